@@ -66,6 +66,8 @@ struct cbox_aux_bus *cbox_aux_bus_load(struct cbox_scene *scene, const char *nam
     p->input_bufs[1] = malloc(8192 * sizeof(float));
     p->output_bufs[0] = malloc(8192 * sizeof(float));
     p->output_bufs[1] = malloc(8192 * sizeof(float));
+    p->input_silent = TRUE;
+    p->output_silent = TRUE;
     CBOX_OBJECT_REGISTER(p);
     cbox_scene_insert_aux_bus(scene, p);
     
@@ -38,6 +38,9 @@ struct cbox_aux_bus
     
     float *input_bufs[2];
     float *output_bufs[2];
+    // TRUE if nothing has been mixed into input_bufs/output_bufs in the
+    // current period
+    gboolean input_silent, output_silent;
 };
 
 extern struct cbox_aux_bus *cbox_aux_bus_load(struct cbox_scene *scene, const char *name, struct cbox_rt *rt, GError **error);
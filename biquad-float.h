@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "config.h"
 #include "dspmath.h"
+#include <stdint.h>
 
 struct cbox_biquadf_state
 {
@@ -294,41 +295,129 @@ static inline void cbox_biquadf_process(struct cbox_biquadf_state *state, struct
 
 #endif
 
+// A biquad applied to both channels of a stereo signal, with the left and
+// right channel in the first two lanes of a vector. The state is copied in
+// by cbox_biquadf_stereo_load and written back by cbox_biquadf_stereo_store,
+// so that it can stay in registers while a block is processed.
+struct cbox_biquadf_stereo
+{
+    cbox_v4sf a0, a1, a2, b1, b2;
+    // per-sample coefficient increments, see cbox_biquadf_stereo_ramp_to
+    cbox_v4sf da0, da1, da2, db1, db2;
+    cbox_v4sf x1, x2, y1, y2;
+    struct cbox_biquadf_state *lstate, *rstate;
+};
+
+static inline void cbox_biquadf_stereo_load(struct cbox_biquadf_stereo *f, struct cbox_biquadf_state *lstate, struct cbox_biquadf_state *rstate, const struct cbox_biquadf_coeffs *coeffs)
+{
+    f->a0 = (cbox_v4sf){coeffs->a0, coeffs->a0, 0.f, 0.f};
+    f->a1 = (cbox_v4sf){coeffs->a1, coeffs->a1, 0.f, 0.f};
+    f->a2 = (cbox_v4sf){coeffs->a2, coeffs->a2, 0.f, 0.f};
+    f->b1 = (cbox_v4sf){coeffs->b1, coeffs->b1, 0.f, 0.f};
+    f->b2 = (cbox_v4sf){coeffs->b2, coeffs->b2, 0.f, 0.f};
+    f->x1 = (cbox_v4sf){lstate->x1, rstate->x1, 0.f, 0.f};
+    f->x2 = (cbox_v4sf){lstate->x2, rstate->x2, 0.f, 0.f};
+    f->y1 = (cbox_v4sf){lstate->y1, rstate->y1, 0.f, 0.f};
+    f->y2 = (cbox_v4sf){lstate->y2, rstate->y2, 0.f, 0.f};
+    f->lstate = lstate;
+    f->rstate = rstate;
+}
+
+static inline cbox_v4sf cbox_biquadf_stereo_run(struct cbox_biquadf_stereo *f, cbox_v4sf in)
+{
+    cbox_v4sf out = f->a0 * in + f->a1 * f->x1 + f->a2 * f->x2 - f->b1 * f->y1 - f->b2 * f->y2;
+    f->x2 = f->x1;
+    f->x1 = in;
+    f->y2 = f->y1;
+    f->y1 = out;
+    return out;
+}
+
+// Makes cbox_biquadf_stereo_run_ramp move the coefficients linearly from
+// the loaded ones to coeffs over the next frames samples
+static inline void cbox_biquadf_stereo_ramp_to(struct cbox_biquadf_stereo *f, const struct cbox_biquadf_coeffs *coeffs, int frames)
+{
+    cbox_v4sf scale = {1.f / frames, 1.f / frames, 0.f, 0.f};
+    f->da0 = ((cbox_v4sf){coeffs->a0, coeffs->a0, 0.f, 0.f} - f->a0) * scale;
+    f->da1 = ((cbox_v4sf){coeffs->a1, coeffs->a1, 0.f, 0.f} - f->a1) * scale;
+    f->da2 = ((cbox_v4sf){coeffs->a2, coeffs->a2, 0.f, 0.f} - f->a2) * scale;
+    f->db1 = ((cbox_v4sf){coeffs->b1, coeffs->b1, 0.f, 0.f} - f->b1) * scale;
+    f->db2 = ((cbox_v4sf){coeffs->b2, coeffs->b2, 0.f, 0.f} - f->b2) * scale;
+}
+
+static inline cbox_v4sf cbox_biquadf_stereo_run_ramp(struct cbox_biquadf_stereo *f, cbox_v4sf in)
+{
+    f->a0 += f->da0;
+    f->a1 += f->da1;
+    f->a2 += f->da2;
+    f->b1 += f->db1;
+    f->b2 += f->db2;
+    return cbox_biquadf_stereo_run(f, in);
+}
+
+static inline void cbox_biquadf_stereo_store(const struct cbox_biquadf_stereo *f)
+{
+    f->lstate->x1 = f->x1[0];
+    f->lstate->x2 = f->x2[0];
+    f->lstate->y1 = sanef(f->y1[0]);
+    f->lstate->y2 = sanef(f->y2[0]);
+    f->rstate->x1 = f->x1[1];
+    f->rstate->x2 = f->x2[1];
+    f->rstate->y1 = sanef(f->y1[1]);
+    f->rstate->y2 = sanef(f->y2[1]);
+}
+
 static inline void cbox_biquadf_process_stereo(struct cbox_biquadf_state *lstate, struct cbox_biquadf_state *rstate, struct cbox_biquadf_coeffs *coeffs, float *buffer)
 {
-    int i;
-    float a0 = coeffs->a0;
-    float a1 = coeffs->a1;
-    float a2 = coeffs->a2;
-    float b1 = coeffs->b1;
-    float b2 = coeffs->b2;
-    double ly1 = lstate->y1;
-    double ly2 = lstate->y2;
-    double ry1 = rstate->y1;
-    double ry2 = rstate->y2;
-    
-    for (i = 0; i < 2 * CBOX_BLOCK_SIZE; i += 2)
+    struct cbox_biquadf_stereo f;
+    cbox_biquadf_stereo_load(&f, lstate, rstate, coeffs);
+    for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i += 2)
     {
-        float inl = buffer[i], inr = buffer[i + 1];
-        float outl = a0 * inl + a1 * lstate->x1 + a2 * lstate->x2 - b1 * ly1 - b2 * ly2;
-        float outr = a0 * inr + a1 * rstate->x1 + a2 * rstate->x2 - b1 * ry1 - b2 * ry2;
-        
-        lstate->x2 = lstate->x1;
-        lstate->x1 = inl;
-        ly2 = ly1;
-        ly1 = outl;
-        buffer[i] = outl;
-
-        rstate->x2 = rstate->x1;
-        rstate->x1 = inr;
-        ry2 = ry1;
-        ry1 = outr;
-        buffer[i + 1] = outr;
+        cbox_v4sf out = cbox_biquadf_stereo_run(&f, (cbox_v4sf){buffer[i], buffer[i + 1], 0.f, 0.f});
+        buffer[i] = out[0];
+        buffer[i + 1] = out[1];
+    }
+    cbox_biquadf_stereo_store(&f);
+}
+
+// A chain of stereo biquads (like the bands of an equaliser), run one after
+// another on each frame. Stages are added with cbox_biquadf_cascade_add,
+// the state is written back at the end of each cbox_biquadf_cascade_process.
+#define CBOX_BIQUADF_CASCADE_MAX_STAGES 16
+
+struct cbox_biquadf_cascade
+{
+    int count;
+    struct cbox_biquadf_stereo stages[CBOX_BIQUADF_CASCADE_MAX_STAGES];
+};
+
+static inline void cbox_biquadf_cascade_init(struct cbox_biquadf_cascade *c)
+{
+    c->count = 0;
+}
+
+static inline void cbox_biquadf_cascade_add(struct cbox_biquadf_cascade *c, struct cbox_biquadf_state *lstate, struct cbox_biquadf_state *rstate, const struct cbox_biquadf_coeffs *coeffs)
+{
+    if (c->count < CBOX_BIQUADF_CASCADE_MAX_STAGES)
+        cbox_biquadf_stereo_load(&c->stages[c->count++], lstate, rstate, coeffs);
+}
+
+// Processes nframes frames, sample i of each channel is at [i * stride]
+// (stride 1 for separate channel buffers, 2 for interleaved ones). Input
+// and output may be the same buffers.
+static inline void cbox_biquadf_cascade_process(struct cbox_biquadf_cascade *c, const float *in_left, const float *in_right, float *out_left, float *out_right, int stride, uint32_t nframes)
+{
+    int count = c->count;
+    for (uint32_t i = 0; i < nframes * stride; i += stride)
+    {
+        cbox_v4sf v = {in_left[i], in_right[i], 0.f, 0.f};
+        for (int s = 0; s < count; s++)
+            v = cbox_biquadf_stereo_run(&c->stages[s], v);
+        out_left[i] = v[0];
+        out_right[i] = v[1];
     }
-    lstate->y2 = sanef(ly2);
-    lstate->y1 = sanef(ly1);
-    rstate->y2 = sanef(ry2);
-    rstate->y1 = sanef(ry1);
+    for (int s = 0; s < count; s++)
+        cbox_biquadf_stereo_store(&c->stages[s]);
 }
 
 static inline double cbox_biquadf_process_sample(struct cbox_biquadf_state *state, struct cbox_biquadf_coeffs *coeffs, double in)
@@ -99,6 +99,9 @@ void chorus_process_block(struct cbox_module *module, cbox_sample_t **inputs, cb
     const int fracbits = 32 - 11;
     const int fracscale = 1 << fracbits;
     
+    // the longest delay used; the LFO goes from 0 to 2
+    m->module.tail_frames = (int)(min_delay + 2 * mod_depth) + 2;
+    
     for (c = 0; c < 2; c++)
     {
         int pos = m->pos;
@@ -95,6 +95,7 @@ void compressor_process_block(struct cbox_module *module, cbox_sample_t **inputs
     }
     
     float threshold = m->params->threshold, invratio = 1.0 / m->params->ratio;
+    float gains[CBOX_BLOCK_SIZE] __attribute__((aligned(16)));
     for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
     {
         float left = inputs[0][i], right = inputs[1][i];
@@ -104,13 +105,22 @@ void compressor_process_block(struct cbox_module *module, cbox_sample_t **inputs
         int rising_fast = sig > 4 * m->tracker.y1 && sig > 4 * m->tracker.x1;
         sig = cbox_onepolef_process_sample(&m->tracker, falling ? &m->release_lp : (rising_fast * m->tracker.y1 ? &m->fast_attack_lp : &m->attack_lp), sig);
         sig = cbox_onepolef_process_sample(&m->tracker2, falling ? &m->release_lp : (rising_fast * m->tracker2.y1 ? &m->fast_attack_lp : &m->attack_lp), sig);
-        float gain = 1.0;
-        if (sig > threshold)
-            gain = threshold * powf(sig / threshold, invratio) / sig;
-        gain *= m->params->makeup;
-                
-        outputs[0][i] = left * gain;
-        outputs[1][i] = right * gain;
+        gains[i] = sig;
+    }
+    // The envelope is recursive, the gain curve isn't - compute it 4 samples
+    // at a time. Below the threshold, the signal is replaced by the threshold,
+    // which gives a gain of exactly 1.
+    cbox_v4sf vthreshold = (cbox_v4sf){} + threshold, vinvratio = (cbox_v4sf){} + invratio;
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i += 4)
+    {
+        cbox_v4sf sig = *(cbox_v4sf *)&gains[i];
+        sig = CBOX_VSELECT(cbox_v4sf, cbox_v4si, sig > vthreshold, sig, vthreshold);
+        *(cbox_v4sf *)&gains[i] = threshold * cbox_fast_powf_v4(sig / threshold, vinvratio) / sig * m->params->makeup;
+    }
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
+    {
+        outputs[0][i] = inputs[0][i] * gains[i];
+        outputs[1][i] = inputs[1][i] * gains[i];
     }
 }
 
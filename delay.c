@@ -74,7 +74,7 @@ void delay_process_event(struct cbox_module *module, const uint8_t *data, uint32
     // struct delay_module *m = (struct delay_module *)module;
 }
 
-void delay_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
+void delay_process_frames(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes)
 {
     struct delay_module *m = (struct delay_module *)module;
     
@@ -84,7 +84,15 @@ void delay_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbo
     float wetamt = m->params->wet_dry;
     float fbamt = m->params->fb_amt;
     
-    for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
+    // the echoes are considered inaudible once they've decayed by 60 dB
+    if (fbamt >= 1.f)
+        m->module.tail_frames = -1;
+    else if (fbamt <= 0.001f)
+        m->module.tail_frames = dv;
+    else
+        m->module.tail_frames = dv * (1 + (int)ceil(log(0.001) / log(fbamt)));
+    
+    for (uint32_t i = 0; i < nframes; i++)
     {
         float dry[2] = { inputs[0][i], inputs[1][i] };
         float *delayed = &m->storage[pos & (MAX_DELAY_LENGTH - 1)][0];
@@ -102,6 +110,11 @@ void delay_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbo
     m->pos = pos;
 }
 
+void delay_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
+{
+    delay_process_frames(module, inputs, outputs, CBOX_BLOCK_SIZE);
+}
+
 MODULE_SIMPLE_DESTROY_FUNCTION(delay)
 
 MODULE_CREATE_FUNCTION(delay)
@@ -119,6 +132,7 @@ MODULE_CREATE_FUNCTION(delay)
     m->params = p;
     m->module.process_event = delay_process_event;
     m->module.process_block = delay_process_block;
+    m->module.process_frames = delay_process_frames;
     m->pos = 0;
     p->time = cbox_config_get_float(cfg_section, "delay", 250);
     p->wet_dry = cbox_config_get_float(cfg_section, "wet_dry", 0.3);
@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define CBOX_BLOCK_SIZE 16
 
 #include <complex.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
 #include <memory.h>
@@ -32,6 +33,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 typedef float cbox_sample_t;
 
+// 4 floats in one SIMD register (GCC vector extension, so it compiles on
+// any architecture - as SSE/NEON code where available)
+typedef float cbox_v4sf __attribute__((vector_size(16)));
+typedef int32_t cbox_v4si __attribute__((vector_size(16)));
+#ifdef __AVX__
+typedef float cbox_v8sf __attribute__((vector_size(32)));
+typedef int32_t cbox_v8si __attribute__((vector_size(32)));
+#endif
+
 struct cbox_sincos
 {
     float sine;
@@ -100,6 +110,79 @@ static inline void copybf(float *to, float *from)
     memcpy(to, from, sizeof(float) * CBOX_BLOCK_SIZE);
 }
 
+// Polynomial approximations of exp2, log2 and pow, 4 (or 8, with AVX) values
+// at a time - per sample gain curves, per voice pitch factors etc. A modern
+// libm is about as fast for single values, so there are no scalar versions.
+// The relative error of exp2 is below 2e-7, the error of log2 is below 2e-7
+// (absolute, or relative for results above 1) - see mathbench.c. Integer
+// powers of 2 are exact.
+//
+// exp2: x = n + f, with n = round(x) and f in [-0.5, 0.5]; 2^f is
+// a polynomial, 2^n is added to the exponent bits. Inputs are clamped to
+// [-125, 127], so that the exponent stays in the normal range.
+#define CBOX_EXP2_P0 1.535336188319500e-4f
+#define CBOX_EXP2_P1 1.339887440266574e-3f
+#define CBOX_EXP2_P2 9.618437357674640e-3f
+#define CBOX_EXP2_P3 5.550332471162809e-2f
+#define CBOX_EXP2_P4 2.402264791363012e-1f
+#define CBOX_EXP2_P5 6.931472028550421e-1f
+
+// log2: x = m * 2^e, with m in [sqrt(0.5), sqrt(2)); log(m) is a polynomial
+// in z = m - 1. Inputs must be positive normal numbers. The exponent is
+// taken relative to sqrt(0.5) (CBOX_LOG_SQRTHALF_BITS), to avoid a branch.
+#define CBOX_LOG_P0 7.0376836292e-2f
+#define CBOX_LOG_P1 -1.1514610310e-1f
+#define CBOX_LOG_P2 1.1676998740e-1f
+#define CBOX_LOG_P3 -1.2420140846e-1f
+#define CBOX_LOG_P4 1.4249322787e-1f
+#define CBOX_LOG_P5 -1.6668057665e-1f
+#define CBOX_LOG_P6 2.0000714765e-1f
+#define CBOX_LOG_P7 -2.4999993993e-1f
+#define CBOX_LOG_P8 3.3333331174e-1f
+#define CBOX_LOG_SQRTHALF_BITS 0x3F3504F3
+
+#define CBOX_EXP2_POLY(f) \
+    ((((((CBOX_EXP2_P0 * (f) + CBOX_EXP2_P1) * (f) + CBOX_EXP2_P2) * (f) + CBOX_EXP2_P3) * (f) + CBOX_EXP2_P4) * (f) + CBOX_EXP2_P5) * (f) + 1.f)
+#define CBOX_LOG_POLY(z) \
+    ((((((((CBOX_LOG_P0 * (z) + CBOX_LOG_P1) * (z) + CBOX_LOG_P2) * (z) + CBOX_LOG_P3) * (z) + CBOX_LOG_P4) * (z) \
+        + CBOX_LOG_P5) * (z) + CBOX_LOG_P6) * (z) + CBOX_LOG_P7) * (z) + CBOX_LOG_P8)
+
+#define CBOX_VSELECT(VT, IT, mask, a, b) ((VT)(((IT)(a) & (mask)) | ((IT)(b) & ~(mask))))
+
+#define CBOX_FAST_MATH_VECTOR(suffix, VT, IT) \
+static inline VT cbox_fast_exp2f_##suffix(VT x) \
+{ \
+    VT lo = (VT){} - 125.f, hi = (VT){} + 127.f; \
+    x = CBOX_VSELECT(VT, IT, x < lo, lo, x); \
+    x = CBOX_VSELECT(VT, IT, x > hi, hi, x); \
+    IT n = __builtin_convertvector(x + 127.5f, IT) - 127; \
+    VT f = x - __builtin_convertvector(n, VT); \
+    return (VT)((IT)CBOX_EXP2_POLY(f) + n * (1 << 23)); \
+} \
+\
+static inline VT cbox_fast_log2f_##suffix(VT x) \
+{ \
+    IT i = (IT)x; \
+    IT e = (i - CBOX_LOG_SQRTHALF_BITS) >> 23; \
+    VT z = (VT)(i - e * (1 << 23)) - 1.f; \
+    VT zz = z * z; \
+    VT ln = z - 0.5f * zz + z * zz * CBOX_LOG_POLY(z); \
+    return __builtin_convertvector(e, VT) + ln * (float)M_LOG2E; \
+} \
+\
+/* x^y for y > 0; x <= 0 (and denormals) give 0 */ \
+static inline VT cbox_fast_powf_##suffix(VT x, VT y) \
+{ \
+    IT tiny = x < 1.17549435e-38f; \
+    VT r = cbox_fast_exp2f_##suffix(y * cbox_fast_log2f_##suffix(x)); \
+    return (VT)((IT)r & ~tiny); \
+}
+
+CBOX_FAST_MATH_VECTOR(v4, cbox_v4sf, cbox_v4si)
+#ifdef __AVX__
+CBOX_FAST_MATH_VECTOR(v8, cbox_v8sf, cbox_v8si)
+#endif
+
 static inline float cent2factor(float cent)
 {
     return powf(2.0, cent * (1.f / 1200.f)); // I think this may be optimised using exp()
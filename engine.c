@@ -167,7 +167,6 @@ static gboolean cbox_engine_process_cmd(struct cbox_command_target *ct, struct c
 void cbox_engine_process(struct cbox_engine *engine, struct cbox_io *io, uint32_t nframes, float **output_buffers)
 {
     struct cbox_module *effect = engine->effect;
-    uint32_t i, j;
     
     cbox_midi_buffer_clear(&engine->midibuf_aux);
     cbox_midi_buffer_clear(&engine->midibuf_song);
@@ -186,25 +185,18 @@ void cbox_engine_process(struct cbox_engine *engine, struct cbox_io *io, uint32_
     if (engine->spb)
         cbox_song_playback_render(engine->spb, &engine->midibuf_song, nframes);
     
+    // The output buffers are zeroed by the I/O code, so they remain silent
+    // unless some scene adds something to them
+    gboolean silent = TRUE;
     for (int i = 0; i < engine->scene_count; i++)
-        cbox_scene_render(engine->scenes[i], nframes, output_buffers);
+    {
+        if (!cbox_scene_render(engine->scenes[i], nframes, output_buffers))
+            silent = FALSE;
+    }
     
     // Process "master" effect
     if (effect)
-    {
-        for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
-        {
-            cbox_sample_t left[CBOX_BLOCK_SIZE], right[CBOX_BLOCK_SIZE];
-            cbox_sample_t *in_bufs[2] = {output_buffers[0] + i, output_buffers[1] + i};
-            cbox_sample_t *out_bufs[2] = {left, right};
-            (*effect->process_block)(effect, in_bufs, out_bufs);
-            for (j = 0; j < CBOX_BLOCK_SIZE; j++)
-            {
-                output_buffers[0][i + j] = left[j];
-                output_buffers[1][i + j] = right[j];
-            }
-        }
-    }
+        cbox_module_process_frames_silent(effect, output_buffers, output_buffers, nframes, silent);
 
 }
 
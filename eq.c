@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "dspmath.h"
 #include "eq.h"
 #include "module.h"
+#include <assert.h>
 #include <glib.h>
 #include <malloc.h>
 #include <math.h>
@@ -98,35 +99,38 @@ void parametric_eq_process_event(struct cbox_module *module, const uint8_t *data
     // struct parametric_eq_module *m = (struct parametric_eq_module *)module;
 }
 
-void parametric_eq_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
+void parametric_eq_process_frames(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes)
 {
     struct parametric_eq_module *m = (struct parametric_eq_module *)module;
     
     if (m->params != m->old_params)
         redo_filters(m);
     
-    for (int c = 0; c < 2; c++)
+    // all active bands are run on both channels in one pass
+    struct cbox_biquadf_cascade cascade;
+    cbox_biquadf_cascade_init(&cascade);
+    for (int i = 0; i < MAX_EQ_BANDS; i++)
     {
-        gboolean first = TRUE;
-        for (int i = 0; i < MAX_EQ_BANDS; i++)
+        if (m->params->bands[i].active)
+            cbox_biquadf_cascade_add(&cascade, &m->state[i][0], &m->state[i][1], &m->coeffs[i]);
+    }
+    if (cascade.count)
+        cbox_biquadf_cascade_process(&cascade, inputs[0], inputs[1], outputs[0], outputs[1], 1, nframes);
+    else
+    {
+        for (int c = 0; c < 2; c++)
         {
-            if (!m->params->bands[i].active)
-                continue;
-            if (first)
-            {
-                cbox_biquadf_process_to(&m->state[i][c], &m->coeffs[i], inputs[c], outputs[c]);
-                first = FALSE;
-            }
-            else
-            {
-                cbox_biquadf_process(&m->state[i][c], &m->coeffs[i], outputs[c]);
-            }
+            if (inputs[c] != outputs[c])
+                memcpy(outputs[c], inputs[c], sizeof(float) * nframes);
         }
-        if (first)
-            memcpy(outputs[c], inputs[c], sizeof(float) * CBOX_BLOCK_SIZE);
     }
 }
 
+void parametric_eq_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
+{
+    parametric_eq_process_frames(module, inputs, outputs, CBOX_BLOCK_SIZE);
+}
+
 float cbox_eq_get_band_param(const char *cfg_section, int band, const char *param, float defvalue)
 {
     gchar *s = g_strdup_printf("band%d_%s", band + 1, param);
@@ -166,6 +170,7 @@ MODULE_CREATE_FUNCTION(parametric_eq)
     CALL_MODULE_INIT(m, 2, 2, parametric_eq);
     m->module.process_event = parametric_eq_process_event;
     m->module.process_block = parametric_eq_process_block;
+    m->module.process_frames = parametric_eq_process_frames;
     struct parametric_eq_params *p = malloc(sizeof(struct parametric_eq_params));
     m->params = p;
     m->old_params = NULL;
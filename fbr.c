@@ -294,24 +294,18 @@ void feedback_reducer_process_block(struct cbox_module *module, cbox_sample_t **
             *m->wrptr++ = inputs[0][i] + inputs[1][i];
         }
     }
-    for (int c = 0; c < 2; c++)
+    struct cbox_biquadf_cascade cascade;
+    cbox_biquadf_cascade_init(&cascade);
+    for (int i = 0; i < MAX_FBR_BANDS; i++)
     {
-        gboolean first = TRUE;
-        for (int i = 0; i < MAX_FBR_BANDS; i++)
-        {
-            if (!m->params->bands[i].active)
-                continue;
-            if (first)
-            {
-                cbox_biquadf_process_to(&m->state[i][c], &m->coeffs[i], inputs[c], outputs[c]);
-                first = FALSE;
-            }
-            else
-            {
-                cbox_biquadf_process(&m->state[i][c], &m->coeffs[i], outputs[c]);
-            }
-        }
-        if (first)
+        if (m->params->bands[i].active)
+            cbox_biquadf_cascade_add(&cascade, &m->state[i][0], &m->state[i][1], &m->coeffs[i]);
+    }
+    if (cascade.count)
+        cbox_biquadf_cascade_process(&cascade, inputs[0], inputs[1], outputs[0], outputs[1], 1, CBOX_BLOCK_SIZE);
+    else
+    {
+        for (int c = 0; c < 2; c++)
             memcpy(outputs[c], inputs[c], sizeof(float) * CBOX_BLOCK_SIZE);
     }
 }
@@ -0,0 +1,149 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Micro-benchmark of the stereo filter code: the vector implementations in
+// biquad-float.h against the scalar left/right code they replaced, for
+// a single filter and for a voice-like chain (2 filters + 3 EQ bands).
+// Not built by default, use "make filterbench".
+
+#include "biquad-float.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_BLOCKS 200000
+#define BENCH_STAGES 5
+
+static void ref_biquadf_process_stereo(struct cbox_biquadf_state *lstate, struct cbox_biquadf_state *rstate, struct cbox_biquadf_coeffs *coeffs, float *buffer)
+{
+    float a0 = coeffs->a0;
+    float a1 = coeffs->a1;
+    float a2 = coeffs->a2;
+    float b1 = coeffs->b1;
+    float b2 = coeffs->b2;
+    double ly1 = lstate->y1;
+    double ly2 = lstate->y2;
+    double ry1 = rstate->y1;
+    double ry2 = rstate->y2;
+
+    for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i += 2)
+    {
+        float inl = buffer[i], inr = buffer[i + 1];
+        float outl = a0 * inl + a1 * lstate->x1 + a2 * lstate->x2 - b1 * ly1 - b2 * ly2;
+        float outr = a0 * inr + a1 * rstate->x1 + a2 * rstate->x2 - b1 * ry1 - b2 * ry2;
+
+        lstate->x2 = lstate->x1;
+        lstate->x1 = inl;
+        ly2 = ly1;
+        ly1 = outl;
+        buffer[i] = outl;
+
+        rstate->x2 = rstate->x1;
+        rstate->x1 = inr;
+        ry2 = ry1;
+        ry1 = outr;
+        buffer[i + 1] = outr;
+    }
+    lstate->y2 = sanef(ly2);
+    lstate->y1 = sanef(ly1);
+    rstate->y2 = sanef(ry2);
+    rstate->y1 = sanef(ry1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill(float *buffer, int block)
+{
+    for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i++)
+        buffer[i] = ((int)((block * 2u * CBOX_BLOCK_SIZE + i) * 7919u % 2001) - 1000) * 0.001f;
+}
+
+static void report(const char *name, double ref_time, double new_time, float ref_sum, float new_sum)
+{
+    double frames = (double)BENCH_BLOCKS * CBOX_BLOCK_SIZE;
+    printf("%-24s scalar %6.2f ns/frame, vector %6.2f ns/frame, speedup %.2fx (checksums %g %g)\n",
+        name, ref_time * 1e9 / frames, new_time * 1e9 / frames, ref_time / new_time, ref_sum, new_sum);
+}
+
+int main(int argc, char *argv[])
+{
+    struct cbox_biquadf_coeffs coeffs[BENCH_STAGES];
+    struct cbox_biquadf_state lstate[BENCH_STAGES], rstate[BENCH_STAGES];
+    float buffer[2 * CBOX_BLOCK_SIZE];
+    float ref_sum = 0, new_sum = 0;
+    double t;
+
+    cbox_biquadf_set_lp_rbj(&coeffs[0], 2000, 2, 44100);
+    cbox_biquadf_set_lp_rbj(&coeffs[1], 2000, 2, 44100);
+    cbox_biquadf_set_peakeq_rbj(&coeffs[2], 100, 0.7, 2, 44100);
+    cbox_biquadf_set_peakeq_rbj(&coeffs[3], 1000, 0.7, 0.5, 44100);
+    cbox_biquadf_set_peakeq_rbj(&coeffs[4], 8000, 0.7, 2, 44100);
+
+    for (int s = 0; s < BENCH_STAGES; s++)
+        cbox_biquadf_reset(&lstate[s]), cbox_biquadf_reset(&rstate[s]);
+    t = now();
+    for (int b = 0; b < BENCH_BLOCKS; b++)
+    {
+        fill(buffer, b);
+        ref_biquadf_process_stereo(&lstate[0], &rstate[0], &coeffs[0], buffer);
+        ref_sum += buffer[0];
+    }
+    double ref_time = now() - t;
+    for (int s = 0; s < BENCH_STAGES; s++)
+        cbox_biquadf_reset(&lstate[s]), cbox_biquadf_reset(&rstate[s]);
+    t = now();
+    for (int b = 0; b < BENCH_BLOCKS; b++)
+    {
+        fill(buffer, b);
+        cbox_biquadf_process_stereo(&lstate[0], &rstate[0], &coeffs[0], buffer);
+        new_sum += buffer[0];
+    }
+    report("single biquad", ref_time, now() - t, ref_sum, new_sum);
+
+    ref_sum = new_sum = 0;
+    for (int s = 0; s < BENCH_STAGES; s++)
+        cbox_biquadf_reset(&lstate[s]), cbox_biquadf_reset(&rstate[s]);
+    t = now();
+    for (int b = 0; b < BENCH_BLOCKS; b++)
+    {
+        fill(buffer, b);
+        for (int s = 0; s < BENCH_STAGES; s++)
+            ref_biquadf_process_stereo(&lstate[s], &rstate[s], &coeffs[s], buffer);
+        ref_sum += buffer[0];
+    }
+    ref_time = now() - t;
+    for (int s = 0; s < BENCH_STAGES; s++)
+        cbox_biquadf_reset(&lstate[s]), cbox_biquadf_reset(&rstate[s]);
+    t = now();
+    for (int b = 0; b < BENCH_BLOCKS; b++)
+    {
+        struct cbox_biquadf_cascade cascade;
+        fill(buffer, b);
+        cbox_biquadf_cascade_init(&cascade);
+        for (int s = 0; s < BENCH_STAGES; s++)
+            cbox_biquadf_cascade_add(&cascade, &lstate[s], &rstate[s], &coeffs[s]);
+        cbox_biquadf_cascade_process(&cascade, buffer, buffer + 1, buffer, buffer + 1, 2, CBOX_BLOCK_SIZE);
+        new_sum += buffer[0];
+    }
+    report("5-stage cascade", ref_time, now() - t, ref_sum, new_sum);
+    return 0;
+}
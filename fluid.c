@@ -43,6 +43,7 @@ GQuark cbox_fluidsynth_error_quark(void)
 }
 
 static void fluidsynth_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs);
+static void fluidsynth_process_frames(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes);
 static void fluidsynth_process_event(struct cbox_module *module, const uint8_t *data, uint32_t len);
 static gboolean fluidsynth_process_cmd(struct cbox_command_target *ct, struct cbox_command_target *fb, struct cbox_osc_command *cmd, GError **error);
 static void fluidsynth_destroyfunc(struct cbox_module *module);
@@ -121,6 +122,7 @@ MODULE_CREATE_FUNCTION(fluidsynth)
     }
     m->module.process_event = fluidsynth_process_event;
     m->module.process_block = fluidsynth_process_block;
+    m->module.process_frames = fluidsynth_process_frames;
     m->module.aux_offset = 2 * m->output_pairs;
     m->settings = new_fluid_settings();
     fluid_settings_setnum(m->settings, "synth.sample-rate", m->module.srate);
@@ -168,10 +170,15 @@ MODULE_CREATE_FUNCTION(fluidsynth)
 }
 
 void fluidsynth_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
+{
+    fluidsynth_process_frames(module, inputs, outputs, CBOX_BLOCK_SIZE);
+}
+
+void fluidsynth_process_frames(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes)
 {
     struct fluidsynth_module *m = (struct fluidsynth_module *)module;
     if (!m->is_multi)
-        fluid_synth_write_float(m->synth, CBOX_BLOCK_SIZE, outputs[0], 0, 1, outputs[1], 0, 1);
+        fluid_synth_write_float(m->synth, nframes, outputs[0], 0, 1, outputs[1], 0, 1);
     else
     {
         for (int i = 0; i < 2 + m->output_pairs; i++)
@@ -180,7 +187,7 @@ void fluidsynth_process_block(struct cbox_module *module, cbox_sample_t **inputs
             m->right_outputs[i] = outputs[2 * i + 1];
         }
         
-        fluid_synth_nwrite_float(m->synth, CBOX_BLOCK_SIZE, m->left_outputs, m->right_outputs, m->left_outputs + m->output_pairs, m->right_outputs + m->output_pairs);
+        fluid_synth_nwrite_float(m->synth, nframes, m->left_outputs, m->right_outputs, m->left_outputs + m->output_pairs, m->right_outputs + m->output_pairs);
     }
 }
 
@@ -98,6 +98,8 @@ void gate_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox
     
     float threshold = m->params->threshold;
     float threshold2 = threshold * threshold * 1.73;
+    float sigs[CBOX_BLOCK_SIZE] __attribute__((aligned(16)));
+    float release_gains[CBOX_BLOCK_SIZE] __attribute__((aligned(16)));
     for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
     {
         float left = inputs[0][i], right = inputs[1][i];
@@ -106,7 +108,18 @@ void gate_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox
         // Primitive envelope detector - may not work so well with more interesting stereo signals
         float shf1 = cbox_onepolef_process_sample(&m->shifter1, &m->shifter_lp, 0.5 * (left + right));
         float shf2 = cbox_onepolef_process_sample(&m->shifter2, &m->shifter_lp, shf1);
-        sig = sig*sig + shf1*shf1 + shf2 * shf2;
+        sigs[i] = sig*sig + shf1*shf1 + shf2 * shf2;
+    }
+    // Release gain for every sample, 4 at a time - it's only used when below
+    // the threshold, so the values above it don't matter.
+    cbox_v4sf vexponent = (cbox_v4sf){} + 0.5f * (m->params->ratio - 1);
+    // gain = powf(sqrt(sig) / threshold, (m->params->ratio - 1));
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i += 4)
+        *(cbox_v4sf *)&release_gains[i] = cbox_fast_powf_v4(*(cbox_v4sf *)&sigs[i] / threshold2, vexponent);
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
+    {
+        float left = inputs[0][i], right = inputs[1][i];
+        float sig = sigs[i];
         
         // attack - hold - release logic based on signal envelope
         int release = 1;
@@ -115,10 +128,7 @@ void gate_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox
         {
             // hold vs release
             if (m->hold_time >= m->hold_threshold)
-            {
-                gain = powf(sig / threshold2, 0.5 * (m->params->ratio - 1));
-                // gain = powf(sqrt(sig) / threshold, (m->params->ratio - 1));
-            }
+                gain = release_gains[i];
             else
                 m->hold_time++;
         }
@@ -228,6 +228,9 @@ void cbox_instrument_output_init(struct cbox_instrument_output *output, struct c
     output->insert = NULL;
     output->output_bus = 0;
     output->gain = 1.0;
+    output->buffers[0] = malloc(max_numsamples * sizeof(float));
+    output->buffers[1] = malloc(max_numsamples * sizeof(float));
+    output->buffers_silent = TRUE;
 }
 
 
@@ -235,6 +238,8 @@ void cbox_instrument_output_uninit(struct cbox_instrument_output *output)
 {
     cbox_recording_source_uninit(&output->rec_dry);
     cbox_recording_source_uninit(&output->rec_wet);
+    free(output->buffers[0]);
+    free(output->buffers[1]);
     if (output->insert)
     {
         CBOX_DELETE(output->insert);
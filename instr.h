@@ -34,6 +34,9 @@ struct cbox_instrument_output
     int output_bus;
     float gain;
     struct cbox_recording_source rec_dry, rec_wet;
+    // post-insert output of the whole period, used by parallel scene render
+    float *buffers[2];
+    gboolean buffers_silent;
 };
 
 struct cbox_instrument
@@ -87,6 +87,8 @@ void limiter_process_block(struct cbox_module *module, cbox_sample_t **inputs, c
         // update calculated values
     }
     const double minval = pow(2.0, -110.0);
+    float levels[CBOX_BLOCK_SIZE] __attribute__((aligned(16)));
+    float gains[CBOX_BLOCK_SIZE] __attribute__((aligned(16)));
     for (int i = 0; i < CBOX_BLOCK_SIZE; ++i)
     {
         float left = inputs[0][i], right = inputs[1][i];
@@ -96,8 +98,14 @@ void limiter_process_block(struct cbox_module *module, cbox_sample_t **inputs, c
             level = fabs(right);
         if (level < minval)
             level = minval;
-        level = log(level);
-        
+        levels[i] = level;
+    }
+    // log and exp 4 samples at a time, only the gain smoothing is recursive
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i += 4)
+        *(cbox_v4sf *)&levels[i] = cbox_fast_log2f_v4(*(cbox_v4sf *)&levels[i]) * (float)M_LN2;
+    for (int i = 0; i < CBOX_BLOCK_SIZE; ++i)
+    {
+        float level = levels[i];
         float gain = 0.0;
         
         if (level > mp->threshold * 0.11552)
@@ -109,12 +117,18 @@ void limiter_process_block(struct cbox_module *module, cbox_sample_t **inputs, c
         else
             m->cur_gain += m->atk_coeff * (gain - m->cur_gain);
         
-        gain = exp(m->cur_gain);
+        gains[i] = m->cur_gain;
+    }
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i += 4)
+        *(cbox_v4sf *)&gains[i] = cbox_fast_exp2f_v4(*(cbox_v4sf *)&gains[i] * (float)M_LOG2E);
+    for (int i = 0; i < CBOX_BLOCK_SIZE; ++i)
+    {
+        float gain = gains[i];
         //if (gain < 1)
         //    printf("level = %f gain = %f\n", m->cur_level, gain);
         
-        outputs[0][i] = left * gain;
-        outputs[1][i] = right * gain;
+        outputs[0][i] = inputs[0][i] * gain;
+        outputs[1][i] = inputs[1][i] * gain;
     }
 }
 
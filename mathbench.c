@@ -0,0 +1,261 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Accuracy check and micro-benchmark of the exp2/log2/pow approximations in
+// dspmath.h. The errors of the scalar versions below (the same algorithms,
+// one value at a time) are measured against double precision libm, and the
+// batch versions must match them to within a few ulps. Returns a non-zero
+// exit code if any of the error bounds is exceeded.
+// Not built by default, use "make mathbench". It is compiled without
+// auto-vectorisation, as the call sites are per-sample loops with state -
+// otherwise the compiler would use libmvec for the libm loops here.
+
+#include "dspmath.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_SIZE 4096
+#define BENCH_PASSES 5000
+
+#define EXP2_MAX_ERROR 2e-7
+#define LOG2_MAX_ERROR 2e-7
+#define POW_MAX_ERROR 5e-6
+#define VECTOR_MAX_ERROR 1e-6
+
+static float inputs[BENCH_SIZE] __attribute__((aligned(32)));
+static float inputs2[BENCH_SIZE] __attribute__((aligned(32)));
+static float outputs[BENCH_SIZE] __attribute__((aligned(32)));
+
+// Reference versions of the batch functions in dspmath.h
+static inline float scalar_fast_exp2f(float x)
+{
+    if (x < -125.f)
+        x = -125.f;
+    if (x > 127.f)
+        x = 127.f;
+    // x + 127.5 is positive, so the conversion rounds down
+    int32_t n = (int32_t)(x + 127.5f) - 127;
+    float f = x - n;
+    union { float f; int32_t i; } u = { .f = CBOX_EXP2_POLY(f) };
+    u.i += n * (1 << 23);
+    return u.f;
+}
+
+static inline float scalar_fast_log2f(float x)
+{
+    union { float f; int32_t i; } u = { .f = x };
+    int32_t e = (u.i - CBOX_LOG_SQRTHALF_BITS) >> 23;
+    u.i -= e * (1 << 23);
+    float z = u.f - 1.f;
+    float zz = z * z;
+    float ln = z - 0.5f * zz + z * zz * CBOX_LOG_POLY(z);
+    return e + ln * (float)M_LOG2E;
+}
+
+// x^y for y > 0; x <= 0 (and denormals) give 0
+static inline float scalar_fast_powf(float x, float y)
+{
+    if (x < 1.17549435e-38f)
+        return 0.f;
+    return scalar_fast_exp2f(y * scalar_fast_log2f(x));
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int check(const char *name, double max_error, double limit)
+{
+    int ok = max_error < limit;
+    printf("%-6s max error %.3g (limit %.3g) %s\n", name, max_error, limit, ok ? "OK" : "FAILED");
+    return ok;
+}
+
+static int mismatch(float vector_value, float scalar_value)
+{
+    return fabs(vector_value - scalar_value) > VECTOR_MAX_ERROR * (fabs(scalar_value) > 1 ? fabs(scalar_value) : 1);
+}
+
+static int check_vector(const char *name, int mismatches)
+{
+    printf("%-6s %d batch results differ from scalar ones %s\n", name, mismatches, mismatches ? "FAILED" : "OK");
+    return !mismatches;
+}
+
+static int test_accuracy(void)
+{
+    double exp2_error = 0, log2_error = 0, pow_error = 0;
+    int mismatches = 0;
+    int ok = 1;
+
+    for (double x = -125; x <= 127; x += 1.0 / 4096)
+    {
+        float r = scalar_fast_exp2f(x);
+        double ref = exp2((float)x);
+        double err = fabs(r - ref) / ref;
+        if (err > exp2_error)
+            exp2_error = err;
+    }
+    ok = check("exp2", exp2_error, EXP2_MAX_ERROR) && ok;
+
+    // absolute error for results below 1, relative above
+    for (double lx = -125; lx < 127; lx += 1.0 / 4096)
+    {
+        float x = exp2(lx);
+        double ref = log2((double)x);
+        double err = fabs(scalar_fast_log2f(x) - ref) / (fabs(ref) > 1 ? fabs(ref) : 1);
+        if (err > log2_error)
+            log2_error = err;
+    }
+    ok = check("log2", log2_error, LOG2_MAX_ERROR) && ok;
+
+    // the range used by the dynamics processors
+    for (double x = 0.001; x < 16; x *= 1.001)
+    {
+        for (double y = 0.05; y < 4; y += 0.05)
+        {
+            double ref = pow((float)x, (float)y);
+            double err = fabs(scalar_fast_powf(x, y) - ref) / ref;
+            if (err > pow_error)
+                pow_error = err;
+        }
+    }
+    ok = check("pow", pow_error, POW_MAX_ERROR) && ok;
+
+    for (int i = 0; i < BENCH_SIZE; i += 4)
+    {
+        cbox_v4sf x = *(cbox_v4sf *)&inputs[i], y = *(cbox_v4sf *)&inputs2[i];
+        cbox_v4sf e = cbox_fast_exp2f_v4(y), l = cbox_fast_log2f_v4(x), p = cbox_fast_powf_v4(x, y);
+        for (int j = 0; j < 4; j++)
+        {
+            mismatches += mismatch(e[j], scalar_fast_exp2f(inputs2[i + j]));
+            mismatches += mismatch(l[j], scalar_fast_log2f(inputs[i + j]));
+            mismatches += mismatch(p[j], scalar_fast_powf(inputs[i + j], inputs2[i + j]));
+        }
+    }
+    ok = check_vector("v4", mismatches) && ok;
+#ifdef __AVX__
+    mismatches = 0;
+    for (int i = 0; i < BENCH_SIZE; i += 8)
+    {
+        cbox_v8sf x = *(cbox_v8sf *)&inputs[i], y = *(cbox_v8sf *)&inputs2[i];
+        cbox_v8sf e = cbox_fast_exp2f_v8(y), l = cbox_fast_log2f_v8(x), p = cbox_fast_powf_v8(x, y);
+        for (int j = 0; j < 8; j++)
+        {
+            mismatches += mismatch(e[j], scalar_fast_exp2f(inputs2[i + j]));
+            mismatches += mismatch(l[j], scalar_fast_log2f(inputs[i + j]));
+            mismatches += mismatch(p[j], scalar_fast_powf(inputs[i + j], inputs2[i + j]));
+        }
+    }
+    ok = check_vector("v8", mismatches) && ok;
+#endif
+    return ok;
+}
+
+#define BENCH_LOOP(expr) \
+    do { \
+        t = now(); \
+        for (int p = 0; p < BENCH_PASSES; p++) \
+        { \
+            for (int i = 0; i < BENCH_SIZE; i++) \
+                outputs[i] = (expr); \
+            sum += outputs[p % BENCH_SIZE]; \
+        } \
+        t = now() - t; \
+    } while(0)
+
+#define BENCH_LOOP_VECTOR(VT, lanes, expr) \
+    do { \
+        t = now(); \
+        for (int p = 0; p < BENCH_PASSES; p++) \
+        { \
+            for (int i = 0; i < BENCH_SIZE; i += lanes) \
+            { \
+                VT x = *(VT *)&inputs[i], y = *(VT *)&inputs2[i]; \
+                (void)x, (void)y; \
+                *(VT *)&outputs[i] = (expr); \
+            } \
+            sum += outputs[p % BENCH_SIZE]; \
+        } \
+        t = now() - t; \
+    } while(0)
+
+static void report(const char *name, double ref_time, double new_time)
+{
+    double values = (double)BENCH_PASSES * BENCH_SIZE;
+    printf("%-20s libm %6.2f ns/value, fast %6.2f ns/value, speedup %.2fx\n",
+        name, ref_time * 1e9 / values, new_time * 1e9 / values, ref_time / new_time);
+}
+
+static void benchmark(void)
+{
+    double t, ref;
+    float sum = 0;
+
+    BENCH_LOOP(exp2f(inputs2[i]));
+    ref = t;
+    BENCH_LOOP(scalar_fast_exp2f(inputs2[i]));
+    report("exp2", ref, t);
+    BENCH_LOOP_VECTOR(cbox_v4sf, 4, cbox_fast_exp2f_v4(y));
+    report("exp2 (v4)", ref, t);
+#ifdef __AVX__
+    BENCH_LOOP_VECTOR(cbox_v8sf, 8, cbox_fast_exp2f_v8(y));
+    report("exp2 (v8)", ref, t);
+#endif
+
+    BENCH_LOOP(log2f(inputs[i]));
+    ref = t;
+    BENCH_LOOP(scalar_fast_log2f(inputs[i]));
+    report("log2", ref, t);
+    BENCH_LOOP_VECTOR(cbox_v4sf, 4, cbox_fast_log2f_v4(x));
+    report("log2 (v4)", ref, t);
+#ifdef __AVX__
+    BENCH_LOOP_VECTOR(cbox_v8sf, 8, cbox_fast_log2f_v8(x));
+    report("log2 (v8)", ref, t);
+#endif
+
+    BENCH_LOOP(powf(inputs[i], inputs2[i]));
+    ref = t;
+    BENCH_LOOP(scalar_fast_powf(inputs[i], inputs2[i]));
+    report("pow", ref, t);
+    BENCH_LOOP_VECTOR(cbox_v4sf, 4, cbox_fast_powf_v4(x, y));
+    report("pow (v4)", ref, t);
+#ifdef __AVX__
+    BENCH_LOOP_VECTOR(cbox_v8sf, 8, cbox_fast_powf_v8(x, y));
+    report("pow (v8)", ref, t);
+#endif
+
+    printf("(checksum %g)\n", sum);
+}
+
+int main(int argc, char *argv[])
+{
+    // positive values for log2/pow, a few octaves either way for exp2
+    for (int i = 0; i < BENCH_SIZE; i++)
+    {
+        inputs[i] = 0.001f + (i * 7919 % BENCH_SIZE) * (10.f / BENCH_SIZE);
+        inputs2[i] = ((i * 104729 % BENCH_SIZE) - BENCH_SIZE / 2) * (8.f / BENCH_SIZE);
+    }
+
+    int ok = test_accuracy();
+    benchmark();
+    return ok ? 0 : 1;
+}
@@ -141,16 +141,69 @@ void cbox_module_init(struct cbox_module *module, struct cbox_document *doc, str
     module->outputs = outputs;
     module->aux_offset = outputs;
     module->bypass = 0;
+    module->output_silent = FALSE;
+    module->tail_frames = -1;
+    module->silent_input_frames = 0;
     module->srate = engine->io_env.srate;
     module->srate_inv = 1.0 / module->srate;
     
     cbox_command_target_init(&module->cmd_target, cmd_handler, module);
     module->process_event = NULL;
     module->process_block = NULL;
+    module->process_frames = NULL;
     module->destroy = destroy;
     CBOX_OBJECT_REGISTER(module);
 }
 
+// Process nframes of audio, in one call if the module supports that, or in
+// CBOX_BLOCK_SIZE chunks otherwise (in which case nframes must be a multiple
+// of CBOX_BLOCK_SIZE). Inputs may be NULL for modules that take no input.
+void cbox_module_process_frames(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes)
+{
+    module->output_silent = FALSE;
+    if (module->process_frames)
+    {
+        module->process_frames(module, inputs, outputs, nframes);
+        return;
+    }
+    assert(!(nframes % CBOX_BLOCK_SIZE));
+    cbox_sample_t *block_inputs[CBOX_MAX_AUDIO_PORTS], *block_outputs[CBOX_MAX_AUDIO_PORTS];
+    gboolean silent = TRUE;
+    for (uint32_t i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
+    {
+        if (inputs)
+        {
+            for (int c = 0; c < module->inputs; c++)
+                block_inputs[c] = inputs[c] + i;
+        }
+        for (int c = 0; c < module->outputs; c++)
+            block_outputs[c] = outputs[c] + i;
+        module->output_silent = FALSE;
+        module->process_block(module, inputs ? block_inputs : NULL, block_outputs);
+        silent = silent && module->output_silent;
+    }
+    module->output_silent = silent;
+}
+
+// Process an effect, skipping it altogether if the input is silent and has
+// been for longer than the module's tail. Returns TRUE if the output is known
+// to be silent.
+gboolean cbox_module_process_frames_silent(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes, gboolean input_silent)
+{
+    if (input_silent && module->tail_frames >= 0 && module->silent_input_frames >= (uint32_t)module->tail_frames)
+    {
+        for (int c = 0; c < module->outputs; c++)
+            memset(outputs[c], 0, nframes * sizeof(float));
+        return TRUE;
+    }
+    cbox_module_process_frames(module, inputs, outputs, nframes);
+    if (!input_silent)
+        module->silent_input_frames = 0;
+    else if (module->silent_input_frames < (uint32_t)G_MAXINT32)
+        module->silent_input_frames += nframes;
+    return module->output_silent;
+}
+
 struct cbox_module *cbox_module_new_from_fx_preset(const char *name, struct cbox_document *doc, struct cbox_rt *rt, struct cbox_engine *engine, GError **error)
 {
     gchar *section = g_strdup_printf("fxpreset:%s", name);
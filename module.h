@@ -76,6 +76,14 @@ struct cbox_module
     struct cbox_midi_buffer midi_input;
     int inputs, outputs, aux_offset;
     int bypass;
+    // Set by modules that can tell when the last processed frames were all
+    // silent; cleared by cbox_module_process_frames before each call
+    gboolean output_silent;
+    // Number of frames of output after the input becomes silent, -1 if
+    // unknown/infinite (the module is never skipped then)
+    int tail_frames;
+    // Number of consecutive silent input frames processed so far
+    uint32_t silent_input_frames;
     int srate;
     double srate_inv;
     
@@ -83,6 +91,9 @@ struct cbox_module
         
     void (*process_event)(struct cbox_module *module, const uint8_t *data, uint32_t len);
     void (*process_block)(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs);
+    // Optional - processes any number of frames (not necessarily a multiple
+    // of CBOX_BLOCK_SIZE) in one call; NULL if only process_block is supported
+    void (*process_frames)(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes);
     void (*destroy)(struct cbox_module *module);
 };
 
@@ -127,6 +138,8 @@ extern struct cbox_module *cbox_module_manifest_create_module(struct cbox_module
 extern struct cbox_module *cbox_module_new_from_fx_preset(const char *name, struct cbox_document *doc, struct cbox_rt *rt, struct cbox_engine *engine, GError **error);
 
 extern void cbox_module_init(struct cbox_module *module, struct cbox_document *doc, struct cbox_rt *rt, struct cbox_engine *engine, void *user_data, int inputs, int outputs, cbox_process_cmd cmd_handler, void (*destroy)(struct cbox_module *module));
+extern void cbox_module_process_frames(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes);
+extern gboolean cbox_module_process_frames_silent(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes, gboolean input_silent);
 extern void cbox_module_swap_pointers_and_free(struct cbox_module *sm, void **pptr, void *value);
 
 extern gboolean cbox_module_slot_process_cmd(struct cbox_module **psm, struct cbox_command_target *fb, struct cbox_osc_command *cmd, const char *subcmd, struct cbox_document *doc, struct cbox_rt *rt, struct cbox_engine *engine, GError **error);
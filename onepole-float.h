@@ -153,34 +153,53 @@ static inline void cbox_onepolef_process(struct cbox_onepolef_state *state, stru
 }
 #endif
 
+// Stereo one-pole filter with the channels in vector lanes, see
+// struct cbox_biquadf_stereo
+struct cbox_onepolef_stereo
+{
+    cbox_v4sf a0, a1, b1;
+    cbox_v4sf x1, y1;
+    struct cbox_onepolef_state *lstate, *rstate;
+};
+
+static inline void cbox_onepolef_stereo_load(struct cbox_onepolef_stereo *f, struct cbox_onepolef_state *lstate, struct cbox_onepolef_state *rstate, const struct cbox_onepolef_coeffs *coeffs)
+{
+    f->a0 = (cbox_v4sf){coeffs->a0, coeffs->a0, 0.f, 0.f};
+    f->a1 = (cbox_v4sf){coeffs->a1, coeffs->a1, 0.f, 0.f};
+    f->b1 = (cbox_v4sf){coeffs->b1, coeffs->b1, 0.f, 0.f};
+    f->x1 = (cbox_v4sf){lstate->x1, rstate->x1, 0.f, 0.f};
+    f->y1 = (cbox_v4sf){lstate->y1, rstate->y1, 0.f, 0.f};
+    f->lstate = lstate;
+    f->rstate = rstate;
+}
+
+static inline cbox_v4sf cbox_onepolef_stereo_run(struct cbox_onepolef_stereo *f, cbox_v4sf in)
+{
+    cbox_v4sf out = f->a0 * in + f->a1 * f->x1 - f->b1 * f->y1;
+    f->x1 = in;
+    f->y1 = out;
+    return out;
+}
+
+static inline void cbox_onepolef_stereo_store(const struct cbox_onepolef_stereo *f)
+{
+    f->lstate->x1 = f->x1[0];
+    f->lstate->y1 = sanef(f->y1[0]);
+    f->rstate->x1 = f->x1[1];
+    f->rstate->y1 = sanef(f->y1[1]);
+}
+
 static inline void cbox_onepolef_process_stereo(struct cbox_onepolef_state *lstate, struct cbox_onepolef_state *rstate, struct cbox_onepolef_coeffs *coeffs, float *buffer)
 {
-    int i;
-    float a0 = coeffs->a0;
-    float a1 = coeffs->a1;
-    float b1 = coeffs->b1;
-    float lx1 = lstate->x1;
-    float ly1 = lstate->y1;
-    float rx1 = rstate->x1;
-    float ry1 = rstate->y1;
-    
-    for (i = 0; i < 2 * CBOX_BLOCK_SIZE; i += 2)
+    struct cbox_onepolef_stereo f;
+    cbox_onepolef_stereo_load(&f, lstate, rstate, coeffs);
+    for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i += 2)
     {
-        float inl = buffer[i], inr = buffer[i + 1];
-        double outl = a0 * inl + a1 * lx1 - b1 * ly1;
-        double outr = a0 * inr + a1 * rx1 - b1 * ry1;
-        
-        buffer[i] = outl;
-        buffer[i + 1] = outr;
-        lx1 = inl;
-        ly1 = outl;
-        rx1 = inr;
-        ry1 = outr;
+        cbox_v4sf out = cbox_onepolef_stereo_run(&f, (cbox_v4sf){buffer[i], buffer[i + 1], 0.f, 0.f});
+        buffer[i] = out[0];
+        buffer[i + 1] = out[1];
     }
-    lstate->x1 = lx1;
-    lstate->y1 = sanef(ly1);
-    rstate->x1 = rx1;
-    rstate->y1 = sanef(ry1);
+    cbox_onepolef_stereo_store(&f);
 }
 
 static inline void cbox_onepolef_process_to(struct cbox_onepolef_state *state, struct cbox_onepolef_coeffs *coeffs, float *buffer_in, float *buffer_out)
@@ -19,45 +19,311 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "prefetch_pipe.h"
 #include "tarfile.h"
 #include "wavebank.h"
+#include "wavepack.h"
+#include "workerpool.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <malloc.h>
 #include <memory.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-// Don't bother fetching less than 4 (mono) or 8 KB (stereo)
-#define PIPE_MIN_PREFETCH_SIZE_FRAMES 2048
+// Don't bother fetching less than that, whatever the consumption rate
+#define PIPE_MIN_PREFETCH_SIZE_FRAMES 256
+#define PREFETCH_MIN_BUFFER_SIZE 16384
+// Granularity of buffer allocation. A single chunk is a minimum size buffer,
+// so the chunks held back for the pipes without a buffer can't be made
+// unusable by fragmentation.
+#define PREFETCH_SLAB_CHUNK_SIZE PREFETCH_MIN_BUFFER_SIZE
+// Largest buffer for a single pipe, as a multiple of streambuf_size
+#define PREFETCH_MAX_BUFFER_SCALE 4
+// The prefetch thread is normally woken up by the consumers, this is only
+// a safety net (and the resolution of consumption rate estimates for pipes
+// that don't need refilling)
+#define PREFETCH_MAX_SLEEP_US 10000
 
-void cbox_prefetch_pipe_init(struct cbox_prefetch_pipe *pipe, uint32_t buffer_size)
+///////////////////////////////////////////////////////////////////////////////
+
+static gboolean sndfile_io_open(struct cbox_prefetch_pipe *pipe)
+{
+    if (pipe->waveform->taritem)
+        pipe->sndfile = cbox_tarfile_opensndfile(pipe->waveform->tarfile, pipe->waveform->taritem, &pipe->sndstream, &pipe->info);
+    else
+        pipe->sndfile = sf_open(pipe->waveform->canonical_name, SFM_READ, &pipe->info);
+    return pipe->sndfile != NULL;
+}
+
+static int32_t sndfile_io_read(struct cbox_prefetch_pipe *pipe, void *dest, uint32_t pos, uint32_t frames)
+{
+    if (sf_seek(pipe->sndfile, 0, SEEK_CUR) != pos)
+        sf_seek(pipe->sndfile, pos, SEEK_SET);
+    return cbox_waveform_read_frames(pipe->sndfile, pipe->waveform->format, pipe->info.channels, dest, frames);
+}
+
+static void sndfile_io_close(struct cbox_prefetch_pipe *pipe)
+{
+    sf_close(pipe->sndfile);
+    pipe->sndfile = NULL;
+}
+
+const struct cbox_prefetch_io_backend cbox_prefetch_io_sndfile = {
+    .name = "sndfile",
+    .open = sndfile_io_open,
+    .read = sndfile_io_read,
+    .close = sndfile_io_close,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+static gboolean pread_io_open(struct cbox_prefetch_pipe *pipe)
+{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    struct cbox_waveform *waveform = pipe->waveform;
+    uint64_t offset, size;
+    if (waveform->format != csf_int16)
+        return FALSE;
+    if (waveform->taritem)
+    {
+        // pread doesn't move the file pointer, so the archive's descriptor
+        // can be shared
+        pipe->fd = waveform->tarfile->fd;
+        pipe->own_fd = FALSE;
+        offset = waveform->taritem->offset;
+        size = waveform->taritem->size;
+    }
+    else
+    {
+        struct stat st;
+        pipe->fd = open(waveform->canonical_name, O_RDONLY);
+        if (pipe->fd == -1)
+            return FALSE;
+        pipe->own_fd = TRUE;
+        if (fstat(pipe->fd, &st) == -1)
+        {
+            close(pipe->fd);
+            return FALSE;
+        }
+        offset = 0;
+        size = st.st_size;
+    }
+    memset(&pipe->info, 0, sizeof(pipe->info));
+    if (cbox_waveform_find_pcm16_data(pipe->fd, offset, size, &pipe->info, &pipe->data_offset) && pipe->info.channels == waveform->info.channels)
+        return TRUE;
+    if (pipe->own_fd)
+        close(pipe->fd);
+#endif
+    return FALSE;
+}
+
+static int32_t pread_io_read(struct cbox_prefetch_pipe *pipe, void *dest, uint32_t pos, uint32_t frames)
+{
+    size_t frame_size = pipe->frame_size;
+    ssize_t result;
+    do {
+        result = pread(pipe->fd, dest, frames * frame_size, pipe->data_offset + (uint64_t)pos * frame_size);
+    } while(result == -1 && errno == EINTR);
+    if (result <= 0)
+        return 0;
+    return result / frame_size;
+}
+
+static void pread_io_close(struct cbox_prefetch_pipe *pipe)
+{
+    if (pipe->own_fd)
+        close(pipe->fd);
+    pipe->fd = -1;
+}
+
+const struct cbox_prefetch_io_backend cbox_prefetch_io_pread = {
+    .name = "pread",
+    .open = pread_io_open,
+    .read = pread_io_read,
+    .close = pread_io_close,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+static gboolean wavepack_io_open(struct cbox_prefetch_pipe *pipe)
+{
+    struct cbox_waveform *waveform = pipe->waveform;
+    if (!waveform->packed)
+        return FALSE;
+    pipe->info = waveform->info;
+    pipe->unpack_buffer = malloc(CBOX_WAVEPACK_BLOCK_FRAMES * waveform->info.channels * sizeof(int16_t));
+    return pipe->unpack_buffer != NULL;
+}
+
+static int32_t wavepack_io_read(struct cbox_prefetch_pipe *pipe, void *dest, uint32_t pos, uint32_t frames)
+{
+    return cbox_wavepack_read(pipe->waveform->packed, dest, pos, frames, pipe->unpack_buffer);
+}
+
+static void wavepack_io_close(struct cbox_prefetch_pipe *pipe)
+{
+    free(pipe->unpack_buffer);
+    pipe->unpack_buffer = NULL;
+}
+
+const struct cbox_prefetch_io_backend cbox_prefetch_io_wavepack = {
+    .name = "wavepack",
+    .open = wavepack_io_open,
+    .read = wavepack_io_read,
+    .close = wavepack_io_close,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+void cbox_prefetch_pipe_init(struct cbox_prefetch_pipe *pipe, struct cbox_prefetch_stack *stack)
 {
-    pipe->data = malloc(buffer_size);
-    pipe->buffer_size = buffer_size;
+    pipe->stack = stack;
+    pipe->data = stack->service->idle_buffer;
+    pipe->buffer_size = 0;
+    pipe->io = NULL;
     pipe->sndfile = NULL;
+    pipe->fd = -1;
+    pipe->unpack_buffer = NULL;
     pipe->state = pps_free;
 }
 
+// Takes a contiguous run of slab chunks for the pipe's ring buffer. One
+// chunk per pipe without a buffer is held back, so that a few fast pipes
+// can't take all of the slab; anything above the pipe's own chunk comes out
+// of the rest. If there is not enough of it, settles for a smaller buffer.
+// Fails only if the minimum buffers of all the pipes don't fit in the budget.
+static gboolean cbox_prefetch_pipe_alloc_buffer(struct cbox_prefetch_pipe *pipe, uint32_t bytes)
+{
+    struct cbox_prefetch_service *service = pipe->stack->service;
+    uint32_t wanted = (bytes + PREFETCH_SLAB_CHUNK_SIZE - 1) / PREFETCH_SLAB_CHUNK_SIZE;
+    if (wanted < 1)
+        wanted = 1;
+    
+    pthread_mutex_lock(&service->slab_lock);
+    int64_t spare = (int64_t)service->slab_chunks - service->slab_chunks_used - service->slab_chunks_reserved;
+    uint32_t chunks = spare + 1 < wanted ? (spare > 0 ? spare + 1 : 1) : wanted;
+    while(TRUE)
+    {
+        uint32_t run = 0;
+        for (uint32_t i = 0; i < service->slab_chunks; i++)
+        {
+            run = service->slab_used[i] ? 0 : run + 1;
+            if (run == chunks)
+            {
+                uint32_t first = i + 1 - chunks;
+                memset(service->slab_used + first, 1, chunks);
+                service->slab_chunks_used += chunks;
+                service->slab_chunks_reserved--;
+                pthread_mutex_unlock(&service->slab_lock);
+                if (chunks == 1 && wanted > 1)
+                {
+                    __sync_fetch_and_add(&pipe->stack->buffer_shortages, 1);
+                    __sync_fetch_and_add(&service->buffer_shortages, 1);
+                }
+                pipe->slab_first_chunk = first;
+                pipe->buffer_size = chunks * PREFETCH_SLAB_CHUNK_SIZE;
+                pipe->data = (uint8_t *)service->slab + first * PREFETCH_SLAB_CHUNK_SIZE;
+                return TRUE;
+            }
+        }
+        if (chunks == 1)
+            break;
+        chunks /= 2;
+    }
+    pthread_mutex_unlock(&service->slab_lock);
+    __sync_fetch_and_add(&pipe->stack->buffer_shortages, 1);
+    __sync_fetch_and_add(&service->buffer_shortages, 1);
+    return FALSE;
+}
+
+static void cbox_prefetch_pipe_free_buffer(struct cbox_prefetch_pipe *pipe)
+{
+    struct cbox_prefetch_service *service = pipe->stack->service;
+    if (!pipe->buffer_size)
+        return;
+    pthread_mutex_lock(&service->slab_lock);
+    memset(service->slab_used + pipe->slab_first_chunk, 0, pipe->buffer_size / PREFETCH_SLAB_CHUNK_SIZE);
+    service->slab_chunks_used -= pipe->buffer_size / PREFETCH_SLAB_CHUNK_SIZE;
+    service->slab_chunks_reserved++;
+    pthread_mutex_unlock(&service->slab_lock);
+    pipe->data = service->idle_buffer;
+    pipe->buffer_size = 0;
+}
+
+// Keep about buffer_time_us worth of data buffered at the current rate, and
+// refill it in reads of 1/8 of that
+static void cbox_prefetch_pipe_update_targets(struct cbox_prefetch_pipe *pipe)
+{
+    double target = pipe->consume_rate * pipe->stack->service->buffer_time_us;
+    uint32_t refill_target = target < pipe->buffer_loop_end ? (uint32_t)target : pipe->buffer_loop_end;
+    uint32_t min_read = refill_target / 8;
+    if (min_read < PIPE_MIN_PREFETCH_SIZE_FRAMES)
+        min_read = PIPE_MIN_PREFETCH_SIZE_FRAMES;
+    if (min_read > pipe->buffer_loop_end / 2)
+        min_read = pipe->buffer_loop_end / 2;
+    if (refill_target < 2 * min_read)
+        refill_target = 2 * min_read;
+    pipe->min_read_frames = min_read;
+    pipe->refill_target_frames = refill_target;
+}
+
 gboolean cbox_prefetch_pipe_openfile(struct cbox_prefetch_pipe *pipe)
 {
-    if (pipe->waveform->taritem)
-        pipe->sndfile = cbox_tarfile_opensndfile(pipe->waveform->tarfile, pipe->waveform->taritem, &pipe->sndstream, &pipe->info);
+    pipe->frame_size = pipe->waveform->frame_size;
+    if (cbox_prefetch_io_wavepack.open(pipe))
+        pipe->io = &cbox_prefetch_io_wavepack;
+    else if (cbox_prefetch_io_pread.open(pipe))
+        pipe->io = &cbox_prefetch_io_pread;
+    else if (cbox_prefetch_io_sndfile.open(pipe))
+        pipe->io = &cbox_prefetch_io_sndfile;
     else
-        pipe->sndfile = sf_open(pipe->waveform->canonical_name, SFM_READ, &pipe->info);
-    if (!pipe->sndfile)
         return FALSE;
-    pipe->file_pos_frame = sf_seek(pipe->sndfile, pipe->waveform->preloaded_frames, SEEK_SET);
+    pipe->file_pos_frame = pipe->start_frame;
+    if (pipe->file_pos_frame > pipe->info.frames)
+        pipe->file_pos_frame = pipe->info.frames;
     if (pipe->file_loop_end > pipe->info.frames)
         pipe->file_loop_end = pipe->info.frames;
-    pipe->buffer_loop_end = pipe->buffer_size / (sizeof(int16_t) * pipe->info.channels);
+    // until there's some measurement, assume the speed the voice started at
+    pipe->consume_rate = pipe->info.samplerate * pipe->speed_hint * 1e-6;
+    pipe->rate_consumed = pipe->consumed;
+    pipe->rate_time = g_get_monotonic_time();
+    
+    uint32_t frame_size = pipe->frame_size;
+    double bytes = pipe->consume_rate * pipe->stack->service->buffer_time_us * frame_size;
+    double max_bytes = (double)pipe->stack->service->nominal_buffer_size * PREFETCH_MAX_BUFFER_SCALE;
+    if (!cbox_prefetch_pipe_alloc_buffer(pipe, bytes < max_bytes ? (uint32_t)bytes : (uint32_t)max_bytes))
+    {
+        pipe->io->close(pipe);
+        pipe->io = NULL;
+        return FALSE;
+    }
+    pipe->buffer_loop_end = pipe->buffer_size / frame_size;
+    cbox_prefetch_pipe_update_targets(pipe);
     pipe->produced = pipe->file_pos_frame;
     pipe->write_ptr = 0;
+    __sync_synchronize();
     pipe->state = pps_active;
     
     return TRUE;
 }
 
+static inline gboolean cbox_prefetch_pipe_needs_refill(struct cbox_prefetch_pipe *pipe)
+{
+    int32_t supply = pipe->produced - pipe->consumed;
+    return supply <= (int32_t)pipe->refill_target_frames - (int32_t)pipe->min_read_frames;
+}
+
 void cbox_prefetch_pipe_consumed(struct cbox_prefetch_pipe *pipe, uint32_t frames)
 {
     pipe->consumed += frames;
+    // Wake up the prefetch thread once there's enough free space for
+    // a refill. The flag ensures it's done only once per refill.
+    if (!pipe->refill_requested && !pipe->finished && pipe->state == pps_active && cbox_prefetch_pipe_needs_refill(pipe))
+    {
+        pipe->refill_requested = TRUE;
+        sem_post(&pipe->stack->service->sem_wakeup);
+    }
 }
 
 void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
@@ -65,7 +331,6 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
     gboolean retry;
     do {
         retry = FALSE;
-        // XXXKF take consumption rate into account
 
         // How many frames left to consume
         int32_t supply = pipe->produced - pipe->consumed;
@@ -77,19 +342,19 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
             
             // XXXKF This may or may not be stupid. I didn't put much thought into it.
             pipe->produced += overrun;
-            pipe->file_pos_frame = sf_seek(pipe->sndfile, overrun, SEEK_CUR);
+            pipe->file_pos_frame += overrun;
             pipe->write_ptr += overrun;
             if (pipe->write_ptr >= pipe->buffer_loop_end)
                 pipe->write_ptr %= pipe->buffer_loop_end;
         }
         //
-        if (supply >= pipe->buffer_loop_end)
+        if (supply >= (int32_t)pipe->refill_target_frames)
             return;
         
-        // How many frames to read to fill the full prefetch size
-        int32_t readsize = pipe->buffer_loop_end - supply;
+        // How many frames to read to get to the refill target
+        int32_t readsize = pipe->refill_target_frames - supply;
         // 
-        if (readsize < PIPE_MIN_PREFETCH_SIZE_FRAMES)
+        if (readsize < (int32_t)pipe->min_read_frames)
             return;
         
         if (pipe->write_ptr == pipe->buffer_loop_end)
@@ -108,15 +373,15 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
             if (pipe->file_loop_start == (uint32_t)-1 || (pipe->loop_count && pipe->play_count >= pipe->loop_count - 1))
             {
                 pipe->finished = TRUE;
-                for (int i = 0; i < readsize * pipe->info.channels; i++)
-                    pipe->data[pipe->write_ptr * pipe->info.channels + i] = rand();
+                uint8_t *dest = (uint8_t *)pipe->data + pipe->write_ptr * pipe->frame_size;
+                for (int i = 0; i < readsize * pipe->frame_size; i++)
+                    dest[i] = rand();
                 break;
             }
             else
             {
                 pipe->play_count++;
                 pipe->file_pos_frame = pipe->file_loop_start;
-                sf_seek(pipe->sndfile, pipe->file_loop_start, SEEK_SET);
             }
         }
         // If reading across file loop boundary, read up to loop end and 
@@ -127,7 +392,7 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
             retry = TRUE;
         }
         
-        int32_t actread = sf_readf_short(pipe->sndfile, pipe->data + pipe->write_ptr * pipe->info.channels, readsize);
+        int32_t actread = pipe->io->read(pipe, (uint8_t *)pipe->data + pipe->write_ptr * pipe->frame_size, pipe->file_pos_frame, readsize);
         pipe->produced += actread;
         pipe->file_pos_frame += actread;
         pipe->write_ptr += actread;
@@ -137,86 +402,356 @@ void cbox_prefetch_pipe_fetch(struct cbox_prefetch_pipe *pipe)
 void cbox_prefetch_pipe_closefile(struct cbox_prefetch_pipe *pipe)
 {
     assert(pipe->state == pps_closing);
-    assert(pipe->sndfile);
-    sf_close(pipe->sndfile);
-    pipe->sndfile = NULL;
+    assert(pipe->io);
+    pipe->io->close(pipe);
+    pipe->io = NULL;
+    cbox_prefetch_pipe_free_buffer(pipe);
     pipe->state = pps_free;
 }
 
 void cbox_prefetch_pipe_close(struct cbox_prefetch_pipe *pipe)
 {
-    if (pipe->sndfile)
+    if (pipe->io)
+    {
+        pipe->state = pps_closing;
         cbox_prefetch_pipe_closefile(pipe);
-    if (pipe->data)
+    }
+}
+
+static void prefetch_service_wait(struct cbox_prefetch_service *service)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += PREFETCH_MAX_SLEEP_US * 1000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    while(sem_timedwait(&service->sem_wakeup, &ts) == -1 && errno == EINTR)
+        ;
+    // a single pass handles all the pending requests
+    while(sem_trywait(&service->sem_wakeup) == 0)
+        ;
+}
+
+static void cbox_prefetch_pipe_update_rate(struct cbox_prefetch_pipe *pipe, gint64 now)
+{
+    gint64 elapsed = now - pipe->rate_time;
+    if (elapsed >= 1000)
+    {
+        double rate = (double)(pipe->consumed - pipe->rate_consumed) / elapsed;
+        pipe->consume_rate = 0.75 * pipe->consume_rate + 0.25 * rate;
+        pipe->rate_consumed = pipe->consumed;
+        pipe->rate_time = now;
+    }
+    cbox_prefetch_pipe_update_targets(pipe);
+    int32_t supply = pipe->produced - pipe->consumed;
+    pipe->starvation_time = pipe->consume_rate > 0 ? supply / pipe->consume_rate : G_MAXDOUBLE;
+}
+
+static int compare_starvation_time(const void *p1, const void *p2)
+{
+    const struct cbox_prefetch_pipe *pipe1 = *(struct cbox_prefetch_pipe * const *)p1;
+    const struct cbox_prefetch_pipe *pipe2 = *(struct cbox_prefetch_pipe * const *)p2;
+    if (pipe1->starvation_time < pipe2->starvation_time)
+        return -1;
+    if (pipe1->starvation_time > pipe2->starvation_time)
+        return 1;
+    return 0;
+}
+
+static void prefetch_task(void *user_data, int task, int worker)
+{
+    struct cbox_prefetch_service *service = user_data;
+    struct cbox_prefetch_pipe *pipe = service->schedule[task];
+    if (pipe->state == pps_opening)
     {
-        free(pipe->data);
-        pipe->data = NULL;
+        if (!cbox_prefetch_pipe_openfile(pipe))
+        {
+            pipe->state = pps_error;
+            return;
+        }
+        // the consumer may have returned the pipe in the meantime, so it
+        // can be closing already
+        assert(pipe->state != pps_opening);
     }
+    else
+    {
+        pipe->refill_requested = FALSE;
+        __sync_synchronize();
+    }
+    // No point filling a buffer nobody is going to read. The pipe is only
+    // closed by this thread after the round, so if it's returned after this
+    // check, the fetch is wasted but harmless.
+    if (pipe->returned || pipe->state == pps_closing)
+        return;
+    cbox_prefetch_pipe_fetch(pipe);
+}
+
+static int prefetch_service_schedule_stack(struct cbox_prefetch_service *service, struct cbox_prefetch_stack *stack, int scheduled, gint64 now)
+{
+    for (int i = 0; i < stack->pipe_count; i++)
+    {
+        struct cbox_prefetch_pipe *pipe = &stack->pipes[i];
+        switch(pipe->state)
+        {
+        case pps_free:
+        case pps_finished:
+        case pps_error:
+            break;
+        case pps_opening:
+            // a voice is already playing the preloaded part, so opening
+            // and filling the buffer comes before everything else
+            pipe->starvation_time = -1;
+            service->schedule[scheduled++] = pipe;
+            stack->pinned = TRUE;
+            break;
+        case pps_active:
+            if (pipe->returned)
+                pipe->state = pps_closing;
+            else if (!pipe->finished)
+            {
+                cbox_prefetch_pipe_update_rate(pipe, now);
+                if (cbox_prefetch_pipe_needs_refill(pipe))
+                {
+                    service->schedule[scheduled++] = pipe;
+                    stack->pinned = TRUE;
+                }
+            }
+            break;
+        case pps_closing:
+            cbox_prefetch_pipe_closefile(pipe);
+            break;
+        default:
+            break;
+        }
+    }
+    return scheduled;
 }
 
 static void *prefetch_thread(void *user_data)
 {
-    struct cbox_prefetch_stack *stack = user_data;
+    struct cbox_prefetch_service *service = user_data;
     
-    while(!stack->finished)
+    while(!service->finished)
+    {
+        prefetch_service_wait(service);
+        gint64 now = g_get_monotonic_time();
+        int scheduled = 0;
+        pthread_mutex_lock(&service->stacks_lock);
+        if (service->schedule_capacity < service->schedule_size)
+        {
+            service->schedule_capacity = service->schedule_size;
+            service->schedule = realloc(service->schedule, service->schedule_capacity * sizeof(struct cbox_prefetch_pipe *));
+        }
+        for (GSList *p = service->stacks; p; p = p->next)
+            scheduled = prefetch_service_schedule_stack(service, p->data, scheduled, now);
+        // The stacks of the scheduled pipes are pinned, so the reads can
+        // be done without holding up stack creation and status queries
+        pthread_mutex_unlock(&service->stacks_lock);
+        // Refill the pipes that are going to run dry first, whichever
+        // stack they belong to. With reader threads, the pipes are still
+        // claimed in that order, but a slow seek or open only holds up one
+        // reader.
+        qsort(service->schedule, scheduled, sizeof(struct cbox_prefetch_pipe *), compare_starvation_time);
+        if (service->io_pool && scheduled > 1)
+            cbox_worker_pool_run(service->io_pool, prefetch_task, service, scheduled);
+        else
+        {
+            for (int i = 0; i < scheduled; i++)
+                prefetch_task(service, i, 0);
+        }
+        if (scheduled)
+        {
+            pthread_mutex_lock(&service->stacks_lock);
+            for (int i = 0; i < scheduled; i++)
+                service->schedule[i]->stack->pinned = FALSE;
+            pthread_cond_broadcast(&service->round_done);
+            pthread_mutex_unlock(&service->stacks_lock);
+        }
+        if (service->housekeeping)
+            service->housekeeping(service->housekeeping_data);
+    }
+    return 0;
+}
+
+struct cbox_prefetch_service *cbox_prefetch_service_new(uint32_t buffer_size, uint64_t budget, int io_threads)
+{
+    struct cbox_prefetch_service *service = calloc(1, sizeof(struct cbox_prefetch_service));
+    if (io_threads > 0)
+    {
+        GError *error = NULL;
+        if (io_threads > CBOX_WORKER_POOL_MAX_THREADS)
+            io_threads = CBOX_WORKER_POOL_MAX_THREADS;
+        // Disk reads don't need real-time priority
+        service->io_pool = cbox_worker_pool_new(io_threads, 0, &error);
+        if (!service->io_pool)
+        {
+            g_warning("Cannot create prefetch reader threads, reading from the prefetch thread only: %s", error ? error->message : "unknown error");
+            g_clear_error(&error);
+        }
+    }
+    
+    // A pipe can take anything from PREFETCH_MIN_BUFFER_SIZE to
+    // PREFETCH_MAX_BUFFER_SCALE times buffer_size out of the budget
+    service->nominal_buffer_size = buffer_size;
+    service->buffer_time_us = buffer_size * 1000000.0 / (2 * sizeof(int16_t) * 44100);
+    service->slab_chunks = (budget + PREFETCH_SLAB_CHUNK_SIZE - 1) / PREFETCH_SLAB_CHUNK_SIZE;
+    if (service->slab_chunks < PREFETCH_MIN_BUFFER_SIZE / PREFETCH_SLAB_CHUNK_SIZE)
+        service->slab_chunks = PREFETCH_MIN_BUFFER_SIZE / PREFETCH_SLAB_CHUNK_SIZE;
+    service->slab = malloc((size_t)service->slab_chunks * PREFETCH_SLAB_CHUNK_SIZE);
+    service->slab_used = calloc(service->slab_chunks, 1);
+    service->slab_chunks_used = 0;
+    service->slab_chunks_reserved = 0;
+    service->idle_buffer = calloc(1, buffer_size);
+    pthread_mutex_init(&service->slab_lock, NULL);
+    
+    service->stacks = NULL;
+    pthread_mutex_init(&service->stacks_lock, NULL);
+    pthread_cond_init(&service->round_done, NULL);
+    service->schedule = NULL;
+    service->schedule_capacity = 0;
+    service->schedule_size = 0;
+    service->finished = FALSE;
+    service->underruns = 0;
+    service->buffer_shortages = 0;
+    service->housekeeping = NULL;
+    service->housekeeping_data = NULL;
+    sem_init(&service->sem_wakeup, 0, 0);
+    
+    if (pthread_create(&service->thr_prefetch, NULL, prefetch_thread, service))
+    {
+        // XXXKF set thread priority
+        g_warning("Cannot create a prefetch thread. Exiting.\n");
+        return NULL;
+    }
+    
+    return service;
+}
+
+void cbox_prefetch_service_set_housekeeping(struct cbox_prefetch_service *service, void (*func)(void *user_data), void *user_data)
+{
+    service->housekeeping_data = user_data;
+    __sync_synchronize();
+    service->housekeeping = func;
+}
+
+void cbox_prefetch_service_wakeup(struct cbox_prefetch_service *service)
+{
+    sem_post(&service->sem_wakeup);
+}
+
+int cbox_prefetch_service_get_active_pipe_count(struct cbox_prefetch_service *service)
+{
+    int count = 0;
+    pthread_mutex_lock(&service->stacks_lock);
+    for (GSList *p = service->stacks; p; p = p->next)
+        count += cbox_prefetch_stack_get_active_pipe_count(p->data);
+    pthread_mutex_unlock(&service->stacks_lock);
+    return count;
+}
+
+uint64_t cbox_prefetch_service_get_bytes_in_flight(struct cbox_prefetch_service *service)
+{
+    uint64_t bytes = 0;
+    pthread_mutex_lock(&service->stacks_lock);
+    for (GSList *p = service->stacks; p; p = p->next)
     {
-        usleep(1000);
+        struct cbox_prefetch_stack *stack = p->data;
         for (int i = 0; i < stack->pipe_count; i++)
         {
             struct cbox_prefetch_pipe *pipe = &stack->pipes[i];
-            switch(pipe->state)
-            {
-            case pps_free:
-            case pps_finished:
-            case pps_error:
-                break;
-            case pps_opening:
-                if (!cbox_prefetch_pipe_openfile(pipe))
-                    pipe->state = pps_error;
-                assert(pipe->state != pps_opening);
-                break;
-            case pps_active:
-                if (pipe->returned)
-                    pipe->state = pps_closing;
-                else
-                    cbox_prefetch_pipe_fetch(pipe);
-                break;
-            case pps_closing:
-                cbox_prefetch_pipe_closefile(pipe);
-                break;
-            default:
-                break;
-            }
+            if (pipe->state != pps_active)
+                continue;
+            int32_t supply = pipe->produced - pipe->consumed;
+            if (supply > 0)
+                bytes += (uint64_t)supply * pipe->frame_size;
         }
     }
-    return 0;
+    pthread_mutex_unlock(&service->stacks_lock);
+    return bytes;
+}
+
+uint64_t cbox_prefetch_service_get_buffer_bytes(struct cbox_prefetch_service *service)
+{
+    return (uint64_t)service->slab_chunks_used * PREFETCH_SLAB_CHUNK_SIZE;
+}
+
+uint64_t cbox_prefetch_service_get_buffer_budget(struct cbox_prefetch_service *service)
+{
+    return (uint64_t)service->slab_chunks * PREFETCH_SLAB_CHUNK_SIZE;
 }
 
-struct cbox_prefetch_stack *cbox_prefetch_stack_new(int npipes, uint32_t buffer_size)
+uint32_t cbox_prefetch_service_get_underrun_count(struct cbox_prefetch_service *service)
+{
+    return service->underruns;
+}
+
+uint32_t cbox_prefetch_service_get_buffer_shortage_count(struct cbox_prefetch_service *service)
+{
+    return service->buffer_shortages;
+}
+
+void cbox_prefetch_service_destroy(struct cbox_prefetch_service *service)
+{
+    void *result = NULL;
+    if (service->stacks)
+        g_warning("Prefetch service destroyed while still in use by %d stack(s)", g_slist_length(service->stacks));
+    service->finished = TRUE;
+    sem_post(&service->sem_wakeup);
+    pthread_join(service->thr_prefetch, &result);
+    sem_destroy(&service->sem_wakeup);
+    if (service->io_pool)
+        cbox_worker_pool_destroy(service->io_pool);
+    pthread_cond_destroy(&service->round_done);
+    pthread_mutex_destroy(&service->stacks_lock);
+    pthread_mutex_destroy(&service->slab_lock);
+    g_slist_free(service->stacks);
+    free(service->schedule);
+    free(service->idle_buffer);
+    free(service->slab_used);
+    free(service->slab);
+    free(service);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct cbox_prefetch_stack *cbox_prefetch_stack_new(struct cbox_prefetch_service *service, int npipes)
 {
     struct cbox_prefetch_stack *stack = calloc(1, sizeof(struct cbox_prefetch_stack));
+    stack->service = service;
     stack->pipes = calloc(npipes, sizeof(struct cbox_prefetch_pipe));
-    
     for (int i = 0; i < npipes; i++)
     {
-        cbox_prefetch_pipe_init(&stack->pipes[i], buffer_size);
+        cbox_prefetch_pipe_init(&stack->pipes[i], stack);
         stack->pipes[i].next_free_pipe = i - 1;
     }
     stack->pipe_count = npipes;
     stack->last_free_pipe = npipes - 1;
-    stack->finished = FALSE;
+    stack->underruns = 0;
+    stack->buffer_shortages = 0;
+    stack->pinned = FALSE;
     
-    if (pthread_create(&stack->thr_prefetch, NULL, prefetch_thread, stack))
-    {
-        // XXXKF set thread priority
-        g_warning("Cannot create a prefetch thread. Exiting.\n");
-        return NULL;
-    }
+    // the prefetch thread grows the schedule before the next round, as it
+    // may be in use by the readers right now
+    pthread_mutex_lock(&service->stacks_lock);
+    service->schedule_size += npipes;
+    service->stacks = g_slist_prepend(service->stacks, stack);
+    int total_pipes = service->schedule_size;
+    pthread_mutex_unlock(&service->stacks_lock);
+    
+    pthread_mutex_lock(&service->slab_lock);
+    service->slab_chunks_reserved += npipes;
+    pthread_mutex_unlock(&service->slab_lock);
+    if ((uint64_t)total_pipes > service->slab_chunks)
+        g_warning("Stream buffer budget of %u KB is too small for %d streaming voices, some of them will only play the preloaded part (at least %u KB needed)",
+            (unsigned)(service->slab_chunks * (PREFETCH_SLAB_CHUNK_SIZE / 1024)), total_pipes, (unsigned)(total_pipes * (PREFETCH_MIN_BUFFER_SIZE / 1024)));
     
     return stack;
 }
 
-struct cbox_prefetch_pipe *cbox_prefetch_stack_pop(struct cbox_prefetch_stack *stack, struct cbox_waveform *waveform, uint32_t file_loop_start, uint32_t file_loop_end, uint32_t loop_count)
+struct cbox_prefetch_pipe *cbox_prefetch_stack_pop(struct cbox_prefetch_stack *stack, struct cbox_waveform *waveform, uint32_t file_loop_start, uint32_t file_loop_end, uint32_t loop_count, uint32_t start_frame, double speed)
 {
     // The stack may include some pipes that are already returned but not yet 
     // fully prepared for opening a new file
@@ -239,13 +774,17 @@ struct cbox_prefetch_pipe *cbox_prefetch_stack_pop(struct cbox_prefetch_stack *s
     pipe->buffer_loop_end = 0;
     pipe->finished = FALSE;
     pipe->returned = FALSE;
-    pipe->produced = waveform->preloaded_frames;
+    pipe->start_frame = start_frame;
+    pipe->produced = start_frame;
     pipe->consumed = 0;
     pipe->play_count = 0;
     pipe->loop_count = loop_count;
+    pipe->speed_hint = speed > 0 ? speed : 1;
+    pipe->refill_requested = FALSE;
     
     __sync_synchronize();
     pipe->state = pps_opening;
+    sem_post(&stack->service->sem_wakeup);
     return pipe;
 }
 
@@ -276,6 +815,17 @@ void cbox_prefetch_stack_push(struct cbox_prefetch_stack *stack, struct cbox_pre
     
     __sync_synchronize();
     stack->last_free_pipe = pos;
+    sem_post(&stack->service->sem_wakeup);
+}
+
+uint32_t cbox_prefetch_stack_get_underrun_count(struct cbox_prefetch_stack *stack)
+{
+    return stack->underruns;
+}
+
+uint32_t cbox_prefetch_stack_get_buffer_shortage_count(struct cbox_prefetch_stack *stack)
+{
+    return stack->buffer_shortages;
 }
 
 int cbox_prefetch_stack_get_active_pipe_count(struct cbox_prefetch_stack *stack)
@@ -291,11 +841,20 @@ int cbox_prefetch_stack_get_active_pipe_count(struct cbox_prefetch_stack *stack)
 
 void cbox_prefetch_stack_destroy(struct cbox_prefetch_stack *stack)
 {
-    void *result = NULL;
-    stack->finished = TRUE;
-    pthread_join(stack->thr_prefetch, &result);
+    struct cbox_prefetch_service *service = stack->service;
+    // Once removed from the list, the stack won't be scheduled again, but
+    // the current round may still be reading into some of its pipes
+    pthread_mutex_lock(&service->stacks_lock);
+    service->stacks = g_slist_remove(service->stacks, stack);
+    service->schedule_size -= stack->pipe_count;
+    while(stack->pinned)
+        pthread_cond_wait(&service->round_done, &service->stacks_lock);
     for (int i = 0; i < stack->pipe_count; i++)
         cbox_prefetch_pipe_close(&stack->pipes[i]);
+    pthread_mutex_unlock(&service->stacks_lock);
+    pthread_mutex_lock(&service->slab_lock);
+    service->slab_chunks_reserved -= stack->pipe_count;
+    pthread_mutex_unlock(&service->slab_lock);
     free(stack->pipes);
     free(stack);
 }
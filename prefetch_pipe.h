@@ -22,11 +22,37 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <assert.h>
 #include <glib.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <sndfile.h>
 #include <stdint.h>
 #include <tarfile.h>
 
+struct cbox_prefetch_pipe;
+struct cbox_prefetch_service;
+struct cbox_prefetch_stack;
 struct cbox_waveform;
+struct cbox_worker_pool;
+
+// File access method used by a pipe. All functions are called from the
+// prefetch thread or one of the reader threads, never from the RT thread.
+struct cbox_prefetch_io_backend
+{
+    const char *name;
+    // Opens pipe->waveform and fills pipe->info, returns FALSE if the file
+    // can't be handled by this backend
+    gboolean (*open)(struct cbox_prefetch_pipe *pipe);
+    // Reads up to frames frames starting at file frame pos, in the format of
+    // the waveform, returns the number of frames read
+    int32_t (*read)(struct cbox_prefetch_pipe *pipe, void *dest, uint32_t pos, uint32_t frames);
+    void (*close)(struct cbox_prefetch_pipe *pipe);
+};
+
+// pread() of raw 16-bit PCM WAV data, including files inside tar archives
+extern const struct cbox_prefetch_io_backend cbox_prefetch_io_pread;
+// decodes the compressed in-memory copy of the waveform, if there is one
+extern const struct cbox_prefetch_io_backend cbox_prefetch_io_wavepack;
+// libsndfile, for everything else (compressed formats etc.)
+extern const struct cbox_prefetch_io_backend cbox_prefetch_io_sndfile;
 
 enum cbox_prefetch_pipe_state
 {
@@ -45,23 +71,53 @@ struct cbox_prefetch_pipe
     int next_free_pipe;
     struct cbox_waveform *waveform;
     struct cbox_tarfile_sndstream sndstream;
-    int16_t *data;
+    // ring buffer, allocated from the service's slab when the file is opened;
+    // holds frames of frame_size bytes in the waveform's sample format
+    void *data;
+    uint32_t frame_size;
     uint32_t buffer_size;
+    uint32_t slab_first_chunk;
     SF_INFO info;
+    const struct cbox_prefetch_io_backend *io;
     SNDFILE *sndfile;
+    // used by the pread backend
+    int fd;
+    gboolean own_fd;
+    uint64_t data_offset;
+    // used by the wavepack backend, for partially read blocks
+    int16_t *unpack_buffer;
     uint32_t file_pos_frame;
     uint32_t file_loop_start;
     uint32_t file_loop_end;
     uint32_t buffer_loop_end;
+    // derived from the consumption rate by the prefetch thread: the amount of
+    // data to keep buffered and the smallest read worth doing
+    uint32_t refill_target_frames;
+    uint32_t min_read_frames;
+    // playback speed the voice started with, used for sizing the buffer
+    double speed_hint;
     uint32_t play_count, loop_count;
+    // where streaming starts (the end of the preloaded part)
+    uint32_t start_frame;
     size_t write_ptr;
     size_t produced;
     size_t consumed;
     gboolean finished;
     gboolean returned;
+    
+    struct cbox_prefetch_stack *stack;
+    // set by the consumer when it wakes up the prefetch thread for a refill,
+    // cleared by the prefetch thread before the refill
+    volatile gboolean refill_requested;
+    // consumption rate estimate (frames per microsecond) and the resulting
+    // time until the buffered data runs out; prefetch thread only
+    double consume_rate;
+    size_t rate_consumed;
+    gint64 rate_time;
+    double starvation_time;
 };
 
-extern void cbox_prefetch_pipe_init(struct cbox_prefetch_pipe *pipe, uint32_t buffer_size);
+extern void cbox_prefetch_pipe_init(struct cbox_prefetch_pipe *pipe, struct cbox_prefetch_stack *stack);
 extern void cbox_prefetch_pipe_consumed(struct cbox_prefetch_pipe *pipe, uint32_t frames);
 extern void cbox_prefetch_pipe_close(struct cbox_prefetch_pipe *pipe);
 
@@ -71,19 +127,102 @@ static inline uint32_t cbox_prefetch_pipe_get_remaining(struct cbox_prefetch_pip
     return pipe->produced - pipe->consumed;
 }
 
+// Process-wide streaming service: one prefetch thread, one set of reader
+// threads and one buffer memory budget for all the pipes of all the stacks
+// registered with it, with refills prioritised across all of them
+struct cbox_prefetch_service
+{
+    // Memory for all the pipe buffers, split into chunks that are handed out
+    // in contiguous runs sized for each pipe's expected consumption rate.
+    // Guarded by slab_lock, as files may be opened by several reader threads.
+    int16_t *slab;
+    uint8_t *slab_used;
+    uint32_t slab_chunks;
+    uint32_t slab_chunks_used;
+    // one chunk for each registered pipe that doesn't have a buffer, held
+    // back so that it can always get a minimum size one
+    uint32_t slab_chunks_reserved;
+    pthread_mutex_t slab_lock;
+    // zeroes, used as the buffer of pipes that don't have one allocated yet
+    int16_t *idle_buffer;
+    // streambuf_size, and the corresponding buffering time for a stereo
+    // 44.1 kHz file played at the original pitch
+    uint32_t nominal_buffer_size;
+    double buffer_time_us;
+    pthread_t thr_prefetch;
+    sem_t sem_wakeup;
+    // optional reader threads, so that a slow read doesn't hold up the others
+    struct cbox_worker_pool *io_pool;
+    // registered stacks; the lock is held by the prefetch thread only while
+    // it picks the pipes for a round, the reads are done without it
+    GSList *stacks;
+    pthread_mutex_t stacks_lock;
+    // signalled after each round, for cbox_prefetch_stack_destroy
+    pthread_cond_t round_done;
+    // pipes due for a refill, most urgent first; prefetch thread only
+    struct cbox_prefetch_pipe **schedule;
+    int schedule_capacity;
+    // total number of pipes in the registered stacks, guarded by stacks_lock
+    int schedule_size;
+    gboolean finished;
+    uint32_t underruns;
+    uint32_t buffer_shortages;
+    // called by the prefetch thread after every scheduling round
+    void (*housekeeping)(void *user_data);
+    void *housekeeping_data;
+};
+
+// The pipes leased by a single consumer (sampler instance). Popping and
+// pushing pipes is done by the consumer's RT thread only.
 struct cbox_prefetch_stack
 {
+    struct cbox_prefetch_service *service;
     struct cbox_prefetch_pipe *pipes;
     int pipe_count;
-    pthread_t thr_prefetch;
     int last_free_pipe;
-    gboolean finished;
+    // set while some of the pipes are being read outside of stacks_lock,
+    // destroying the stack waits for that to finish; guarded by stacks_lock
+    gboolean pinned;
+    // number of times a streaming voice ran out of data (voices may be
+    // rendered on several threads, so updated atomically)
+    uint32_t underruns;
+    // number of files opened with a minimum size buffer (or none at all),
+    // because the slab was full (reader threads only, so updated atomically)
+    uint32_t buffer_shortages;
 };
 
-extern struct cbox_prefetch_stack *cbox_prefetch_stack_new(int npipes, uint32_t buffer_size);
-extern struct cbox_prefetch_pipe *cbox_prefetch_stack_pop(struct cbox_prefetch_stack *stack, struct cbox_waveform *waveform, uint32_t file_loop_start, uint32_t file_loop_end, uint32_t loop_count);
+// Called by the consumer when it needed more data than was available
+static inline void cbox_prefetch_pipe_report_underrun(struct cbox_prefetch_pipe *pipe)
+{
+    if (!pipe->finished)
+    {
+        __sync_fetch_and_add(&pipe->stack->underruns, 1);
+        __sync_fetch_and_add(&pipe->stack->service->underruns, 1);
+    }
+}
+
+extern struct cbox_prefetch_service *cbox_prefetch_service_new(uint32_t buffer_size, uint64_t budget, int io_threads);
+// Runs func on the prefetch thread after each round, for background work
+// related to streaming
+extern void cbox_prefetch_service_set_housekeeping(struct cbox_prefetch_service *service, void (*func)(void *user_data), void *user_data);
+// Starts a round as soon as possible, safe to call from the RT thread
+extern void cbox_prefetch_service_wakeup(struct cbox_prefetch_service *service);
+extern int cbox_prefetch_service_get_active_pipe_count(struct cbox_prefetch_service *service);
+// Data read ahead and not consumed yet, in bytes
+extern uint64_t cbox_prefetch_service_get_bytes_in_flight(struct cbox_prefetch_service *service);
+// Buffer memory currently allocated to pipes, and the maximum
+extern uint64_t cbox_prefetch_service_get_buffer_bytes(struct cbox_prefetch_service *service);
+extern uint64_t cbox_prefetch_service_get_buffer_budget(struct cbox_prefetch_service *service);
+extern uint32_t cbox_prefetch_service_get_underrun_count(struct cbox_prefetch_service *service);
+extern uint32_t cbox_prefetch_service_get_buffer_shortage_count(struct cbox_prefetch_service *service);
+extern void cbox_prefetch_service_destroy(struct cbox_prefetch_service *service);
+
+extern struct cbox_prefetch_stack *cbox_prefetch_stack_new(struct cbox_prefetch_service *service, int npipes);
+extern struct cbox_prefetch_pipe *cbox_prefetch_stack_pop(struct cbox_prefetch_stack *stack, struct cbox_waveform *waveform, uint32_t file_loop_start, uint32_t file_loop_end, uint32_t loop_count, uint32_t start_frame, double speed);
 extern void cbox_prefetch_stack_push(struct cbox_prefetch_stack *stack, struct cbox_prefetch_pipe *pipe);
 extern int cbox_prefetch_stack_get_active_pipe_count(struct cbox_prefetch_stack *stack);
+extern uint32_t cbox_prefetch_stack_get_underrun_count(struct cbox_prefetch_stack *stack);
+extern uint32_t cbox_prefetch_stack_get_buffer_shortage_count(struct cbox_prefetch_stack *stack);
 extern void cbox_prefetch_stack_destroy(struct cbox_prefetch_stack *stack);
 
 #endif
@@ -19,6 +19,8 @@ class GetUUID:
         def callback(cmd, fb, args):
             if cmd == "/uuid" and len(args) == 1:
                 self.uuid = args[0]
+            elif cmd == "/load_progress":
+                pass
             else:
                 raise ValueException("Unexpected callback: %s" % cmd)
         self.callback = callback
@@ -798,10 +800,19 @@ class SamplerEngine(NonDocObj):
     class Status(object):
         """Maximum number of voices playing at the same time."""
         polyphony = int
+        """Number of voices in the voice pool (polyphony plus headroom for voices being stolen)."""
+        allocated_voices = int
+        """Voice stealing policy: oldest, released or quietest."""
+        steal_policy = str
+        render_threads = int
         """Current number of voices playing."""
         active_voices = int
         """Current number of disk streams."""
         active_pipes = int
+        """Number of disk stream underruns since the engine was created."""
+        stream_underruns = int
+        """Number of disk streams opened with the minimum buffer, because the stream buffer budget was used up."""
+        stream_buffer_shortages = int
         """GM volume (14-bit) per MIDI channel."""
         volume = {int:int}
         """GM pan (14-bit) per MIDI channel."""
@@ -841,6 +852,9 @@ class SamplerEngine(NonDocObj):
     def set_polyphony(self, polyphony):
         """Set a maximum number of voices that can be played at a given time."""
         self.cmd("/polyphony", None, int(polyphony))
+    def set_steal_policy(self, policy):
+        """Set the order in which voices are stolen: 'oldest', 'released' or 'quietest'."""
+        self.cmd("/steal_policy", None, str(policy))
     def get_patches(self):
         """Return a map of program identifiers to program objects."""
         return self.get_thing("/patches", '/patch', {int : (str, SamplerProgram, int)})
@@ -914,6 +928,7 @@ class DocScene(DocObj):
         auxes = {str: DocAuxBus}
         enable_default_song_input = SettableProperty(bool)
         enable_default_external_input = SettableProperty(bool)
+        render_threads = SettableProperty(int)
     def clear(self):
         self.cmd("/clear", None)
     def load(self, name):
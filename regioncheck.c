@@ -0,0 +1,192 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Self-check of the note-on region lookup in sampler_rll.c. A random program
+// (key/velocity ranges, keyswitches, channel/random/CC conditions, sequences,
+// first/legato/release triggers) is played with random notes, both through
+// the index and through a copy of the old linear scan of the layer list.
+// Every note must pick the same layers in the same order, and leave the same
+// keyswitch and sequence state. Returns a non-zero exit code on mismatch.
+// Not built by default, use "make regioncheck".
+
+#include "sampler.h"
+#include "sampler_prg.h"
+#include <stdio.h>
+
+#define CHECK_LAYERS 500
+#define CHECK_NOTES 50000
+
+static uint32_t seed = 1;
+
+static int rnd(int range)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % range;
+}
+
+// The note-on lookup as it was before the index: one pass over the whole
+// list, keyswitch tracking done as a side effect of the scan
+static GSList *ref_get_next_layer(struct sampler_channel *c, GSList *next_layer, int note, int vel, float random, gboolean is_first)
+{
+    int ch = (c - c->module->channels) + 1;
+    for(;next_layer;next_layer = g_slist_next(next_layer))
+    {
+        struct sampler_layer *lr = next_layer->data;
+        struct sampler_layer_data *l = lr->runtime;
+        if (!l->eff_waveform)
+            continue;
+        if ((l->trigger == stm_first && !is_first) ||
+            (l->trigger == stm_legato && is_first))
+            continue;
+        if (l->sw_last != -1)
+        {
+            if (note >= l->sw_lokey && note <= l->sw_hikey)
+                lr->last_key = note;
+        }
+        if (note >= l->lokey && note <= l->hikey && vel >= l->lovel && vel <= l->hivel && ch >= l->lochan && ch <= l->hichan && random >= l->lorand && random < l->hirand &&
+            (l->cc_number == -1 || (c->cc[l->cc_number] >= l->locc && c->cc[l->cc_number] <= l->hicc)))
+        {
+            if (!l->eff_use_keyswitch ||
+                ((l->sw_last == -1 || l->sw_last == lr->last_key) &&
+                 (l->sw_down == -1 || (c->switchmask[l->sw_down >> 5] & (1 << (l->sw_down & 31)))) &&
+                 (l->sw_up == -1 || !(c->switchmask[l->sw_up >> 5] & (1 << (l->sw_up & 31)))) &&
+                 (l->sw_previous == -1 || l->sw_previous == c->previous_note)))
+            {
+                gboolean play = lr->current_seq_position == 1;
+                lr->current_seq_position++;
+                if (lr->current_seq_position >= l->seq_length)
+                    lr->current_seq_position = 1;
+                if (play)
+                    return next_layer;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void init_random_layer(struct sampler_layer *lr, struct cbox_waveform *waveform)
+{
+    struct sampler_layer_data *l = &lr->data;
+    int lokey = rnd(128), lovel = rnd(128);
+
+    l->eff_waveform = rnd(20) ? waveform : NULL;
+    l->trigger = rnd(4) ? stm_attack : (rnd(3) ? (rnd(2) ? stm_first : stm_legato) : stm_release);
+    // mostly narrow ranges, some full range ones and some out of MIDI range
+    l->lokey = rnd(10) ? lokey : -rnd(10);
+    l->hikey = rnd(10) ? lokey + rnd(8) : 127 + rnd(10);
+    l->lovel = rnd(3) ? lovel : 0;
+    l->hivel = rnd(3) ? lovel + rnd(40) : 127;
+    l->lochan = rnd(4) ? 1 : 1 + rnd(4);
+    l->hichan = rnd(4) ? 16 : l->lochan + rnd(4);
+    l->lorand = rnd(4) ? 0 : rnd(50) / 100.0;
+    l->hirand = rnd(4) ? 1 : 0.5 + rnd(50) / 100.0;
+    l->cc_number = rnd(5) ? -1 : 1 + rnd(3);
+    l->locc = rnd(64);
+    l->hicc = 64 + rnd(64);
+    l->on_cc_number = -1;
+    l->sw_lokey = 24 + rnd(4);
+    l->sw_hikey = l->sw_lokey + 8;
+    l->sw_last = rnd(3) ? -1 : l->sw_lokey + rnd(9);
+    l->sw_down = rnd(8) ? -1 : 36 + rnd(4);
+    l->sw_up = rnd(8) ? -1 : 40 + rnd(4);
+    l->sw_previous = rnd(8) ? -1 : 48 + rnd(12);
+    l->eff_use_keyswitch = l->sw_last != -1 || l->sw_down != -1 || l->sw_up != -1 || l->sw_previous != -1;
+    l->seq_length = 1 + rnd(3);
+    lr->runtime = l;
+    lr->last_key = l->sw_lokey;
+    lr->current_seq_position = 1;
+}
+
+static gboolean compare_state(struct sampler_layer *ref, struct sampler_layer *idx, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (ref[i].last_key != idx[i].last_key || ref[i].current_seq_position != idx[i].current_seq_position)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct sampler_layer ref_layers[CHECK_LAYERS], idx_layers[CHECK_LAYERS];
+    static struct sampler_module module;
+    static struct sampler_program program;
+    static struct cbox_waveform waveform;
+    GSList *ref_list = NULL, *ref_list_release = NULL;
+    int mismatches = 0, voices = 0;
+
+    for (int i = 0; i < CHECK_LAYERS; i++)
+    {
+        init_random_layer(&idx_layers[i], &waveform);
+        ref_layers[i] = idx_layers[i];
+        ref_layers[i].runtime = &ref_layers[i].data;
+        program.all_layers = g_slist_prepend(program.all_layers, &idx_layers[i]);
+    }
+    // same order as sampler_rll_new_from_program
+    for (int i = CHECK_LAYERS - 1; i >= 0; i--)
+    {
+        if (ref_layers[i].data.trigger == stm_release)
+            ref_list_release = g_slist_prepend(ref_list_release, &ref_layers[i]);
+        else
+            ref_list = g_slist_prepend(ref_list, &ref_layers[i]);
+    }
+    struct sampler_rll *rll = sampler_rll_new_from_program(&program);
+
+    for (int i = 0; i < 16; i++)
+        module.channels[i].module = &module;
+    for (int n = 0; n < CHECK_NOTES; n++)
+    {
+        struct sampler_channel *c = &module.channels[rnd(16) ? 0 : rnd(16)];
+        int note = rnd(10) ? 20 + rnd(60) : rnd(128);
+        int vel = 1 + rnd(127);
+        float random = rnd(1000) / 1000.0;
+        gboolean is_first = rnd(2), is_release_trigger = !rnd(5);
+        c->cc[1 + rnd(3)] = rnd(128);
+        c->switchmask[1] = rnd(65536) << 4;
+        c->previous_note = 48 + rnd(12);
+
+        GSList *ref = ref_get_next_layer(c, is_release_trigger ? ref_list_release : ref_list, note, vel, random, is_first);
+        struct sampler_rll_index *idx = !is_release_trigger ? &rll->index : &rll->index_release;
+        sampler_rll_index_update_keyswitches(idx, note, is_first);
+        struct sampler_layer **next = sampler_program_get_next_layer(&program, c, sampler_rll_index_get_candidates(idx, note, vel), note, vel, random, is_first);
+        while(ref || next)
+        {
+            if (!ref || !next || (struct sampler_layer *)ref->data - ref_layers != *next - idx_layers)
+            {
+                mismatches++;
+                break;
+            }
+            voices++;
+            ref = ref_get_next_layer(c, g_slist_next(ref), note, vel, random, is_first);
+            next = sampler_program_get_next_layer(&program, c, next + 1, note, vel, random, is_first);
+        }
+        if (!compare_state(ref_layers, idx_layers, CHECK_LAYERS))
+        {
+            printf("Layer state differs after note %d\n", n);
+            mismatches++;
+            break;
+        }
+    }
+    printf("%d notes, %d voices started, %d mismatches - %s\n", CHECK_NOTES, voices, mismatches, mismatches ? "FAILED" : "OK");
+    sampler_rll_destroy(rll);
+    g_slist_free(program.all_layers);
+    g_slist_free(ref_list);
+    g_slist_free(ref_list_release);
+    return mismatches ? 1 : 0;
+}
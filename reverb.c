@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "dspmath.h"
 #include "module.h"
 #include "onepole-float.h"
+#include <assert.h>
 #include <glib.h>
 #include <malloc.h>
 #include <math.h>
@@ -206,7 +207,7 @@ static void cbox_reverb_process_leg(struct reverb_module *m, int u)
     }
 }
 
-void reverb_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
+void reverb_process_frames(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs, uint32_t nframes)
 {
     struct reverb_module *m = (struct reverb_module *)module;
     struct reverb_params *p = m->params;
@@ -222,28 +223,42 @@ void reverb_process_block(struct cbox_module *module, cbox_sample_t **inputs, cb
         cbox_onepolef_set_highpass(&m->filter_coeffs[1], p->highpass * tpdsr);
         float rv = p->decay_time * m->module.srate / 1000;
         m->gain = pow(0.001, s->total_time / (rv * s->leg_count / 2));
+        // decay_time is the time to decay by 60 dB
+        m->module.tail_frames = (int)rv + s->total_time;
         m->old_params = p;
     }
 
+    // the delay network works on CBOX_BLOCK_SIZE samples at a time
+    assert(!(nframes % CBOX_BLOCK_SIZE));
     int mid = s->leg_count >> 1;
-    memcpy(s->legs[0].buffer, inputs[0], CBOX_BLOCK_SIZE * sizeof(float));
-    memcpy(s->legs[mid].buffer, inputs[1], CBOX_BLOCK_SIZE * sizeof(float));
-    for (int u = 1; u < mid; u++)
+    for (uint32_t ofs = 0; ofs < nframes; ofs += CBOX_BLOCK_SIZE)
     {
+        const float *in_left = inputs[0] + ofs, *in_right = inputs[1] + ofs;
+        float *out_left = outputs[0] + ofs, *out_right = outputs[1] + ofs;
+        memcpy(s->legs[0].buffer, in_left, CBOX_BLOCK_SIZE * sizeof(float));
+        memcpy(s->legs[mid].buffer, in_right, CBOX_BLOCK_SIZE * sizeof(float));
+        for (int u = 1; u < mid; u++)
+        {
+            for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
+                s->legs[u].buffer[i] = 0.f;
+            for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
+                s->legs[u + mid].buffer[i] = 0.f;
+        }
+            
+        for (int u = 0; u < s->leg_count; u++)
+            cbox_reverb_process_leg(m, u);
+
         for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
-            s->legs[u].buffer[i] = 0.f;
+            out_left[i] = in_left[i] * dryamt + s->legs[mid - 1].buffer[i] * wetamt;
         for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
-            s->legs[u + mid].buffer[i] = 0.f;
+            out_right[i] = in_right[i] * dryamt + s->legs[s->leg_count - 1].buffer[i] * wetamt;
+        m->pos += CBOX_BLOCK_SIZE;
     }
-        
-    for (int u = 0; u < s->leg_count; u++)
-        cbox_reverb_process_leg(m, u);
+}
 
-    for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
-        outputs[0][i] = inputs[0][i] * dryamt + s->legs[mid - 1].buffer[i] * wetamt;
-    for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
-        outputs[1][i] = inputs[1][i] * dryamt + s->legs[s->leg_count - 1].buffer[i] * wetamt;
-    m->pos += CBOX_BLOCK_SIZE;
+void reverb_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
+{
+    reverb_process_frames(module, inputs, outputs, CBOX_BLOCK_SIZE);
 }
 
 static void reverb_destroyfunc(struct cbox_module *module_)
@@ -296,6 +311,7 @@ MODULE_CREATE_FUNCTION(reverb)
     CALL_MODULE_INIT(m, 2, 2, reverb);
     m->module.process_event = reverb_process_event;
     m->module.process_block = reverb_process_block;
+    m->module.process_frames = reverb_process_frames;
     m->pos = 0;
     m->old_params = NULL;
     m->params = malloc(sizeof(struct reverb_params));
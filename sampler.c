@@ -46,33 +46,287 @@ static void sampler_process_block(struct cbox_module *module, cbox_sample_t **in
 static void sampler_process_event(struct cbox_module *module, const uint8_t *data, uint32_t len);
 static void sampler_destroyfunc(struct cbox_module *module);
 
+static const char *steal_policy_names[ssp_count] = { "oldest", "released", "quietest" };
+
+const char *sampler_steal_policy_to_string(enum sampler_steal_policy policy)
+{
+    return steal_policy_names[policy];
+}
+
+gboolean sampler_steal_policy_from_string(const char *name, enum sampler_steal_policy *policy)
+{
+    for (int i = 0; i < ssp_count; i++)
+    {
+        if (!strcmp(name, steal_policy_names[i]))
+        {
+            *policy = i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void sampler_steal_queue_link(struct sampler_module *m, struct sampler_voice *v, int bucket)
+{
+    v->steal_bucket = bucket;
+    if (bucket == -1)
+        return;
+    // Keep the bucket in start order. New voices go straight to the back,
+    // only an older voice changing buckets needs to walk past younger ones.
+    struct sampler_voice *prev = m->steal_tails[bucket];
+    while(prev && prev->serial_no > v->serial_no)
+        prev = prev->steal_prev;
+    v->steal_prev = prev;
+    v->steal_next = prev ? prev->steal_next : m->steal_heads[bucket];
+    if (prev)
+        prev->steal_next = v;
+    else
+        m->steal_heads[bucket] = v;
+    if (v->steal_next)
+        v->steal_next->steal_prev = v;
+    else
+        m->steal_tails[bucket] = v;
+    m->steal_bucket_mask |= 1 << bucket;
+}
+
+void sampler_steal_queue_unlink(struct sampler_module *m, struct sampler_voice *v)
+{
+    int bucket = v->steal_bucket;
+    if (bucket == -1)
+        return;
+    if (v->steal_prev)
+        v->steal_prev->steal_next = v->steal_next;
+    else
+        m->steal_heads[bucket] = v->steal_next;
+    if (v->steal_next)
+        v->steal_next->steal_prev = v->steal_prev;
+    else
+        m->steal_tails[bucket] = v->steal_prev;
+    if (!m->steal_heads[bucket])
+        m->steal_bucket_mask &= ~(1 << bucket);
+    v->steal_prev = NULL;
+    v->steal_next = NULL;
+    v->steal_bucket = -1;
+}
+
+// Age in blocks, plus how far a non-looping voice is into its sample
+// (released looping voices get a fixed bonus instead)
+static inline int sampler_voice_get_steal_score(struct sampler_module *m, struct sampler_voice *v)
+{
+    int age = m->serial_no - v->serial_no;
+    if (v->gen->loop_start == -1)
+    {
+        int progress = (int)((v->gen->bigpos >> 32) * (double)SAMPLER_STEAL_MAX_PROGRESS / v->gen->cur_sample_end);
+        age += progress < SAMPLER_STEAL_MAX_PROGRESS ? progress : SAMPLER_STEAL_MAX_PROGRESS;
+    }
+    else
+    if (v->released)
+        age += 10;
+    return age;
+}
+
 void sampler_steal_voice(struct sampler_module *m)
 {
-    int max_age = 0;
-    struct sampler_voice *voice_found = NULL;
-    for (int i = 0; i < 16; i++)
+    while(m->steal_bucket_mask)
     {
-        FOREACH_VOICE(m->channels[i].voices_running, v)
+        int bucket = __builtin_ctz(m->steal_bucket_mask);
+        int oldest = m->steal_heads[bucket]->serial_no;
+        int max_score = -1;
+        struct sampler_voice *voice_found = NULL;
+        // The bucket is in start order, so a voice started more than
+        // SAMPLER_STEAL_MAX_PROGRESS blocks after the oldest one can't win
+        for (struct sampler_voice *v = m->steal_heads[bucket], *next; v && v->serial_no - oldest <= SAMPLER_STEAL_MAX_PROGRESS; v = next)
         {
-            if (v->amp_env.cur_stage == 15)
+            next = v->steal_next;
+            // The voice may have entered the final fadeout since the last
+            // bucket update, drop it then
+            if (v->envs->amp_env.cur_stage == 15)
+            {
+                sampler_steal_queue_unlink(m, v);
                 continue;
-            int age = m->serial_no - v->serial_no;
-            if (v->gen.loop_start == -1)
-                age += (int)((v->gen.bigpos >> 32) * 100.0 / v->gen.cur_sample_end);
-            else
-            if (v->released)
-                age += 10;
-            if (age > max_age)
+            }
+            int score = sampler_voice_get_steal_score(m, v);
+            if (score > max_score)
             {
-                max_age = age;
+                max_score = score;
                 voice_found = v;
             }
         }
+        if (!voice_found)
+            continue;
+        sampler_steal_queue_unlink(m, voice_found);
+        voice_found->released = 1;
+        cbox_envelope_go_to(&voice_found->envs->amp_env, 15);
+        return;
     }
-    if (voice_found)
+}
+
+#define sampler_set_steal_policy_args(ARG) ARG(enum sampler_steal_policy, policy)
+
+DEFINE_RT_VOID_FUNC(sampler_module, m, sampler_set_steal_policy)
+{
+    m->steal_policy = policy;
+    // Rebuild the queues for the new policy. The running voice lists are
+    // newest first, so walk them from the end to insert in start order.
+    for (int i = 0; i < SAMPLER_STEAL_BUCKETS; i++)
+        m->steal_heads[i] = m->steal_tails[i] = NULL;
+    m->steal_bucket_mask = 0;
+    for (int i = 0; i < 16; i++)
     {
-        voice_found->released = 1;
-        cbox_envelope_go_to(&voice_found->amp_env, 15);
+        struct sampler_voice *v = m->channels[i].voices_running;
+        while(v && v->next)
+            v = v->next;
+        for (; v; v = v->prev)
+        {
+            v->steal_prev = v->steal_next = NULL;
+            sampler_steal_queue_link(m, v, sampler_voice_get_steal_bucket(m, v));
+        }
+    }
+}
+
+// Voices stolen when going over the polyphony limit still need to fade out,
+// so the pool is a bit larger than the polyphony setting
+static inline int get_voice_pool_size(int polyphony)
+{
+    return polyphony + (polyphony + 3) / 4;
+}
+
+static void *sampler_voice_arena_alloc(int voice_count, size_t item_size)
+{
+    void *ptr;
+    if (posix_memalign(&ptr, SAMPLER_VOICE_ALIGNMENT, voice_count * item_size))
+        return NULL;
+    memset(ptr, 0, voice_count * item_size);
+    return ptr;
+}
+
+static void sampler_voice_arena_destroy(struct sampler_voice_arena *arena)
+{
+    if (arena->pipe_stack)
+        cbox_prefetch_stack_destroy(arena->pipe_stack);
+    free(arena->colds);
+    free(arena->filters);
+    free(arena->envs);
+    free(arena->gens);
+    free(arena->voices);
+    free(arena);
+}
+
+static struct sampler_voice_arena *sampler_voice_arena_new(int voice_count)
+{
+    struct sampler_voice_arena *arena = calloc(1, sizeof(struct sampler_voice_arena));
+    if (!arena)
+        return NULL;
+    arena->voices = sampler_voice_arena_alloc(voice_count, sizeof(struct sampler_voice));
+    arena->gens = sampler_voice_arena_alloc(voice_count, sizeof(struct sampler_gen));
+    arena->envs = sampler_voice_arena_alloc(voice_count, sizeof(struct sampler_voice_envs));
+    arena->filters = sampler_voice_arena_alloc(voice_count, sizeof(struct sampler_voice_filters));
+    arena->colds = calloc(voice_count, sizeof(struct sampler_voice_cold));
+    if (!arena->voices || !arena->gens || !arena->envs || !arena->filters || !arena->colds)
+    {
+        sampler_voice_arena_destroy(arena);
+        return NULL;
+    }
+    arena->voice_count = voice_count;
+    arena->pipe_stack = cbox_prefetch_stack_new(cbox_wavebank_get_prefetch_service(), voice_count);
+    // The voices are pre-linked, so that adding them to the free list is O(1)
+    for (int i = 0; i < voice_count; i++)
+    {
+        struct sampler_voice *v = &arena->voices[i];
+        v->gen = &arena->gens[i];
+        v->envs = &arena->envs[i];
+        v->filters = &arena->filters[i];
+        v->gen->mode = spt_inactive;
+        v->steal_bucket = -1;
+        v->cold = &arena->colds[i];
+        v->cold->pipe_stack = arena->pipe_stack;
+        v->prev = i > 0 ? &arena->voices[i - 1] : NULL;
+        v->next = i < voice_count - 1 ? &arena->voices[i + 1] : NULL;
+    }
+    return arena;
+}
+
+#define sampler_add_voice_arena_args(ARG) ARG(struct sampler_voice_arena *, arena)
+
+DEFINE_RT_VOID_FUNC(sampler_module, m, sampler_add_voice_arena)
+{
+    struct sampler_voice *first = &arena->voices[0], *last = &arena->voices[arena->voice_count - 1];
+    last->next = m->voices_free;
+    if (m->voices_free)
+        m->voices_free->prev = last;
+    m->voices_free = first;
+    arena->next = m->voice_arenas;
+    m->voice_arenas = arena;
+    m->voice_count += arena->voice_count;
+}
+
+#define sampler_remove_idle_voice_arena_args(ARG) ARG(int, min_voice_count)
+
+// Detaches an arena that has no active voices, as long as the pool still
+// has at least min_voice_count voices afterwards
+DEFINE_RT_FUNC(struct sampler_voice_arena *, sampler_module, m, sampler_remove_idle_voice_arena)
+{
+    for (struct sampler_voice_arena **parena = &m->voice_arenas; *parena; parena = &(*parena)->next)
+    {
+        struct sampler_voice_arena *arena = *parena;
+        if (m->voice_count - arena->voice_count < min_voice_count)
+            continue;
+        gboolean idle = TRUE;
+        for (int i = 0; i < arena->voice_count && idle; i++)
+            idle = arena->gens[i].mode == spt_inactive;
+        if (!idle)
+            continue;
+        for (int i = 0; i < arena->voice_count; i++)
+            sampler_voice_unlink(&m->voices_free, &arena->voices[i]);
+        *parena = arena->next;
+        m->voice_count -= arena->voice_count;
+        return arena;
+    }
+    return NULL;
+}
+
+gboolean sampler_set_polyphony(struct sampler_module *m, int polyphony, GError **error)
+{
+    if (polyphony < 1 || polyphony > MAX_SAMPLER_VOICES)
+    {
+        g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Invalid polyphony %d (must be between 1 and %d)", polyphony, (int)MAX_SAMPLER_VOICES);
+        return FALSE;
+    }
+    int pool_size = get_voice_pool_size(polyphony);
+    if (pool_size > m->voice_count)
+    {
+        struct sampler_voice_arena *arena = sampler_voice_arena_new(pool_size - m->voice_count);
+        if (!arena)
+        {
+            g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Cannot allocate %d voices", pool_size - m->voice_count);
+            return FALSE;
+        }
+        sampler_add_voice_arena(m, arena);
+    }
+    m->max_voices = polyphony;
+    // Release the memory used by surplus voices, if possible; arenas that are
+    // still in use are kept until the next polyphony change
+    struct sampler_voice_arena *arena;
+    while((arena = sampler_remove_idle_voice_arena(m, pool_size)) != NULL)
+    {
+        m->freed_stream_underruns += cbox_prefetch_stack_get_underrun_count(arena->pipe_stack);
+        m->freed_stream_buffer_shortages += cbox_prefetch_stack_get_buffer_shortage_count(arena->pipe_stack);
+        sampler_voice_arena_destroy(arena);
+    }
+    return TRUE;
+}
+
+// Streaming statistics of all the arenas' pipe stacks
+static void sampler_get_stream_status(struct sampler_module *m, int *active_pipes, uint32_t *underruns, uint32_t *buffer_shortages)
+{
+    *active_pipes = 0;
+    *underruns = m->freed_stream_underruns;
+    *buffer_shortages = m->freed_stream_buffer_shortages;
+    for (struct sampler_voice_arena *arena = m->voice_arenas; arena; arena = arena->next)
+    {
+        *active_pipes += cbox_prefetch_stack_get_active_pipe_count(arena->pipe_stack);
+        *underruns += cbox_prefetch_stack_get_underrun_count(arena->pipe_stack);
+        *buffer_shortages += cbox_prefetch_stack_get_buffer_shortage_count(arena->pipe_stack);
     }
 }
 
@@ -85,6 +339,151 @@ static inline float clip01(float v)
     return v;
 }
 
+// Voices waiting to be rendered by the multi-voice resampler
+struct sampler_voice_batch
+{
+    int count;
+    // voices finished during parallel rendering are inactivated afterwards,
+    // on the calling thread
+    gboolean defer_inactivate;
+    struct sampler_voice *voices[SAMPLER_GEN_BATCH_MAX];
+    struct sampler_gen *gens[SAMPLER_GEN_BATCH_MAX];
+    float *leftright[SAMPLER_GEN_BATCH_MAX];
+    float buffers[SAMPLER_GEN_BATCH_MAX][2 * CBOX_BLOCK_SIZE];
+};
+
+static inline void sampler_voice_batch_init(struct sampler_voice_batch *b, gboolean defer_inactivate)
+{
+    b->count = 0;
+    b->defer_inactivate = defer_inactivate;
+    for (int i = 0; i < SAMPLER_GEN_BATCH_MAX; i++)
+        b->leftright[i] = b->buffers[i];
+}
+
+static void sampler_voice_batch_flush(struct sampler_voice_batch *b, struct sampler_module *m, cbox_sample_t **outputs)
+{
+    if (!b->count)
+        return;
+    sampler_gen_sample_playback_batch(b->gens, b->leftright, b->count);
+    for (int i = 0; i < b->count; i++)
+    {
+        if (b->defer_inactivate)
+            sampler_voice_mix(b->voices[i], m, outputs, b->buffers[i], CBOX_BLOCK_SIZE);
+        else
+            sampler_voice_finish(b->voices[i], m, outputs, b->buffers[i], CBOX_BLOCK_SIZE);
+    }
+    b->count = 0;
+}
+
+// Render a prepared voice, either directly or by adding it to one of the
+// batches (one per sample format - mono16, stereo16)
+static inline void sampler_render_voice(struct sampler_module *m, struct sampler_voice_batch *batches, struct sampler_voice *v, cbox_sample_t **outputs)
+{
+    if (!v->current_pipe && sampler_gen_is_batchable(v->gen))
+    {
+        struct sampler_voice_batch *b = &batches[v->gen->mode == spt_stereo16 ? 1 : 0];
+        b->voices[b->count] = v;
+        b->gens[b->count] = v->gen;
+        if (++b->count == SAMPLER_GEN_BATCH_MAX)
+            sampler_voice_batch_flush(b, m, outputs);
+    }
+    else
+    {
+        float leftright[2 * CBOX_BLOCK_SIZE];
+        uint32_t samples = sampler_voice_render(v, leftright);
+        if (batches[0].defer_inactivate)
+            sampler_voice_mix(v, m, outputs, leftright, samples);
+        else
+            sampler_voice_finish(v, m, outputs, leftright, samples);
+    }
+}
+
+// Voices past the modulation stage, waiting for their pitch and gain factors,
+// which are calculated 4 voices at a time
+struct sampler_voice_mod_batch
+{
+    int count;
+    struct sampler_voice *voices[4];
+    struct sampler_voice_mod mods[4];
+};
+
+static void sampler_voice_mod_batch_flush(struct sampler_voice_mod_batch *mb, struct sampler_module *m, struct sampler_voice_batch *batches, cbox_sample_t **outputs)
+{
+    cbox_v4sf pitch = {}, gain = {};
+    for (int i = 0; i < mb->count; i++)
+    {
+        pitch[i] = mb->mods[i].pitch * (1.f / 1200.f);
+        gain[i] = mb->mods[i].gain * (1.f / 6.f);
+    }
+    pitch = cbox_fast_exp2f_v4(pitch);
+    gain = cbox_fast_exp2f_v4(gain);
+    for (int i = 0; i < mb->count; i++)
+    {
+        struct sampler_voice *v = mb->voices[i];
+        sampler_voice_prepare_finish(v, m, &mb->mods[i], pitch[i], gain[i]);
+        if (m->render_pool)
+            m->render_voices[m->render_voice_count++] = v;
+        else
+            sampler_render_voice(m, batches, v, outputs);
+    }
+    mb->count = 0;
+}
+
+// Worker task: render a contiguous range of the prepared voices into the
+// task's own output buffers. Only the voices' own state is modified here.
+static void sampler_render_task(void *user_data, int task, int worker)
+{
+    struct sampler_module *m = user_data;
+    int channels = m->module.outputs;
+    float *buffers = m->render_buffers + task * channels * CBOX_BLOCK_SIZE;
+    cbox_sample_t *outputs[channels];
+    for (int c = 0; c < channels; c++)
+        outputs[c] = buffers + c * CBOX_BLOCK_SIZE;
+    memset(buffers, 0, channels * CBOX_BLOCK_SIZE * sizeof(float));
+
+    struct sampler_voice_batch batches[2];
+    sampler_voice_batch_init(&batches[0], TRUE);
+    sampler_voice_batch_init(&batches[1], TRUE);
+    int first = task * m->render_task_size;
+    int last = first + m->render_task_size;
+    if (last > m->render_voice_count)
+        last = m->render_voice_count;
+    for (int i = first; i < last; i++)
+        sampler_render_voice(m, batches, m->render_voices[i], outputs);
+    sampler_voice_batch_flush(&batches[0], m, outputs);
+    sampler_voice_batch_flush(&batches[1], m, outputs);
+}
+
+static void sampler_render_parallel(struct sampler_module *m, cbox_sample_t **outputs)
+{
+    int count = m->render_voice_count;
+    // The split depends only on the number of voices, and the task outputs
+    // are summed in task order, so the result doesn't depend on which thread
+    // rendered which task
+    int tasks = (count + SAMPLER_RENDER_MIN_TASK_VOICES - 1) / SAMPLER_RENDER_MIN_TASK_VOICES;
+    if (tasks > SAMPLER_RENDER_MAX_TASKS)
+        tasks = SAMPLER_RENDER_MAX_TASKS;
+    m->render_task_size = (count + tasks - 1) / tasks;
+    cbox_worker_pool_run(m->render_pool, sampler_render_task, m, tasks);
+
+    int channels = m->module.outputs;
+    for (int t = 0; t < tasks; t++)
+    {
+        float *buffers = m->render_buffers + t * channels * CBOX_BLOCK_SIZE;
+        for (int c = 0; c < channels; c++)
+        {
+            for (int i = 0; i < CBOX_BLOCK_SIZE; i++)
+                outputs[c][i] += buffers[c * CBOX_BLOCK_SIZE + i];
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        struct sampler_voice *v = m->render_voices[i];
+        if (v->gen->mode == spt_inactive)
+            sampler_voice_inactivate(v, FALSE);
+    }
+}
+
 void sampler_process_block(struct cbox_module *module, cbox_sample_t **inputs, cbox_sample_t **outputs)
 {
     struct sampler_module *m = (struct sampler_module *)module;
@@ -98,22 +497,46 @@ void sampler_process_block(struct cbox_module *module, cbox_sample_t **inputs, c
             outputs[oo][i] = outputs[oo + 1][i] = 0.f;
     }
     
+    // one batch per sample format (mono16, stereo16)
+    struct sampler_voice_batch batches[2];
+    sampler_voice_batch_init(&batches[0], FALSE);
+    sampler_voice_batch_init(&batches[1], FALSE);
+
+    // Voices are always prepared on this thread, in channel order, so that
+    // voice stealing and inactivation stay deterministic; only rendering,
+    // filtering and mixing are farmed out to the worker threads. Each voice
+    // is rendered after it and the 3 next ones have been through the
+    // modulation stage, so that their exp2 calls can share a vector.
+    struct sampler_voice_mod_batch mod_batch;
+    mod_batch.count = 0;
+    m->render_voice_count = 0;
     int vcount = 0, vrel = 0;
     for (int i = 0; i < 16; i++)
     {
         int cvcount = 0;
         FOREACH_VOICE(m->channels[i].voices_running, v)
         {
-            sampler_voice_process(v, m, outputs);
+            if (sampler_voice_prepare_mod(v, m, &mod_batch.mods[mod_batch.count]))
+            {
+                mod_batch.voices[mod_batch.count] = v;
+                if (++mod_batch.count == 4)
+                    sampler_voice_mod_batch_flush(&mod_batch, m, batches, outputs);
+            }
 
-            if (v->amp_env.cur_stage == 15)
+            if (v->envs->amp_env.cur_stage == 15)
                 vrel++;
             cvcount++;
         }
         m->channels[i].active_voices = cvcount;
         vcount += cvcount;
     }
+    sampler_voice_mod_batch_flush(&mod_batch, m, batches, outputs);
+    if (m->render_voice_count)
+        sampler_render_parallel(m, outputs);
+    sampler_voice_batch_flush(&batches[0], m, outputs);
+    sampler_voice_batch_flush(&batches[1], m, outputs);
     m->active_voices = vcount;
+    m->module.output_silent = !vcount;
     if (vcount - vrel > m->max_voices)
         sampler_steal_voice(m);
     m->serial_no++;
@@ -241,10 +664,10 @@ static int release_program_voices_execute(void *data)
                 // The voice is still going, so repeat until it fades out
                 finished = 0;
                 // If not in final fadeout stage, force final fadeout.
-                if (v->amp_env.cur_stage != 15)
+                if (v->envs->amp_env.cur_stage != 15)
                 {
                     v->released = 1;
-                    cbox_envelope_go_to(&v->amp_env, 15);
+                    cbox_envelope_go_to(&v->envs->amp_env, 15);
                 }
             }
         }
@@ -288,11 +711,11 @@ void sampler_register_program(struct sampler_module *m, struct sampler_program *
         select_initial_program(m);
 }
 
-static gboolean load_program_at(struct sampler_module *m, const char *cfg_section, const char *name, int prog_no, struct sampler_program **ppgm, GError **error)
+static gboolean load_program_at(struct sampler_module *m, const char *cfg_section, const char *name, int prog_no, struct sampler_program **ppgm, struct cbox_command_target *fb, GError **error)
 {
     struct sampler_program *pgm = NULL;
     int index = find_program(m, prog_no);
-    pgm = sampler_program_new_from_cfg(m, cfg_section, name, prog_no, error);
+    pgm = sampler_program_new_from_cfg(m, cfg_section, name, prog_no, fb, error);
     if (!pgm)
         return FALSE;
     
@@ -320,14 +743,14 @@ void sampler_unselect_program(struct sampler_module *m, struct sampler_program *
     }
 }
 
-static gboolean load_from_string(struct sampler_module *m, const char *sample_dir, const char *sfz_data, const char *name, int prog_no, struct sampler_program **ppgm, GError **error)
+static gboolean load_from_string(struct sampler_module *m, const char *sample_dir, const char *sfz_data, const char *name, int prog_no, struct sampler_program **ppgm, struct cbox_command_target *fb, GError **error)
 {
     int index = find_program(m, prog_no);
     struct sampler_program *pgm = sampler_program_new(m, prog_no, name, NULL, sample_dir, error);
     if (!pgm)
         return FALSE;
     pgm->source_file = g_strdup("string");
-    if (!sampler_module_load_program_sfz(m, pgm, sfz_data, TRUE, error))
+    if (!sampler_module_load_program_sfz(m, pgm, sfz_data, TRUE, fb, error))
     {
         free(pgm);
         return FALSE;
@@ -377,9 +800,17 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
                 return FALSE;
         }
         
+        int active_pipes;
+        uint32_t underruns, buffer_shortages;
+        sampler_get_stream_status(m, &active_pipes, &underruns, &buffer_shortages);
         return cbox_execute_on(fb, NULL, "/active_voices", "i", error, m->active_voices) &&
-            cbox_execute_on(fb, NULL, "/active_pipes", "i", error, cbox_prefetch_stack_get_active_pipe_count(m->pipe_stack)) &&
+            cbox_execute_on(fb, NULL, "/active_pipes", "i", error, active_pipes) &&
+            cbox_execute_on(fb, NULL, "/stream_underruns", "i", error, (int)underruns) &&
+            cbox_execute_on(fb, NULL, "/stream_buffer_shortages", "i", error, (int)buffer_shortages) &&
             cbox_execute_on(fb, NULL, "/polyphony", "i", error, m->max_voices) && 
+            cbox_execute_on(fb, NULL, "/allocated_voices", "i", error, m->voice_count) && 
+            cbox_execute_on(fb, NULL, "/steal_policy", "s", error, sampler_steal_policy_to_string(m->steal_policy)) && 
+            cbox_execute_on(fb, NULL, "/render_threads", "i", error, m->render_pool ? cbox_worker_pool_get_thread_count(m->render_pool) : 0) && 
             CBOX_OBJECT_DEFAULT_STATUS(&m->module, fb, error);
     }
     else
@@ -397,13 +828,17 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
     }
     else if (!strcmp(cmd->command, "/polyphony") && !strcmp(cmd->arg_types, "i"))
     {
-        int polyphony = CBOX_ARG_I(cmd, 0);
-        if (polyphony < 1 || polyphony > MAX_SAMPLER_VOICES)
+        return sampler_set_polyphony(m, CBOX_ARG_I(cmd, 0), error);
+    }
+    else if (!strcmp(cmd->command, "/steal_policy") && !strcmp(cmd->arg_types, "s"))
+    {
+        enum sampler_steal_policy policy;
+        if (!sampler_steal_policy_from_string(CBOX_ARG_S(cmd, 0), &policy))
         {
-            g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Invalid polyphony %d (must be between 1 and %d)", polyphony, (int)MAX_SAMPLER_VOICES);
+            g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Invalid steal policy '%s' (must be oldest, released or quietest)", CBOX_ARG_S(cmd, 0));
             return FALSE;
         }
-        m->max_voices = polyphony;
+        sampler_set_steal_policy(m, policy);
         return TRUE;
     }
     else if (!strcmp(cmd->command, "/set_patch") && !strcmp(cmd->arg_types, "ii"))
@@ -447,7 +882,7 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
     else if (!strcmp(cmd->command, "/load_patch") && !strcmp(cmd->arg_types, "iss"))
     {
         struct sampler_program *pgm = NULL;
-        if (!load_program_at(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_I(cmd, 0), &pgm, error))
+        if (!load_program_at(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_I(cmd, 0), &pgm, fb, error))
             return FALSE;
         if (fb)
             return cbox_execute_on(fb, NULL, "/uuid", "o", error, pgm);
@@ -457,7 +892,7 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
     {
         struct sampler_program *pgm = NULL;
         char *cfg_section = g_strdup_printf("spgm:!%s", CBOX_ARG_S(cmd, 1));
-        gboolean res = load_program_at(m, cfg_section, CBOX_ARG_S(cmd, 2), CBOX_ARG_I(cmd, 0), &pgm, error);
+        gboolean res = load_program_at(m, cfg_section, CBOX_ARG_S(cmd, 2), CBOX_ARG_I(cmd, 0), &pgm, fb, error);
         g_free(cfg_section);
         if (res && pgm && fb)
             return cbox_execute_on(fb, NULL, "/uuid", "o", error, pgm);
@@ -466,7 +901,7 @@ gboolean sampler_process_cmd(struct cbox_command_target *ct, struct cbox_command
     else if (!strcmp(cmd->command, "/load_patch_from_string") && !strcmp(cmd->arg_types, "isss"))
     {
         struct sampler_program *pgm = NULL; 
-        if (!load_from_string(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_S(cmd, 3), CBOX_ARG_I(cmd, 0), &pgm, error))
+        if (!load_from_string(m, CBOX_ARG_S(cmd, 1), CBOX_ARG_S(cmd, 2), CBOX_ARG_S(cmd, 3), CBOX_ARG_I(cmd, 0), &pgm, fb, error))
             return FALSE;
         if (fb && pgm)
             return cbox_execute_on(fb, NULL, "/uuid", "o", error, pgm);
@@ -508,12 +943,25 @@ MODULE_CREATE_FUNCTION(sampler)
         inited = 1;
     }
     
-    int max_voices = cbox_config_get_int(cfg_section, "polyphony", MAX_SAMPLER_VOICES);
+    int max_voices = cbox_config_get_int(cfg_section, "polyphony", DEFAULT_SAMPLER_POLYPHONY);
     if (max_voices < 1 || max_voices > MAX_SAMPLER_VOICES)
     {
         g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_INVALID_LAYER, "%s: invalid polyphony value", cfg_section);
         return NULL;
     }
+    enum sampler_steal_policy steal_policy = ssp_released;
+    const char *steal_policy_name = cbox_config_get_string(cfg_section, "steal_policy");
+    if (steal_policy_name && !sampler_steal_policy_from_string(steal_policy_name, &steal_policy))
+    {
+        g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_INVALID_LAYER, "%s: invalid steal policy '%s'", cfg_section, steal_policy_name);
+        return NULL;
+    }
+    int render_threads = cbox_config_get_int(cfg_section, "render_threads", 0);
+    if (render_threads < 0 || render_threads > CBOX_WORKER_POOL_MAX_THREADS)
+    {
+        g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_INVALID_LAYER, "%s: invalid render thread count", cfg_section);
+        return NULL;
+    }
     int output_pairs = cbox_config_get_int(cfg_section, "output_pairs", 1);
     if (output_pairs < 1 || output_pairs > 16)
     {
@@ -536,12 +984,44 @@ MODULE_CREATE_FUNCTION(sampler)
     m->module.process_block = sampler_process_block;
     m->programs = NULL;
     m->max_voices = max_voices;
+    m->steal_policy = steal_policy;
+    m->steal_bucket_mask = 0;
     m->serial_no = 0;
     m->deleting = FALSE;
-    // XXXKF read defaults from some better place, like config
-    // XXXKF allow dynamic change of the number of the pipes
-    m->pipe_stack = cbox_prefetch_stack_new(MAX_SAMPLER_VOICES, cbox_config_get_int("streaming", "streambuf_size", 65536));
+    m->voices_free = NULL;
+    m->voice_arenas = NULL;
+    m->voice_count = 0;
+    m->freed_stream_underruns = 0;
+    m->freed_stream_buffer_shortages = 0;
+    struct sampler_voice_arena *arena = sampler_voice_arena_new(get_voice_pool_size(max_voices));
+    if (!arena)
+    {
+        g_set_error(error, CBOX_SAMPLER_ERROR, CBOX_SAMPLER_ERROR_FAILED, "%s: cannot allocate voices", cfg_section);
+        free(m);
+        return NULL;
+    }
+    m->voice_arenas = arena;
+    m->voices_free = &arena->voices[0];
+    m->voice_count = arena->voice_count;
+    m->render_pool = NULL;
+    m->render_voices = NULL;
+    m->render_buffers = NULL;
+    if (render_threads)
+    {
+        // the worker threads help the audio thread, so they should run at
+        // a similar priority
+        m->render_pool = cbox_worker_pool_new(render_threads, cbox_config_get_int(cfg_section, "render_thread_priority", CBOX_WORKER_POOL_DEFAULT_PRIORITY), error);
+        if (!m->render_pool)
+        {
+            sampler_voice_arena_destroy(m->voice_arenas);
+            free(m);
+            return NULL;
+        }
+        m->render_voices = malloc(get_voice_pool_size(MAX_SAMPLER_VOICES) * sizeof(struct sampler_voice *));
+        m->render_buffers = malloc(SAMPLER_RENDER_MAX_TASKS * m->module.outputs * CBOX_BLOCK_SIZE * sizeof(float));
+    }
     m->disable_mixer_controls = cbox_config_get_int("sampler", "disable_mixer_controls", 0);
+    sampler_gen_batch_init();
 
     float srate = m->module.srate;
     for (i = 0; i < 12800; i++)
@@ -592,7 +1072,7 @@ MODULE_CREATE_FUNCTION(sampler)
             pgm_section = g_strdup_printf("spgm:%s", pgm_name);
         }
         
-        m->programs[i] = sampler_program_new_from_cfg(m, pgm_section, pgm_section + 5, pgm_id, error);
+        m->programs[i] = sampler_program_new_from_cfg(m, pgm_section, pgm_section + 5, pgm_id, NULL, error);
         g_free(pgm_section);
         if (!m->programs[i])
         {
@@ -603,17 +1083,16 @@ MODULE_CREATE_FUNCTION(sampler)
     if (!success)
     {
         // XXXKF free programs/layers, first ensuring that they're fully initialised
+        sampler_voice_arena_destroy(m->voice_arenas);
+        if (m->render_pool)
+        {
+            cbox_worker_pool_destroy(m->render_pool);
+            free(m->render_voices);
+            free(m->render_buffers);
+        }
         free(m);
         return NULL;
     }
-    m->voices_free = NULL;
-    memset(m->voices_all, 0, sizeof(m->voices_all));
-    for (i = 0; i < MAX_SAMPLER_VOICES; i++)
-    {
-        struct sampler_voice *v = &m->voices_all[i];
-        v->gen.mode = spt_inactive;
-        sampler_voice_link(&m->voices_free, v);
-    }
     m->active_voices = 0;
     
     for (i = 0; i < 16; i++)
@@ -658,8 +1137,19 @@ void sampler_destroyfunc(struct cbox_module *module)
     {
         assert (m->channels[i].voices_running == NULL);
     }
-    cbox_prefetch_stack_destroy(m->pipe_stack);
+    if (m->render_pool)
+    {
+        cbox_worker_pool_destroy(m->render_pool);
+        free(m->render_voices);
+        free(m->render_buffers);
+    }
     free(m->programs);
+    while(m->voice_arenas)
+    {
+        struct sampler_voice_arena *arena = m->voice_arenas;
+        m->voice_arenas = arena->next;
+        sampler_voice_arena_destroy(arena);
+    }
 }
 
 #define MAKE_TO_STRING_CONTENT(name, v) \
@@ -732,21 +1222,21 @@ void sampler_nif_vel2env(struct sampler_noteinitfunc *nif, struct sampler_voice
     switch(env_type)
     {
         case 0:
-            env = &v->amp_env;
+            env = &v->envs->amp_env;
             break;
         case 1:
-            env = &v->filter_env;
+            env = &v->envs->filter_env;
             break;
         case 2:
-            env = &v->pitch_env;
+            env = &v->envs->pitch_env;
             break;
         default:
             assert(0);
     }
-    if (env->shape != &v->dyn_envs[env_type])
+    if (env->shape != &v->cold->dyn_envs[env_type])
     {
-        memcpy(&v->dyn_envs[env_type], env->shape, sizeof(struct cbox_envelope_shape));
-        env->shape = &v->dyn_envs[env_type];
+        memcpy(&v->cold->dyn_envs[env_type], env->shape, sizeof(struct cbox_envelope_shape));
+        env->shape = &v->cold->dyn_envs[env_type];
     }
     float param = nif->param * v->vel * (1.0 / 127.0);
     if ((nif->variant & 15) == 4)
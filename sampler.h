@@ -27,9 +27,30 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "sampler_layer.h"
 #include "sampler_prg.h"
 #include "wavebank.h"
+#include "workerpool.h"
 #include <stdint.h>
 
-#define MAX_SAMPLER_VOICES 128
+// Upper limit of the polyphony setting; the voice pool itself is allocated
+// according to the actual polyphony
+#define MAX_SAMPLER_VOICES 4096
+#define DEFAULT_SAMPLER_POLYPHONY 128
+#define SAMPLER_VOICE_ALIGNMENT 64
+// Parallel rendering splits the prepared voices into at most this many tasks,
+// each mixed into its own set of output buffers
+#define SAMPLER_RENDER_MAX_TASKS 32
+#define SAMPLER_RENDER_MIN_TASK_VOICES 8
+#define SAMPLER_STEAL_BUCKETS 8
+// Voices not looping are more stealable the further they are into the
+// sample, by up to this many blocks of age
+#define SAMPLER_STEAL_MAX_PROGRESS 100
+
+enum sampler_steal_policy
+{
+    ssp_oldest, // steal the voice that was started first
+    ssp_released, // steal the oldest released voice, then the oldest held one
+    ssp_quietest, // steal the voice with lowest amp envelope level (6 dB steps), then the oldest
+    ssp_count,
+};
 
 #define CBOX_SAMPLER_ERROR cbox_sampler_error_quark()
 
@@ -45,6 +66,7 @@ struct sampler_noteinitfunc;
 struct sampler_voice;
 
 #define GET_RT_FROM_sampler_channel(channel) ((channel)->module->module.rt)
+#define GET_RT_FROM_sampler_module(m) ((m)->module.rt)
 
 struct sampler_channel
 {
@@ -73,8 +95,9 @@ struct sampler_lfo
 struct sampler_gen
 {
     enum sampler_player_type mode;
-    int16_t *sample_data;
-    int16_t *scratch;
+    // in the format given by mode
+    const void *sample_data;
+    const void *scratch;
     
     uint64_t bigpos, bigdelta;
     uint64_t virtpos, virtdelta;
@@ -91,61 +114,145 @@ struct sampler_gen
     float stretching_jump;
     float stretching_crossfade;
     uint32_t play_count, loop_count;
-    int16_t scratch_bandlimited[2 * MAX_INTERPOLATION_ORDER * 2];
+    float scratch_bandlimited[2 * MAX_INTERPOLATION_ORDER * CBOX_WAVEFORM_MAX_FRAME_SIZE / sizeof(float)];
     
     // Streaming mode only
-    int16_t *streaming_buffer;
+    const void *streaming_buffer;
     uint32_t consumed, consumed_credit, streaming_buffer_frames;
     gboolean prefetch_only_loop, in_streaming_buffer;
 };
 
+// Rarely accessed per-voice state, kept out of struct sampler_voice so that
+// the render loop doesn't drag it through the cache
+struct sampler_voice_cold
+{
+    struct cbox_envelope_shape dyn_envs[3]; // amp, filter, pitch
+    struct cbox_biquadf_state eq_left[3], eq_right[3];
+    struct cbox_biquadf_coeffs eq_coeffs[3];
+    // waveform whose preload region the voice is using, see cbox_waveform_acquire
+    struct cbox_waveform *held_waveform;
+    // the stack of the voice's arena, the pipes are returned to their own
+    struct cbox_prefetch_stack *pipe_stack;
+};
+
+// Envelope state of a voice, see struct sampler_voice_arena
+struct sampler_voice_envs
+{
+    struct cbox_envelope amp_env, filter_env, pitch_env;
+};
+
+// Filter and tone control state of a voice, see struct sampler_voice_arena
+struct sampler_voice_filters
+{
+    struct cbox_biquadf_state filter_left, filter_right;
+    struct cbox_biquadf_state filter_left2, filter_right2;
+    struct cbox_biquadf_coeffs filter_coeffs, filter_coeffs_extra;
+    // coefficients at the end of the previous block; the filters ramp from
+    // these to filter_coeffs(_extra) over each block
+    struct cbox_biquadf_coeffs filter_coeffs_prev, filter_coeffs_extra_prev;
+    // quantised cutoff and resonance that filter_coeffs were computed for,
+    // (uint32_t)-1 after a layer change; likewise the tone control setting
+    // of onepole_coeffs (FLT_MAX after a layer change)
+    uint32_t filter_key;
+    float last_tonectl;
+    struct cbox_onepolef_state onepole_left, onepole_right;
+    struct cbox_onepolef_coeffs onepole_coeffs;
+};
+
+// Filters, tone control, EQ and mixing of one block of a voice, specialised
+// for the layer's settings, see sampler_voice_select_mix_func
+typedef void (*sampler_voice_mix_func)(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright);
+
 struct sampler_voice
 {
+    // Hot data - touched by every block of the render loop, in roughly the
+    // order it is accessed
     struct sampler_voice *prev, *next;
     struct sampler_layer_data *layer;
-    // Note: may be NULL when program is being deleted
-    struct sampler_program *program;
-    struct cbox_waveform *last_waveform;
-    struct sampler_gen gen;
-    struct cbox_prefetch_pipe *current_pipe;
-    int note;
-    int vel;
-    int released, released_with_sustain, released_with_sostenuto, captured_sostenuto;
-    int off_by;
+    struct sampler_channel *channel;
+    // per-block DSP state, stored in the arrays of the voice's arena
+    struct sampler_gen *gen;
+    struct sampler_voice_envs *envs;
+    struct sampler_voice_filters *filters;
     int delay;
     int age;
+    int released;
     float pitch_shift;
     float cutoff_shift;
     float gain_shift, gain_fromvel;
-    struct cbox_biquadf_state filter_left, filter_right;
-    struct cbox_biquadf_state filter_left2, filter_right2;
-    struct cbox_biquadf_coeffs filter_coeffs, filter_coeffs_extra;
-    struct cbox_onepolef_state onepole_left, onepole_right;
-    struct cbox_onepolef_coeffs onepole_coeffs;
-    struct sampler_channel *channel;
-    struct cbox_envelope amp_env, filter_env, pitch_env;
     struct sampler_lfo amp_lfo, filter_lfo, pitch_lfo;
-    enum sampler_loop_mode loop_mode;
     int output_pair_no;
     int send1bus, send2bus;
     float send1gain, send2gain;
-    int serial_no;
-    struct cbox_envelope_shape dyn_envs[3]; // amp, filter, pitch
-    struct cbox_biquadf_state eq_left[3], eq_right[3];
-    struct cbox_biquadf_coeffs eq_coeffs[3];
+    uint32_t last_eq_bitmask;
     gboolean layer_changed;
+    sampler_voice_mix_func mix_func;
+    struct cbox_prefetch_pipe *current_pipe;
+
+    // Warm data - note on/off handling, voice stealing and layer updates
+    // Note: may be NULL when program is being deleted
+    struct sampler_program *program;
+    struct cbox_waveform *last_waveform;
+    // preloaded_frames of the waveform at the time the voice was started
+    // (it may be changed by the wavebank while the voice is playing)
+    uint32_t preloaded_frames;
+    int note;
+    int vel;
+    int released_with_sustain, released_with_sostenuto, captured_sostenuto;
+    int off_by;
+    enum sampler_loop_mode loop_mode;
     int last_level;
     uint64_t last_level_min_rate;
-    uint32_t last_eq_bitmask;
     float reloffset;
     uint32_t offset;
+    // voice stealing queue, bucket is -1 if not stealable (inactive or in final fadeout)
+    struct sampler_voice *steal_prev, *steal_next;
+    int steal_bucket;
+    // value of the module's serial_no when the voice was started
+    int serial_no;
+
+    struct sampler_voice_cold *cold;
+} __attribute__((aligned(SAMPLER_VOICE_ALIGNMENT)));
+
+// A block of voices allocated in one go, cache line aligned. The per-block
+// DSP state (generator, envelopes, filters) is split into one array each,
+// indexed like voices, so that the render loop reads it in long contiguous
+// runs instead of picking it out of the much larger voice structures; the
+// cold parts are a separate array too. Each arena leases one streaming pipe
+// per voice from the shared prefetch service, so that the voices added by
+// raising the polyphony can stream too, and the pipes are released with the
+// arena.
+struct sampler_voice_arena
+{
+    struct sampler_voice_arena *next;
+    int voice_count;
+    struct cbox_prefetch_stack *pipe_stack;
+    struct sampler_voice *voices;
+    struct sampler_gen *gens;
+    struct sampler_voice_envs *envs;
+    struct sampler_voice_filters *filters;
+    struct sampler_voice_cold *colds;
+};
+
+// Modulation results of one voice for the current block, passed from
+// sampler_voice_prepare_mod to sampler_voice_prepare_finish
+struct sampler_voice_mod
+{
+    float pitch; // cents
+    float gain; // dB
+    float cutoff;
+    float resonance;
+    float tonectl;
+    float ampenv;
 };
 
 struct sampler_module
 {
     struct cbox_module module;
 
-    struct sampler_voice *voices_free, voices_all[MAX_SAMPLER_VOICES];
+    struct sampler_voice *voices_free;
+    struct sampler_voice_arena *voice_arenas;
+    int voice_count;
     struct sampler_channel channels[16];
     struct sampler_program **programs;
     int program_count;
@@ -155,7 +262,18 @@ struct sampler_module
     uint32_t current_time;
     gboolean deleting;
     int disable_mixer_controls;
-    struct cbox_prefetch_stack *pipe_stack;
+    // streaming problems counted by the pipes of arenas already freed
+    uint32_t freed_stream_underruns, freed_stream_buffer_shortages;
+    enum sampler_steal_policy steal_policy;
+    // Stealable voices per bucket, in start order (oldest first); the lowest
+    // non-empty bucket is stolen from first
+    struct sampler_voice *steal_heads[SAMPLER_STEAL_BUCKETS], *steal_tails[SAMPLER_STEAL_BUCKETS];
+    uint32_t steal_bucket_mask;
+    // optional parallel rendering; NULL if disabled
+    struct cbox_worker_pool *render_pool;
+    struct sampler_voice **render_voices;
+    int render_voice_count, render_task_size;
+    float *render_buffers;
     struct cbox_sincos sincos[12800];
 };
 
@@ -185,11 +303,28 @@ extern void sampler_channel_process_cc(struct sampler_channel *c, int cc, int va
 extern void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, struct sampler_layer_data *l, int note, int vel, int *exgroups, int *pexgroupcount);
 extern void sampler_voice_release(struct sampler_voice *v, gboolean is_polyaft);
 extern void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs);
+extern gboolean sampler_voice_prepare(struct sampler_voice *v, struct sampler_module *m);
+// The two halves of sampler_voice_prepare; the caller converts mod->pitch
+// (cents) and mod->gain (dB) to factors, so that it can do it for several
+// voices at once
+extern gboolean sampler_voice_prepare_mod(struct sampler_voice *v, struct sampler_module *m, struct sampler_voice_mod *mod);
+extern void sampler_voice_prepare_finish(struct sampler_voice *v, struct sampler_module *m, const struct sampler_voice_mod *mod, float pitch_factor, float gain_factor);
+extern uint32_t sampler_voice_render(struct sampler_voice *v, float *leftright);
+extern void sampler_voice_mix(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright, uint32_t samples);
+extern void sampler_voice_finish(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright, uint32_t samples);
 extern void sampler_voice_link(struct sampler_voice **pv, struct sampler_voice *v);
 extern void sampler_voice_unlink(struct sampler_voice **pv, struct sampler_voice *v);
 extern void sampler_voice_inactivate(struct sampler_voice *v, gboolean expect_active);
 extern void sampler_voice_update_params_from_layer(struct sampler_voice *v);
 
+extern gboolean sampler_set_polyphony(struct sampler_module *m, int polyphony, GError **error);
+extern void sampler_steal_voice(struct sampler_module *m);
+extern void sampler_set_steal_policy(struct sampler_module *m, enum sampler_steal_policy policy);
+extern void sampler_steal_queue_link(struct sampler_module *m, struct sampler_voice *v, int bucket);
+extern void sampler_steal_queue_unlink(struct sampler_module *m, struct sampler_voice *v);
+extern const char *sampler_steal_policy_to_string(enum sampler_steal_policy policy);
+extern gboolean sampler_steal_policy_from_string(const char *name, enum sampler_steal_policy *policy);
+
 extern float sampler_sine_wave[2049];
 
 static inline int sampler_channel_addcc(struct sampler_channel *c, int cc_no)
@@ -200,5 +335,43 @@ static inline int sampler_channel_addcc(struct sampler_channel *c, int cc_no)
 #define FOREACH_VOICE(var, p) \
     for (struct sampler_voice *p = (var), *p##_next = NULL; p && (p##_next = p->next, TRUE); p = p##_next)
 
+// Bucket the voice should be in for the current steal policy, -1 if it should not be stolen at all
+static inline int sampler_voice_get_steal_bucket(struct sampler_module *m, struct sampler_voice *v)
+{
+    if (v->envs->amp_env.cur_stage == 15)
+        return -1;
+    switch(m->steal_policy)
+    {
+    case ssp_released:
+        return v->released ? 0 : 1;
+    case ssp_quietest:
+        // delay, attack and hold stages count as loudest
+        if (!v->released && v->envs->amp_env.cur_stage < 3)
+            return SAMPLER_STEAL_BUCKETS - 1;
+        // silent (decayed, or sustain level 0) - frexp would give exponent 0
+        else if (v->envs->amp_env.cur_value <= 0)
+            return 0;
+        else
+        {
+            int exponent;
+            frexp(v->envs->amp_env.cur_value * 0.01, &exponent);
+            // released voices are treated as 12 dB quieter
+            int bucket = exponent + SAMPLER_STEAL_BUCKETS - 1 - (v->released ? 2 : 0);
+            return bucket < 0 ? 0 : (bucket >= SAMPLER_STEAL_BUCKETS ? SAMPLER_STEAL_BUCKETS - 1 : bucket);
+        }
+    default:
+        return 0;
+    }
+}
+
+static inline void sampler_voice_update_steal_bucket(struct sampler_module *m, struct sampler_voice *v)
+{
+    int bucket = sampler_voice_get_steal_bucket(m, v);
+    if (__builtin_expect(bucket != v->steal_bucket, 0))
+    {
+        sampler_steal_queue_unlink(m, v);
+        sampler_steal_queue_link(m, v, bucket);
+    }
+}
 
 #endif
@@ -160,7 +160,7 @@ void sampler_channel_release_groups(struct sampler_channel *c, int note, int exg
                     if (v->layer->off_mode == som_fast)
                     {
                         v->released = 1;
-                        cbox_envelope_go_to(&v->amp_env, 15);
+                        cbox_envelope_go_to(&v->envs->amp_env, 15);
                     }
                     else
                     {
@@ -196,7 +196,9 @@ void sampler_channel_start_note(struct sampler_channel *c, int note, int vel, gb
     struct sampler_program *prg = c->program;
     if (!prg || !prg->rll || prg->deleting)
         return;
-    GSList *next_layer = sampler_program_get_next_layer(prg, c, !is_release_trigger ? prg->rll->layers : prg->rll->layers_release, note, vel, random, is_first);
+    struct sampler_rll_index *idx = !is_release_trigger ? &prg->rll->index : &prg->rll->index_release;
+    sampler_rll_index_update_keyswitches(idx, note, is_first);
+    struct sampler_layer **next_layer = sampler_program_get_next_layer(prg, c, sampler_rll_index_get_candidates(idx, note, vel), note, vel, random, is_first);
     if (!next_layer)
     {
         if (!is_release_trigger)
@@ -210,11 +212,11 @@ void sampler_channel_start_note(struct sampler_channel *c, int note, int vel, gb
     
     FOREACH_VOICE(m->voices_free, v)
     {
-        struct sampler_layer *l = next_layer->data;
+        struct sampler_layer *l = *next_layer;
         // Maybe someone forgot to call sampler_update_layer?
         assert(l->runtime);
         sampler_voice_start(v, c, l->runtime, note, vel, exgroups, &exgroupcount);
-        next_layer = sampler_program_get_next_layer(prg, c, g_slist_next(next_layer), note, vel, random, is_first);
+        next_layer = sampler_program_get_next_layer(prg, c, next_layer + 1, note, vel, random, is_first);
         if (!next_layer)
             break;
     }
@@ -23,6 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "module.h"
 #include "rt.h"
 #include "sampler.h"
+#include "sampler_impl.h"
 #include "sfzloader.h"
 #include <assert.h>
 #include <errno.h>
@@ -245,7 +246,119 @@ static inline void process_voice_stereo_noloop(struct sampler_gen *v, struct res
 
 #endif
 
-static inline uint32_t process_voice_noloop(struct sampler_gen *v, struct resampler_state *rs, const int16_t *srcdata, uint32_t pos_offset, uint32_t usable_sample_end)
+// Kernels for the wider sample formats. These are plain C for every
+// architecture - the sample conversion cost is paid on every fetch, in
+// exchange for the smaller memory footprint (24-bit) or for no conversion
+// at load time (float). Both formats are in the int16 scale.
+
+static inline float sample_fetch_s24(const void *data, uint32_t index)
+{
+    const uint8_t *p = (const uint8_t *)data + 3 * index;
+    return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) * (1.f / 65536.f);
+}
+
+static inline float sample_fetch_f32(const void *data, uint32_t index)
+{
+    return ((const float *)data)[index];
+}
+
+#define GENERIC_KERNELS(suffix, FETCH) \
+static void process_voice_mono_noloop_##suffix(struct sampler_gen *v, struct resampler_state *rs, const void *srcdata, int endpos) \
+{ \
+    const float ffrac = 1.0f / 6.0f; \
+    const float scaler = 1.f / 16777216.f; \
+    for (int i = rs->offset; i < endpos; i++) \
+    { \
+        float t = ((v->bigpos >> 8) & 0x00FFFFFF) * scaler; \
+        uint32_t idx = v->bigpos >> 32; \
+        float p0 = FETCH(srcdata, idx), p1 = FETCH(srcdata, idx + 1), p2 = FETCH(srcdata, idx + 2), p3 = FETCH(srcdata, idx + 3); \
+        float b0 = -t*(t-1.f)*(t-2.f); \
+        float b1 = 3.f*(t+1.f)*(t-1.f)*(t-2.f); \
+        float c = (b0 * p0 + b1 * p1 - 3.f*(t+1.f)*t*(t-2.f) * p2 + (t+1.f)*t*(t-1.f) * p3) * ffrac; \
+        rs->leftright[2 * i] = rs->lgain * c; \
+        rs->leftright[2 * i + 1] = rs->rgain * c; \
+        rs->lgain += rs->lgain_delta; \
+        rs->rgain += rs->rgain_delta; \
+        v->bigpos += v->bigdelta; \
+    } \
+    rs->offset = endpos; \
+} \
+\
+static void process_voice_stereo_noloop_##suffix(struct sampler_gen *v, struct resampler_state *rs, const void *srcdata, int endpos) \
+{ \
+    const float ffrac = 1.0f / 6.0f; \
+    const float scaler = 1.f / 16777216.f; \
+    for (int i = rs->offset; i < endpos; i++) \
+    { \
+        float t = ((v->bigpos >> 8) & 0x00FFFFFF) * scaler; \
+        uint32_t idx = (v->bigpos >> 31) & ~1; \
+        float b0 = -t*(t-1.f)*(t-2.f); \
+        float b1 = 3.f*(t+1.f)*(t-1.f)*(t-2.f); \
+        float b2 = -3.f*(t+1.f)*t*(t-2.f); \
+        float b3 = (t+1.f)*t*(t-1.f); \
+        float c0 = (b0 * FETCH(srcdata, idx) + b1 * FETCH(srcdata, idx + 2) + b2 * FETCH(srcdata, idx + 4) + b3 * FETCH(srcdata, idx + 6)) * ffrac; \
+        float c1 = (b0 * FETCH(srcdata, idx + 1) + b1 * FETCH(srcdata, idx + 3) + b2 * FETCH(srcdata, idx + 5) + b3 * FETCH(srcdata, idx + 7)) * ffrac; \
+        rs->leftright[2 * i] = rs->lgain * c0; \
+        rs->leftright[2 * i + 1] = rs->rgain * c1; \
+        rs->lgain += rs->lgain_delta; \
+        rs->rgain += rs->rgain_delta; \
+        v->bigpos += v->bigdelta; \
+    } \
+    rs->offset = endpos; \
+}
+
+GENERIC_KERNELS(s24, sample_fetch_s24)
+GENERIC_KERNELS(f32, sample_fetch_f32)
+
+// Playback at exactly the sample's rate, starting on a whole frame. The
+// cubic interpolator returns the second of its 4 input frames unchanged
+// when the fraction is 0, so this is just a copy with gain.
+
+static inline float sample_fetch_s16(const void *data, uint32_t index)
+{
+    return ((const int16_t *)data)[index];
+}
+
+#define UNITY_KERNELS(suffix, FETCH) \
+static void process_voice_mono_unity_##suffix(struct sampler_gen *v, struct resampler_state *rs, const void *srcdata, int endpos) \
+{ \
+    uint32_t idx = (v->bigpos >> 32) + 1; \
+    for (int i = rs->offset; i < endpos; i++, idx++) \
+    { \
+        float c = FETCH(srcdata, idx); \
+        rs->leftright[2 * i] = rs->lgain * c; \
+        rs->leftright[2 * i + 1] = rs->rgain * c; \
+        rs->lgain += rs->lgain_delta; \
+        rs->rgain += rs->rgain_delta; \
+    } \
+    v->bigpos += (uint64_t)(endpos - rs->offset) << 32; \
+    rs->offset = endpos; \
+} \
+\
+static void process_voice_stereo_unity_##suffix(struct sampler_gen *v, struct resampler_state *rs, const void *srcdata, int endpos) \
+{ \
+    uint32_t idx = 2 * ((v->bigpos >> 32) + 1); \
+    for (int i = rs->offset; i < endpos; i++, idx += 2) \
+    { \
+        rs->leftright[2 * i] = rs->lgain * FETCH(srcdata, idx); \
+        rs->leftright[2 * i + 1] = rs->rgain * FETCH(srcdata, idx + 1); \
+        rs->lgain += rs->lgain_delta; \
+        rs->rgain += rs->rgain_delta; \
+    } \
+    v->bigpos += (uint64_t)(endpos - rs->offset) << 32; \
+    rs->offset = endpos; \
+}
+
+UNITY_KERNELS(s16, sample_fetch_s16)
+UNITY_KERNELS(s24, sample_fetch_s24)
+UNITY_KERNELS(f32, sample_fetch_f32)
+
+static inline gboolean sampler_gen_is_unity(struct sampler_gen *v)
+{
+    return v->bigdelta == ((uint64_t)1 << 32) && !(uint32_t)v->bigpos;
+}
+
+static inline uint32_t process_voice_noloop(struct sampler_gen *v, struct resampler_state *rs, const void *srcdata, uint32_t pos_offset, uint32_t usable_sample_end)
 {
     uint32_t out_frames = CBOX_BLOCK_SIZE - rs->offset;
 
@@ -257,10 +370,30 @@ static inline uint32_t process_voice_noloop(struct sampler_gen *v, struct resamp
     
     assert(out_frames > 0 && out_frames <= CBOX_BLOCK_SIZE - rs->offset);
     uint32_t oldpos = v->bigpos >> 32;
-    if (v->mode == spt_stereo16)
-        process_voice_stereo_noloop(v, rs, srcdata - (pos_offset << 1), rs->offset + out_frames);
-    else
-        process_voice_mono_noloop(v, rs, srcdata - pos_offset, rs->offset + out_frames);
+    const void *src = (const uint8_t *)srcdata - pos_offset * sampler_player_type_get_frame_size(v->mode);
+    uint32_t endpos = rs->offset + out_frames;
+    if (sampler_gen_is_unity(v))
+    {
+        switch(v->mode)
+        {
+            case spt_stereo16: process_voice_stereo_unity_s16(v, rs, src, endpos); break;
+            case spt_mono24: process_voice_mono_unity_s24(v, rs, src, endpos); break;
+            case spt_stereo24: process_voice_stereo_unity_s24(v, rs, src, endpos); break;
+            case spt_monof: process_voice_mono_unity_f32(v, rs, src, endpos); break;
+            case spt_stereof: process_voice_stereo_unity_f32(v, rs, src, endpos); break;
+            default: process_voice_mono_unity_s16(v, rs, src, endpos); break;
+        }
+        return (v->bigpos >> 32) - oldpos;
+    }
+    switch(v->mode)
+    {
+        case spt_stereo16: process_voice_stereo_noloop(v, rs, src, endpos); break;
+        case spt_mono24: process_voice_mono_noloop_s24(v, rs, src, endpos); break;
+        case spt_stereo24: process_voice_stereo_noloop_s24(v, rs, src, endpos); break;
+        case spt_monof: process_voice_mono_noloop_f32(v, rs, src, endpos); break;
+        case spt_stereof: process_voice_stereo_noloop_f32(v, rs, src, endpos); break;
+        default: process_voice_mono_noloop(v, rs, src, endpos); break;
+    }
     return (v->bigpos >> 32) - oldpos;
 }
 
@@ -273,7 +406,7 @@ static void process_voice_withloop(struct sampler_gen *v, struct resampler_state
     while ( rs->offset < CBOX_BLOCK_SIZE ) {
         uint64_t startframe = v->bigpos >> 32;
         
-        int16_t *source_data = v->sample_data;
+        const void *source_data = v->sample_data;
         uint32_t source_offset = 0;
         uint32_t usable_sample_end = loop_edge;
         // if the first frame to play is already within 3 frames of loop end
@@ -322,12 +455,13 @@ static void process_voice_streaming(struct sampler_gen *v, struct resampler_stat
         v->consumed_credit = 0;
     }
     // This is the first frame where interpolation will cross the loop boundary
-    int16_t scratch[2 * MAX_INTERPOLATION_ORDER * 2];
+    float scratch[2 * MAX_INTERPOLATION_ORDER * CBOX_WAVEFORM_MAX_FRAME_SIZE / sizeof(float)];
+    uint32_t frame_size = sampler_player_type_get_frame_size(v->mode);
     
     while ( limit && rs->offset < CBOX_BLOCK_SIZE ) {
         uint64_t startframe = v->bigpos >> 32;
         
-        int16_t *source_data = v->in_streaming_buffer ? v->streaming_buffer : v->sample_data;
+        const void *source_data = v->in_streaming_buffer ? v->streaming_buffer : v->sample_data;
         uint32_t loop_start = v->in_streaming_buffer ? 0 : v->loop_start;
         uint32_t loop_end = v->in_streaming_buffer ? v->streaming_buffer_frames : v->loop_end;
         uint32_t loop_edge = loop_end - MAX_INTERPOLATION_ORDER;
@@ -355,18 +489,17 @@ static void process_voice_streaming(struct sampler_gen *v, struct resampler_stat
                 continue;
             }
 
-            int shift = (v->mode == spt_stereo16) ? 1 : 0;
-            
             // 'linearize' the virtual circular buffer - write 3 (or N) frames before end of the loop
             // and 3 (N) frames at the start of the loop, and play it; in rare cases this will need to be
             // repeated twice if output write pointer is close to CBOX_BLOCK_SIZE or playback rate is very low,
             // but that's OK.
-            uint32_t halfscratch = MAX_INTERPOLATION_ORDER << shift;
-            memcpy(&scratch[0], &source_data[loop_edge << shift], halfscratch * sizeof(int16_t) );
+            uint32_t halfscratch = MAX_INTERPOLATION_ORDER * frame_size;
+            uint8_t *bscratch = (uint8_t *)scratch;
+            memcpy(bscratch, (const uint8_t *)source_data + loop_edge * frame_size, halfscratch);
             if (v->loop_start == (uint32_t)-1)
-                memset(scratch + halfscratch, 0, halfscratch * sizeof(int16_t));
+                memset(bscratch + halfscratch, 0, halfscratch);
             else
-                memcpy(scratch + halfscratch, &v->streaming_buffer[v->loop_start << shift], halfscratch * sizeof(int16_t));
+                memcpy(bscratch + halfscratch, (const uint8_t *)v->streaming_buffer + v->loop_start * frame_size, halfscratch);
 
             usable_sample_end = loop_end;
             source_data = scratch;
@@ -507,3 +640,159 @@ uint32_t sampler_gen_sample_playback(struct sampler_gen *v, float *leftright, ui
     return written;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Multi-voice resampler. Voices that can render the whole block from memory
+// without hitting the loop edge are processed side by side, one voice per
+// SIMD lane, so that the interpolation maths is done without any horizontal
+// reductions. Sample fetches are still scalar (there is no useful int16
+// gather), but they are independent and pipeline well.
+
+gboolean sampler_gen_is_batchable(struct sampler_gen *v)
+{
+    if (v->mode != spt_mono16 && v->mode != spt_stereo16)
+        return FALSE;
+    // Streaming and timestretch both need the full per-voice path
+    if (v->streaming_buffer || v->fadein_counter != -1 || v->virtdelta != v->bigdelta || v->virtpos != v->bigpos)
+        return FALSE;
+    if (v->loop_end < MAX_INTERPOLATION_ORDER)
+        return FALSE;
+    // The copy kernel is cheaper than a batch lane
+    if (sampler_gen_is_unity(v))
+        return FALSE;
+    // Same condition as in process_voice_noloop, for the whole block
+    uint64_t loop_edge64 = ((uint64_t)(v->loop_end - MAX_INTERPOLATION_ORDER)) << 32;
+    return v->bigpos + (CBOX_BLOCK_SIZE - 1) * v->bigdelta < loop_edge64;
+}
+
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+
+#define SAMPLER_GEN_HAS_BATCH 1
+
+typedef float batch_v4sf __attribute__((vector_size(16)));
+typedef float batch_v8sf __attribute__((vector_size(32)));
+
+// Unused lanes replay lane 0 with zero gain, which keeps the inner loops
+// free of lane count checks.
+#define BATCH_KERNEL(name, VEC, LANES, STEREO, ATTRIBUTES) \
+ATTRIBUTES static void name(struct sampler_gen **gens, float **outputs, int count) \
+{ \
+    const int16_t *data[LANES]; \
+    uint64_t pos[LANES], delta[LANES]; \
+    VEC lgain, rgain, lgain_delta, rgain_delta; \
+    for (int k = 0; k < LANES; k++) \
+    { \
+        struct sampler_gen *v = gens[k < count ? k : 0]; \
+        data[k] = v->sample_data; \
+        pos[k] = v->bigpos; \
+        delta[k] = v->bigdelta; \
+        lgain[k] = k < count ? v->last_lgain : 0.f; \
+        rgain[k] = k < count ? v->last_rgain : 0.f; \
+        lgain_delta[k] = k < count ? (v->lgain - v->last_lgain) * (1.f / CBOX_BLOCK_SIZE) : 0.f; \
+        rgain_delta[k] = k < count ? (v->rgain - v->last_rgain) * (1.f / CBOX_BLOCK_SIZE) : 0.f; \
+    } \
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i++) \
+    { \
+        VEC t, l0, l1, l2, l3, r0, r1, r2, r3; \
+        for (int k = 0; k < LANES; k++) \
+        { \
+            t[k] = ((pos[k] >> 8) & 0x00FFFFFF) * (1.f / 16777216.f); \
+            if (STEREO) \
+            { \
+                const int16_t *p = &data[k][(pos[k] >> 31) & ~1]; \
+                l0[k] = p[0]; l1[k] = p[2]; l2[k] = p[4]; l3[k] = p[6]; \
+                r0[k] = p[1]; r1[k] = p[3]; r2[k] = p[5]; r3[k] = p[7]; \
+            } \
+            else \
+            { \
+                const int16_t *p = &data[k][pos[k] >> 32]; \
+                l0[k] = p[0]; l1[k] = p[1]; l2[k] = p[2]; l3[k] = p[3]; \
+            } \
+            pos[k] += delta[k]; \
+        } \
+        VEC tp1 = t + 1.f, tm1 = t - 1.f, tm2 = t - 2.f; \
+        VEC b0 = -t * tm1 * tm2 * (1.f / 6.f); \
+        VEC b1 = tp1 * tm1 * tm2 * (3.f / 6.f); \
+        VEC b2 = tp1 * t * tm2 * (-3.f / 6.f); \
+        VEC b3 = tp1 * t * tm1 * (1.f / 6.f); \
+        VEC cl = b0 * l0 + b1 * l1 + b2 * l2 + b3 * l3; \
+        VEC cr = STEREO ? b0 * r0 + b1 * r1 + b2 * r2 + b3 * r3 : cl; \
+        VEC outl = lgain * cl, outr = rgain * cr; \
+        lgain += lgain_delta; \
+        rgain += rgain_delta; \
+        for (int k = 0; k < count; k++) \
+        { \
+            outputs[k][2 * i] = outl[k]; \
+            outputs[k][2 * i + 1] = outr[k]; \
+        } \
+    } \
+    for (int k = 0; k < count; k++) \
+        gens[k]->bigpos = pos[k]; \
+}
+
+BATCH_KERNEL(batch_mono_sse2, batch_v4sf, 4, 0, )
+BATCH_KERNEL(batch_stereo_sse2, batch_v4sf, 4, 1, )
+BATCH_KERNEL(batch_mono_avx2, batch_v8sf, 8, 0, __attribute__((target("avx2"))))
+BATCH_KERNEL(batch_stereo_avx2, batch_v8sf, 8, 1, __attribute__((target("avx2"))))
+
+typedef void (*batch_kernel_func)(struct sampler_gen **gens, float **outputs, int count);
+
+static batch_kernel_func batch_kernels[2] = { batch_mono_sse2, batch_stereo_sse2 };
+static int batch_lanes = 4;
+
+void sampler_gen_batch_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        batch_kernels[0] = batch_mono_avx2;
+        batch_kernels[1] = batch_stereo_avx2;
+        batch_lanes = 8;
+    }
+}
+
+#else
+
+#define SAMPLER_GEN_HAS_BATCH 0
+
+static int batch_lanes = 1;
+
+void sampler_gen_batch_init(void)
+{
+}
+
+#endif
+
+int sampler_gen_batch_get_lanes(void)
+{
+    return batch_lanes;
+}
+
+void sampler_gen_sample_playback_batch(struct sampler_gen **gens, float **leftright, int count)
+{
+    assert(count > 0 && count <= SAMPLER_GEN_BATCH_MAX);
+#if SAMPLER_GEN_HAS_BATCH
+    if (count > 1)
+    {
+        enum sampler_player_type mode = gens[0]->mode;
+        batch_kernel_func kernel = batch_kernels[mode == spt_stereo16 ? 1 : 0];
+        for (int i = 0; i < count; i += batch_lanes)
+        {
+            int lanes = count - i < batch_lanes ? count - i : batch_lanes;
+            for (int k = 0; k < lanes; k++)
+                assert(gens[i + k]->mode == mode);
+            kernel(gens + i, leftright + i, lanes);
+        }
+        for (int k = 0; k < count; k++)
+        {
+            struct sampler_gen *v = gens[k];
+            v->virtpos = v->bigpos;
+            v->last_lgain = v->lgain;
+            v->last_rgain = v->rgain;
+        }
+        return;
+    }
+#endif
+    for (int k = 0; k < count; k++)
+        sampler_gen_sample_playback(gens[k], leftright[k], (uint32_t)-1);
+}
+
@@ -21,6 +21,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 extern void sampler_gen_reset(struct sampler_gen *v);
 extern uint32_t sampler_gen_sample_playback(struct sampler_gen *v, float *leftright, uint32_t limit);
+
+// Maximum number of voices passed to a single sampler_gen_sample_playback_batch call
+#define SAMPLER_GEN_BATCH_MAX 16
+
+extern void sampler_gen_batch_init(void);
+extern int sampler_gen_batch_get_lanes(void);
+extern gboolean sampler_gen_is_batchable(struct sampler_gen *v);
+// All generators must be batchable and use the same mode; always renders a full block
+extern void sampler_gen_sample_playback_batch(struct sampler_gen **gens, float **leftright, int count);
 extern void sampler_program_change_byidx(struct sampler_module *m, struct sampler_channel *c, int program_idx);
 extern void sampler_program_change(struct sampler_module *m, struct sampler_channel *c, int program);
 
@@ -238,6 +238,7 @@ struct sampler_layer *sampler_layer_new(struct sampler_module *m, struct sampler
     for (int i = 1; i < 127; i++)
         ld->velcurve[i] = -1;
     ld->modulations = NULL;
+    ld->compiled_modulations = NULL;
     ld->nifs = NULL;
     ld->on_locc = 0;
     ld->on_hicc = 127;
@@ -298,6 +299,8 @@ void sampler_layer_data_clone(struct sampler_layer_data *dst, const struct sampl
         dstm->has_value = copy_hasattr ? srcm->has_value : FALSE;
         mod->data = dstm;
     }
+    // recompiled by sampler_layer_data_finalize
+    dst->compiled_modulations = NULL;
     dst->nifs = g_slist_copy(src->nifs);
     for(GSList *nif = dst->nifs; nif; nif = nif->next)
     {
@@ -358,6 +361,80 @@ static void sampler_layer_data_getdefaults(struct sampler_layer_data *l, struct
     }
 }
 
+static void modulation_group_add(struct sampler_modulation_group *g, int src, float offset, float scale, int src2, float offset2, float scale2, int dest)
+{
+    int i = g->count++;
+    g->src[i] = src;
+    g->offset[i] = offset;
+    g->scale[i] = scale;
+    g->src2[i] = src2;
+    g->offset2[i] = offset2;
+    g->scale2[i] = scale2;
+    g->dest[i] = dest;
+}
+
+static struct sampler_compiled_modulations *sampler_compile_modulations(GSList *modulations)
+{
+    static const float modoffset[4] = {0, -1, -1, 1 };
+    static const float modscale[4] = {1, 1, 2, -2 };
+
+    int count = g_slist_length(modulations);
+    if (!count)
+        return NULL;
+    // all the arrays live in the same block, following the header
+    struct sampler_compiled_modulations *cm = g_malloc0(sizeof(struct sampler_compiled_modulations) + count * 3 * (4 * sizeof(float) + 3 * sizeof(uint8_t)));
+    float *fptr = (float *)(cm + 1);
+    uint8_t *bptr = (uint8_t *)(fptr + 3 * 4 * count);
+    struct sampler_modulation_group *groups[3] = { &cm->cc, &cm->note_cc, &cm->note_note };
+    for (int i = 0; i < 3; i++)
+    {
+        struct sampler_modulation_group *g = groups[i];
+        g->offset = fptr; fptr += count;
+        g->scale = fptr; fptr += count;
+        g->offset2 = fptr; fptr += count;
+        g->scale2 = fptr; fptr += count;
+        g->src = bptr; bptr += count;
+        g->src2 = bptr; bptr += count;
+        g->dest = bptr; bptr += count;
+    }
+
+    for (GSList *mod = modulations; mod; mod = g_slist_next(mod))
+    {
+        struct sampler_modulation *sm = mod->data;
+        int src = sm->src, src2 = sm->src2;
+        float offset = modoffset[sm->flags & 3], scale = modscale[sm->flags & 3];
+        float offset2 = 1.f, scale2 = 0.f;
+        if (src < smsrc_pernote_offset)
+            scale *= 1.f / 127.f;
+        if (src2 != smsrc_none)
+        {
+            offset2 = modoffset[(sm->flags & 12) >> 2];
+            scale2 = modscale[(sm->flags & 12) >> 2];
+            if (src2 < smsrc_pernote_offset)
+                scale2 *= 1.f / 127.f;
+        }
+        else
+            src2 = smsrc_cc0;
+        // the product is symmetric, so put the per-note source first
+        if (src < smsrc_pernote_offset && src2 >= smsrc_pernote_offset)
+        {
+            int t = src; src = src2; src2 = t;
+            float to = offset, ts = scale;
+            offset = offset2; scale = scale2;
+            offset2 = to; scale2 = ts;
+        }
+        offset *= sm->amount;
+        scale *= sm->amount;
+        if (src < smsrc_pernote_offset)
+            modulation_group_add(&cm->cc, src, offset, scale, src2, offset2, scale2, sm->dest);
+        else if (src2 < smsrc_pernote_offset)
+            modulation_group_add(&cm->note_cc, src - smsrc_pernote_offset, offset, scale, src2, offset2, scale2, sm->dest);
+        else
+            modulation_group_add(&cm->note_note, src - smsrc_pernote_offset, offset, scale, src2 - smsrc_pernote_offset, offset2, scale2, sm->dest);
+    }
+    return cm;
+}
+
 #define PROC_FIELDS_FINALISER(type, name, def_value) 
 #define PROC_FIELDS_FINALISER_string(name)
 #define PROC_FIELDS_FINALISER_enum(type, name, def_value) 
@@ -416,7 +493,16 @@ void sampler_layer_data_finalize(struct sampler_layer_data *l, struct sampler_la
     if ((l->eff_loop_mode == slm_loop_continuous || l->eff_loop_mode == slm_loop_sustain) && l->loop_start == 0 && l->eff_waveform && l->eff_waveform->has_loop)
         l->loop_start = l->eff_waveform->loop_start;
     if (l->loop_end == 0 && l->eff_waveform != NULL)
-        l->loop_end = l->eff_waveform->has_loop ? l->eff_waveform->loop_end : l->eff_waveform->info.frames;
+        l->loop_end = l->eff_waveform->has_loop ? l->eff_waveform->loop_end : cbox_waveform_get_source_frames(l->eff_waveform);
+    l->eff_loop_start = l->loop_start;
+    l->eff_loop_end = l->loop_end;
+    if (l->eff_waveform)
+    {
+        l->eff_loop_start = cbox_waveform_map_position(l->eff_waveform, l->loop_start);
+        l->eff_loop_end = cbox_waveform_map_position(l->eff_waveform, l->loop_end);
+        if (l->eff_loop_end > l->eff_waveform->info.frames)
+            l->eff_loop_end = l->eff_waveform->info.frames;
+    }
 
     if (l->off_mode == som_unknown)
         l->off_mode = l->off_by != 0 ? som_fast : som_normal;
@@ -456,15 +542,17 @@ void sampler_layer_data_finalize(struct sampler_layer_data *l, struct sampler_la
     // but that's OK.
     if (l->eff_waveform && l->eff_waveform->preloaded_frames == l->eff_waveform->info.frames)
     {
-        int shift = l->eff_waveform->info.channels == 2 ? 1 : 0;
-        uint32_t halfscratch = MAX_INTERPOLATION_ORDER << shift;
-        memcpy(&l->scratch_loop[0], &l->eff_waveform->data[(l->loop_end - MAX_INTERPOLATION_ORDER) << shift], halfscratch * sizeof(int16_t) );
-        memcpy(&l->scratch_end[0], &l->eff_waveform->data[(l->loop_end - MAX_INTERPOLATION_ORDER) << shift], halfscratch * sizeof(int16_t) );
-        memset(l->scratch_end + halfscratch, 0, halfscratch * sizeof(int16_t));
-        if (l->loop_start != (uint32_t)-1)
-            memcpy(l->scratch_loop + halfscratch, &l->eff_waveform->data[l->loop_start << shift], halfscratch * sizeof(int16_t));
+        uint32_t frame_size = l->eff_waveform->frame_size;
+        uint32_t halfscratch = MAX_INTERPOLATION_ORDER * frame_size;
+        const uint8_t *data = l->eff_waveform->data;
+        uint8_t *scratch_loop = (uint8_t *)l->scratch_loop, *scratch_end = (uint8_t *)l->scratch_end;
+        memcpy(scratch_loop, data + (l->eff_loop_end - MAX_INTERPOLATION_ORDER) * frame_size, halfscratch);
+        memcpy(scratch_end, data + (l->eff_loop_end - MAX_INTERPOLATION_ORDER) * frame_size, halfscratch);
+        memset(scratch_end + halfscratch, 0, halfscratch);
+        if (l->eff_loop_start != (uint32_t)-1)
+            memcpy(scratch_loop + halfscratch, data + l->eff_loop_start * frame_size, halfscratch);
         else
-            memset(l->scratch_loop + halfscratch, 0, halfscratch * sizeof(int16_t));
+            memset(scratch_loop + halfscratch, 0, halfscratch);
     }
     if (sampler_layer_data_is_4pole(l))
         l->resonance_scaled = sqrtf(l->resonance_linearized / 0.707f) * 0.5f;
@@ -478,6 +566,9 @@ void sampler_layer_data_finalize(struct sampler_layer_data *l, struct sampler_la
     l->eq_bitmask = ((l->eq1.gain != 0 || l->eq1.vel2gain != 0) ? 1 : 0)
         | ((l->eq2.gain != 0 || l->eq2.vel2gain != 0) ? 2 : 0)
         | ((l->eq3.gain != 0 || l->eq3.vel2gain != 0) ? 4 : 0);
+
+    g_free(l->compiled_modulations);
+    l->compiled_modulations = sampler_compile_modulations(l->modulations);
 }
 
 void sampler_layer_reset_switches(struct sampler_layer *l, struct sampler_module *m)
@@ -1063,6 +1154,8 @@ void sampler_layer_data_close(struct sampler_layer_data *l)
 {
     g_slist_free_full(l->nifs, g_free);
     g_slist_free_full(l->modulations, g_free);
+    g_free(l->compiled_modulations);
+    l->compiled_modulations = NULL;
     if (l->eff_waveform)
     {
         cbox_waveform_unref(l->eff_waveform);
@@ -29,14 +29,38 @@ struct sampler_voice;
 struct sampler_noteinitfunc;
 struct sampler_module;
 
+// One per sample format (see enum cbox_sample_format) and channel count
 enum sampler_player_type
 {
     spt_inactive,
     spt_mono16,
     spt_stereo16,
+    spt_mono24,
+    spt_stereo24,
+    spt_monof,
+    spt_stereof,
     spt_finished
 };
 
+static inline gboolean sampler_player_type_is_stereo(enum sampler_player_type spt)
+{
+    return spt == spt_stereo16 || spt == spt_stereo24 || spt == spt_stereof;
+}
+
+static inline uint32_t sampler_player_type_get_frame_size(enum sampler_player_type spt)
+{
+    switch(spt)
+    {
+        case spt_mono16: return 2;
+        case spt_stereo16: return 4;
+        case spt_mono24: return 3;
+        case spt_stereo24: return 6;
+        case spt_monof: return 4;
+        case spt_stereof: return 8;
+        default: return 0;
+    }
+}
+
 enum sampler_loop_mode
 {
     slm_unknown,
@@ -170,6 +194,28 @@ struct sampler_modulation
     unsigned int has_value:1;
 };
 
+// Modulations in struct-of-arrays form. Flags are folded into offset/scale,
+// 1/127 into the scale for CC sources, and the amount into offset/scale of
+// the first source, so that an entry adds
+// (offset + src * scale) * (offset2 + src2 * scale2) to its destination.
+// Per-note sources are stored relative to smsrc_pernote_offset.
+struct sampler_modulation_group
+{
+    int count;
+    float *offset, *scale, *offset2, *scale2;
+    uint8_t *src, *src2, *dest;
+};
+
+struct sampler_compiled_modulations
+{
+    // both sources are CCs (second may be a dummy one with scale2 = 0, offset2 = 1)
+    struct sampler_modulation_group cc;
+    // first source is per-note, second one is a CC (or a dummy)
+    struct sampler_modulation_group note_cc;
+    // both sources are per-note
+    struct sampler_modulation_group note_note;
+};
+
 typedef void (*SamplerNoteInitFunc)(struct sampler_noteinitfunc *nif, struct sampler_voice *voice);
 
 struct sampler_noteinitfunc
@@ -387,12 +433,16 @@ struct sampler_layer_data
     GSList *nifs;
 
     // computed values:
+    struct sampler_compiled_modulations *compiled_modulations; // NULL if no modulations
     float eff_freq;
     int eff_use_keyswitch;
     enum sampler_loop_mode eff_loop_mode;
+    // loop points as frame indexes in eff_waveform's data
+    uint32_t eff_loop_start, eff_loop_end;
     struct cbox_waveform *eff_waveform;
-    int16_t scratch_loop[2 * MAX_INTERPOLATION_ORDER * 2];
-    int16_t scratch_end[2 * MAX_INTERPOLATION_ORDER * 2];
+    // in the waveform's sample format; float is used for the alignment
+    float scratch_loop[2 * MAX_INTERPOLATION_ORDER * CBOX_WAVEFORM_MAX_FRAME_SIZE / sizeof(float)];
+    float scratch_end[2 * MAX_INTERPOLATION_ORDER * CBOX_WAVEFORM_MAX_FRAME_SIZE / sizeof(float)];
     float resonance_scaled;
     float logcutoff;
     uint32_t eq_bitmask;
@@ -29,44 +29,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 CBOX_CLASS_DEFINITION_ROOT(sampler_program)
 
-GSList *sampler_program_get_next_layer(struct sampler_program *prg, struct sampler_channel *c, GSList *next_layer, int note, int vel, float random, gboolean is_first)
-{
-    int ch = (c - c->module->channels) + 1;
-    for(;next_layer;next_layer = g_slist_next(next_layer))
-    {
-        struct sampler_layer *lr = next_layer->data;
-        struct sampler_layer_data *l = lr->runtime;
-        if (!l->eff_waveform)
-            continue;
-        if ((l->trigger == stm_first && !is_first) ||
-            (l->trigger == stm_legato && is_first))
-            continue;
-        if (l->sw_last != -1)
-        {
-            if (note >= l->sw_lokey && note <= l->sw_hikey)
-                lr->last_key = note;
-        }
-        if (note >= l->lokey && note <= l->hikey && vel >= l->lovel && vel <= l->hivel && ch >= l->lochan && ch <= l->hichan && random >= l->lorand && random < l->hirand && 
-            (l->cc_number == -1 || (c->cc[l->cc_number] >= l->locc && c->cc[l->cc_number] <= l->hicc)))
-        {
-            if (!l->eff_use_keyswitch || 
-                ((l->sw_last == -1 || l->sw_last == lr->last_key) &&
-                 (l->sw_down == -1 || (c->switchmask[l->sw_down >> 5] & (1 << (l->sw_down & 31)))) &&
-                 (l->sw_up == -1 || !(c->switchmask[l->sw_up >> 5] & (1 << (l->sw_up & 31)))) &&
-                 (l->sw_previous == -1 || l->sw_previous == c->previous_note)))
-            {
-                gboolean play = lr->current_seq_position == 1;
-                lr->current_seq_position++;
-                if (lr->current_seq_position >= l->seq_length)
-                    lr->current_seq_position = 1;
-                if (play)
-                    return next_layer;
-            }
-        }
-    }
-    return NULL;
-}
-
 static gboolean return_layers(GSList *layers, const char *keyword, struct cbox_command_target *fb, GError **error)
 {
     for (GSList *p = layers; p; p = g_slist_next(p))
@@ -199,7 +161,7 @@ struct sampler_program *sampler_program_new(struct sampler_module *m, int prog_n
     return prg;
 }
 
-struct sampler_program *sampler_program_new_from_cfg(struct sampler_module *m, const char *cfg_section, const char *name, int pgm_id, GError **error)
+struct sampler_program *sampler_program_new_from_cfg(struct sampler_module *m, const char *cfg_section, const char *name, int pgm_id, struct cbox_command_target *fb, GError **error)
 {
     int i;
     
@@ -293,7 +255,7 @@ struct sampler_program *sampler_program_new_from_cfg(struct sampler_module *m, c
             prg->source_file = g_strdup(sfz);
         }
 
-        if (sampler_module_load_program_sfz(m, prg, prg->source_file, FALSE, error))
+        if (sampler_module_load_program_sfz(m, prg, prg->source_file, FALSE, fb, error))
             return prg;
         CBOX_DELETE(prg);
         return NULL;
@@ -496,39 +458,3 @@ struct sampler_program *sampler_program_clone(struct sampler_program *prg, struc
     
     return newprg;
 }
-
-/////////////////////////////////////////////////////////////////////////////////
-
-struct sampler_rll *sampler_rll_new_from_program(struct sampler_program *prg)
-{
-    struct sampler_rll *rll = malloc(sizeof(struct sampler_rll));
-    rll->layers = NULL;
-    rll->layers_release = NULL;
-    rll->layers_oncc = NULL;
-    for (int i = 0; i < 4; i++)
-        rll->cc_trigger_bitmask[i] = 0;
-
-    for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
-    {
-        struct sampler_layer *l = p->data;
-        int cc = l->data.on_cc_number;
-        if (cc != -1)
-        {
-            rll->layers_oncc = g_slist_prepend(rll->layers_oncc, l);
-            rll->cc_trigger_bitmask[cc >> 5] |= 1 << (cc & 31);
-        }
-        else if (l->data.trigger == stm_release)
-            rll->layers_release = g_slist_prepend(rll->layers_release, l);
-        else
-            rll->layers = g_slist_prepend(rll->layers, l);
-    }
-    return rll;
-}
-
-void sampler_rll_destroy(struct sampler_rll *rll)
-{
-    g_slist_free(rll->layers);
-    g_slist_free(rll->layers_release);
-    g_slist_free(rll->layers_oncc);
-    free(rll);
-}
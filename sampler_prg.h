@@ -27,6 +27,22 @@ struct sampler_channel;
 
 CBOX_EXTERN_CLASS(sampler_program)
 
+#define SAMPLER_RLL_VEL_SHIFT 4
+#define SAMPLER_RLL_VEL_BUCKETS (128 >> SAMPLER_RLL_VEL_SHIFT)
+#define SAMPLER_RLL_CELLS (128 * SAMPLER_RLL_VEL_BUCKETS)
+
+// Lookup table of candidate layers for a note-on. Every (key, velocity bucket)
+// cell points to a NULL-terminated run of layers whose key and velocity ranges
+// overlap the cell, in the same order as in the source list. The remaining 128
+// entries list the layers using each key as a sw_last keyswitch. Only key and
+// velocity are used for indexing, all the other conditions are still checked
+// on every note.
+struct sampler_rll_index
+{
+    uint32_t offsets[SAMPLER_RLL_CELLS + 128];
+    struct sampler_layer **layers;
+};
+
 // Runtime layer lists; in future, I might something more clever, like a tree
 struct sampler_rll
 {
@@ -34,6 +50,7 @@ struct sampler_rll
     GSList *layers_release; // of sampler_layer
     GSList *layers_oncc;
     uint32_t cc_trigger_bitmask[4]; // one bit per CC
+    struct sampler_rll_index index, index_release;
 };
 
 struct sampler_ctrlinit
@@ -71,9 +88,12 @@ struct sampler_program
 extern struct sampler_rll *sampler_rll_new_from_program(struct sampler_program *prg);
 extern void sampler_rll_destroy(struct sampler_rll *rll);
 
-extern GSList *sampler_program_get_next_layer(struct sampler_program *prg, struct sampler_channel *c, GSList *next_layer, int note, int vel, float random, gboolean is_first);
+extern struct sampler_layer **sampler_rll_index_get_candidates(struct sampler_rll_index *idx, int note, int vel);
+extern void sampler_rll_index_update_keyswitches(struct sampler_rll_index *idx, int note, gboolean is_first);
+
+extern struct sampler_layer **sampler_program_get_next_layer(struct sampler_program *prg, struct sampler_channel *c, struct sampler_layer **next_layer, int note, int vel, float random, gboolean is_first);
 extern struct sampler_program *sampler_program_new(struct sampler_module *m, int prog_no, const char *name, struct cbox_tarfile *tarfile, const char *sample_dir, GError **error);
-extern struct sampler_program *sampler_program_new_from_cfg(struct sampler_module *m, const char *cfg_section, const char *name, int pgm_id, GError **error);
+extern struct sampler_program *sampler_program_new_from_cfg(struct sampler_module *m, const char *cfg_section, const char *name, int pgm_id, struct cbox_command_target *fb, GError **error);
 extern void sampler_program_add_layer(struct sampler_program *prg, struct sampler_layer *l);
 extern void sampler_program_delete_layer(struct sampler_program *prg, struct sampler_layer *l);
 extern void sampler_program_add_group(struct sampler_program *prg, struct sampler_layer *l);
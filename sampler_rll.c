@@ -0,0 +1,164 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sampler.h"
+#include "sampler_prg.h"
+
+struct sampler_layer **sampler_rll_index_get_candidates(struct sampler_rll_index *idx, int note, int vel)
+{
+    return &idx->layers[idx->offsets[note * SAMPLER_RLL_VEL_BUCKETS + (vel >> SAMPLER_RLL_VEL_SHIFT)]];
+}
+
+static inline gboolean is_layer_playable(struct sampler_layer_data *l, gboolean is_first)
+{
+    if (!l->eff_waveform)
+        return FALSE;
+    return !((l->trigger == stm_first && !is_first) ||
+        (l->trigger == stm_legato && is_first));
+}
+
+void sampler_rll_index_update_keyswitches(struct sampler_rll_index *idx, int note, gboolean is_first)
+{
+    for (struct sampler_layer **p = &idx->layers[idx->offsets[SAMPLER_RLL_CELLS + note]]; *p; p++)
+    {
+        // same as the old full scan - layers that can't play now don't see the keyswitch
+        if (is_layer_playable((*p)->runtime, is_first))
+            (*p)->last_key = note;
+    }
+}
+
+struct sampler_layer **sampler_program_get_next_layer(struct sampler_program *prg, struct sampler_channel *c, struct sampler_layer **next_layer, int note, int vel, float random, gboolean is_first)
+{
+    int ch = (c - c->module->channels) + 1;
+    for(;*next_layer;next_layer++)
+    {
+        struct sampler_layer *lr = *next_layer;
+        struct sampler_layer_data *l = lr->runtime;
+        if (!is_layer_playable(l, is_first))
+            continue;
+        if (note >= l->lokey && note <= l->hikey && vel >= l->lovel && vel <= l->hivel && ch >= l->lochan && ch <= l->hichan && random >= l->lorand && random < l->hirand && 
+            (l->cc_number == -1 || (c->cc[l->cc_number] >= l->locc && c->cc[l->cc_number] <= l->hicc)))
+        {
+            if (!l->eff_use_keyswitch || 
+                ((l->sw_last == -1 || l->sw_last == lr->last_key) &&
+                 (l->sw_down == -1 || (c->switchmask[l->sw_down >> 5] & (1 << (l->sw_down & 31)))) &&
+                 (l->sw_up == -1 || !(c->switchmask[l->sw_up >> 5] & (1 << (l->sw_up & 31)))) &&
+                 (l->sw_previous == -1 || l->sw_previous == c->previous_note)))
+            {
+                gboolean play = lr->current_seq_position == 1;
+                lr->current_seq_position++;
+                if (lr->current_seq_position >= l->seq_length)
+                    lr->current_seq_position = 1;
+                if (play)
+                    return next_layer;
+            }
+        }
+    }
+    return NULL;
+}
+
+static inline int clip_midi(int value)
+{
+    return value < 0 ? 0 : (value > 127 ? 127 : value);
+}
+
+#define RLL_INDEX_ENTRIES (SAMPLER_RLL_CELLS + 128)
+
+// Returns the index entries the layer belongs to
+static int get_rll_index_entries(struct sampler_layer_data *d, uint32_t *entries)
+{
+    int count = 0;
+    for (int key = clip_midi(d->lokey); key <= clip_midi(d->hikey); key++)
+    {
+        for (int bucket = clip_midi(d->lovel) >> SAMPLER_RLL_VEL_SHIFT; bucket <= clip_midi(d->hivel) >> SAMPLER_RLL_VEL_SHIFT; bucket++)
+            entries[count++] = key * SAMPLER_RLL_VEL_BUCKETS + bucket;
+    }
+    if (d->sw_last != -1)
+    {
+        for (int key = clip_midi(d->sw_lokey); key <= clip_midi(d->sw_hikey); key++)
+            entries[count++] = SAMPLER_RLL_CELLS + key;
+    }
+    return count;
+}
+
+static void sampler_rll_index_init(struct sampler_rll_index *idx, GSList *layers)
+{
+    uint32_t pos[RLL_INDEX_ENTRIES], entries[RLL_INDEX_ENTRIES];
+
+    memset(pos, 0, sizeof(pos));
+    for (GSList *p = layers; p; p = g_slist_next(p))
+    {
+        int count = get_rll_index_entries(&((struct sampler_layer *)p->data)->data, entries);
+        for (int i = 0; i < count; i++)
+            pos[entries[i]]++;
+    }
+    // Each run is followed by a NULL terminator
+    uint32_t total = 0;
+    for (int i = 0; i < RLL_INDEX_ENTRIES; i++)
+    {
+        idx->offsets[i] = total;
+        total += pos[i] + 1;
+        pos[i] = idx->offsets[i];
+    }
+    idx->layers = calloc(total, sizeof(struct sampler_layer *));
+    for (GSList *p = layers; p; p = g_slist_next(p))
+    {
+        struct sampler_layer *l = p->data;
+        int count = get_rll_index_entries(&l->data, entries);
+        for (int i = 0; i < count; i++)
+            idx->layers[pos[entries[i]]++] = l;
+    }
+}
+
+struct sampler_rll *sampler_rll_new_from_program(struct sampler_program *prg)
+{
+    struct sampler_rll *rll = malloc(sizeof(struct sampler_rll));
+    rll->layers = NULL;
+    rll->layers_release = NULL;
+    rll->layers_oncc = NULL;
+    for (int i = 0; i < 4; i++)
+        rll->cc_trigger_bitmask[i] = 0;
+
+    for (GSList *p = prg->all_layers; p; p = g_slist_next(p))
+    {
+        struct sampler_layer *l = p->data;
+        int cc = l->data.on_cc_number;
+        if (cc != -1)
+        {
+            rll->layers_oncc = g_slist_prepend(rll->layers_oncc, l);
+            rll->cc_trigger_bitmask[cc >> 5] |= 1 << (cc & 31);
+        }
+        else if (l->data.trigger == stm_release)
+            rll->layers_release = g_slist_prepend(rll->layers_release, l);
+        else
+            rll->layers = g_slist_prepend(rll->layers, l);
+    }
+    sampler_rll_index_init(&rll->index, rll->layers);
+    sampler_rll_index_init(&rll->index_release, rll->layers_release);
+    return rll;
+}
+
+void sampler_rll_destroy(struct sampler_rll *rll)
+{
+    free(rll->index.layers);
+    free(rll->index_release.layers);
+    g_slist_free(rll->layers);
+    g_slist_free(rll->layers_release);
+    g_slist_free(rll->layers_oncc);
+    free(rll);
+}
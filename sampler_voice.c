@@ -29,6 +29,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "stm.h"
 #include <assert.h>
 #include <errno.h>
+#include <float.h>
 #include <glib.h>
 #include <math.h>
 #include <memory.h>
@@ -79,15 +80,15 @@ static gboolean is_tail_finished(struct sampler_voice *v)
     if (v->layer->cutoff == -1)
         return TRUE;
     double eps = 1.0 / 65536.0;
-    if (cbox_biquadf_is_audible(&v->filter_left, eps))
+    if (cbox_biquadf_is_audible(&v->filters->filter_left, eps))
         return FALSE;
-    if (cbox_biquadf_is_audible(&v->filter_right, eps))
+    if (cbox_biquadf_is_audible(&v->filters->filter_right, eps))
         return FALSE;
     if (sampler_layer_data_is_4pole(v->layer))
     {
-        if (cbox_biquadf_is_audible(&v->filter_left2, eps))
+        if (cbox_biquadf_is_audible(&v->filters->filter_left2, eps))
             return FALSE;
-        if (cbox_biquadf_is_audible(&v->filter_right2, eps))
+        if (cbox_biquadf_is_audible(&v->filters->filter_right2, eps))
             return FALSE;
     }
     
@@ -163,22 +164,141 @@ static inline void mix_block_into(cbox_sample_t **outputs, int oofs, float *src_
 
 #endif
 
+// Generates a mix function for a fixed number of filter stages (0, 1 or 2),
+// with or without tone control and EQ. The filters, the tone control, the
+// EQ bands and the mixing into the output bus are fused into one pass over
+// the block, with both channels in the lanes of one vector; the filtered
+// signal is also left in leftright, for the effect sends.
+#define SAMPLER_VOICE_MIX_FUNC(STAGES, TONECTL, EQ) \
+static void sampler_voice_mix_##STAGES##_##TONECTL##_##EQ(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright) \
+{ \
+    struct cbox_biquadf_stereo f1, f2; \
+    struct cbox_onepolef_stereo tc; \
+    struct cbox_biquadf_cascade eqs; \
+    gboolean hybrid = v->layer->fil_type == sft_lp24hybrid; \
+    if (STAGES >= 1) \
+    { \
+        cbox_biquadf_stereo_load(&f1, &v->filters->filter_left, &v->filters->filter_right, &v->filters->filter_coeffs_prev); \
+        cbox_biquadf_stereo_ramp_to(&f1, &v->filters->filter_coeffs, CBOX_BLOCK_SIZE); \
+    } \
+    if (STAGES >= 2) \
+    { \
+        cbox_biquadf_stereo_load(&f2, &v->filters->filter_left2, &v->filters->filter_right2, hybrid ? &v->filters->filter_coeffs_extra_prev : &v->filters->filter_coeffs_prev); \
+        cbox_biquadf_stereo_ramp_to(&f2, hybrid ? &v->filters->filter_coeffs_extra : &v->filters->filter_coeffs, CBOX_BLOCK_SIZE); \
+    } \
+    if (TONECTL) \
+        cbox_onepolef_stereo_load(&tc, &v->filters->onepole_left, &v->filters->onepole_right, &v->filters->onepole_coeffs); \
+    if (EQ) \
+    { \
+        cbox_biquadf_cascade_init(&eqs); \
+        for (int e = 0; e < 3; e++) \
+        { \
+            if (v->layer->eq_bitmask & (1 << e)) \
+                cbox_biquadf_cascade_add(&eqs, &v->cold->eq_left[e], &v->cold->eq_right[e], &v->cold->eq_coeffs[e]); \
+        } \
+    } \
+    cbox_sample_t *dst_left = outputs[v->output_pair_no * 2]; \
+    cbox_sample_t *dst_right = outputs[v->output_pair_no * 2 + 1]; \
+    for (int i = 0; i < CBOX_BLOCK_SIZE; i++) \
+    { \
+        cbox_v4sf lr = {leftright[2 * i], leftright[2 * i + 1], 0.f, 0.f}; \
+        if (STAGES >= 1) \
+            lr = cbox_biquadf_stereo_run_ramp(&f1, lr); \
+        if (STAGES >= 2) \
+            lr = cbox_biquadf_stereo_run_ramp(&f2, lr); \
+        if (TONECTL) \
+            lr = cbox_onepolef_stereo_run(&tc, lr); \
+        if (EQ) \
+        { \
+            for (int e = 0; e < eqs.count; e++) \
+                lr = cbox_biquadf_stereo_run(&eqs.stages[e], lr); \
+        } \
+        leftright[2 * i] = lr[0]; \
+        leftright[2 * i + 1] = lr[1]; \
+        dst_left[i] += lr[0]; \
+        dst_right[i] += lr[1]; \
+    } \
+    if (STAGES >= 1) \
+    { \
+        cbox_biquadf_stereo_store(&f1); \
+        v->filters->filter_coeffs_prev = v->filters->filter_coeffs; \
+        v->filters->filter_coeffs_extra_prev = v->filters->filter_coeffs_extra; \
+    } \
+    if (STAGES >= 2) \
+        cbox_biquadf_stereo_store(&f2); \
+    if (TONECTL) \
+        cbox_onepolef_stereo_store(&tc); \
+    if (EQ) \
+    { \
+        for (int e = 0; e < eqs.count; e++) \
+            cbox_biquadf_stereo_store(&eqs.stages[e]); \
+    } \
+}
+
+#define SAMPLER_VOICE_MIX_FUNCS_FOR_STAGES(STAGES) \
+    SAMPLER_VOICE_MIX_FUNC(STAGES, 0, 0) \
+    SAMPLER_VOICE_MIX_FUNC(STAGES, 0, 1) \
+    SAMPLER_VOICE_MIX_FUNC(STAGES, 1, 0) \
+    SAMPLER_VOICE_MIX_FUNC(STAGES, 1, 1)
+
+SAMPLER_VOICE_MIX_FUNCS_FOR_STAGES(0)
+SAMPLER_VOICE_MIX_FUNCS_FOR_STAGES(1)
+SAMPLER_VOICE_MIX_FUNCS_FOR_STAGES(2)
+
+static const sampler_voice_mix_func sampler_voice_mix_funcs[3][2][2] = {
+    { { sampler_voice_mix_0_0_0, sampler_voice_mix_0_0_1 }, { sampler_voice_mix_0_1_0, sampler_voice_mix_0_1_1 } },
+    { { sampler_voice_mix_1_0_0, sampler_voice_mix_1_0_1 }, { sampler_voice_mix_1_1_0, sampler_voice_mix_1_1_1 } },
+    { { sampler_voice_mix_2_0_0, sampler_voice_mix_2_0_1 }, { sampler_voice_mix_2_1_0, sampler_voice_mix_2_1_1 } },
+};
+
+static sampler_voice_mix_func sampler_voice_select_mix_func(struct sampler_layer_data *l)
+{
+    int stages = l->cutoff == -1 ? 0 : (sampler_layer_data_is_4pole(l) ? 2 : 1);
+    return sampler_voice_mix_funcs[stages][l->tonectl_freq != 0][l->eq_bitmask != 0];
+}
+
+static inline void apply_modulations(const struct sampler_compiled_modulations *cm, const uint8_t *cc, const float *modsrcs, float *moddests)
+{
+    const struct sampler_modulation_group *g = &cm->cc;
+    for (int i = 0; i < g->count; i++)
+        moddests[g->dest[i]] += (g->offset[i] + cc[g->src[i]] * g->scale[i]) * (g->offset2[i] + cc[g->src2[i]] * g->scale2[i]);
+    g = &cm->note_cc;
+    for (int i = 0; i < g->count; i++)
+        moddests[g->dest[i]] += (g->offset[i] + modsrcs[g->src[i]] * g->scale[i]) * (g->offset2[i] + cc[g->src2[i]] * g->scale2[i]);
+    g = &cm->note_note;
+    for (int i = 0; i < g->count; i++)
+        moddests[g->dest[i]] += (g->offset[i] + modsrcs[g->src[i]] * g->scale[i]) * (g->offset2[i] + modsrcs[g->src2[i]] * g->scale2[i]);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
+static enum sampler_player_type sampler_voice_get_player_type(struct cbox_waveform *waveform)
+{
+    static const enum sampler_player_type types[][2] = {
+        [csf_int16] = { spt_mono16, spt_stereo16 },
+        [csf_int24] = { spt_mono24, spt_stereo24 },
+        [csf_float] = { spt_monof, spt_stereof },
+    };
+    return types[waveform->format][waveform->info.channels == 2 ? 1 : 0];
+}
+
 void sampler_voice_activate(struct sampler_voice *v, enum sampler_player_type mode)
 {
-    assert(v->gen.mode == spt_inactive);
+    assert(v->gen->mode == spt_inactive);
     sampler_voice_unlink(&v->program->module->voices_free, v);
     assert(mode != spt_inactive);
     assert(v->channel);
-    v->gen.mode = mode;
+    v->gen->mode = mode;
     sampler_voice_link(&v->channel->voices_running, v);
+    // New voices are the youngest in the least stealable bucket
+    struct sampler_module *m = v->program->module;
+    sampler_steal_queue_link(m, v, m->steal_policy == ssp_oldest ? 0 : (m->steal_policy == ssp_released ? 1 : SAMPLER_STEAL_BUCKETS - 1));
 }
 
 void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, struct sampler_layer_data *l, int note, int vel, int *exgroups, int *pexgroupcount)
 {
     struct sampler_module *m = c->module;
-    sampler_gen_reset(&v->gen);
+    sampler_gen_reset(v->gen);
     
     v->age = 0;
     if (l->trigger == stm_release)
@@ -192,16 +312,19 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
     }
     uint32_t end = l->eff_waveform->info.frames;
     if (l->end != 0)
-        end = (l->end == -1) ? 0 : l->end;
+        end = (l->end == -1) ? 0 : cbox_waveform_map_position(l->eff_waveform, l->end);
     v->last_waveform = l->eff_waveform;
-    v->gen.cur_sample_end = end;
+    assert(!v->cold->held_waveform);
+    v->cold->held_waveform = l->eff_waveform;
+    uint32_t preloaded_frames = v->preloaded_frames = cbox_waveform_acquire(l->eff_waveform);
+    v->gen->cur_sample_end = end;
     if (end > l->eff_waveform->info.frames)
         end = l->eff_waveform->info.frames;
     
     assert(!v->current_pipe);
-    if (end > l->eff_waveform->preloaded_frames)
+    if (end > preloaded_frames)
     {
-        if (l->eff_loop_mode == slm_loop_continuous && l->loop_end < l->eff_waveform->preloaded_frames)
+        if (l->eff_loop_mode == slm_loop_continuous && l->eff_loop_end < preloaded_frames)
         {
             // Everything fits in prefetch, because loop ends in prefetch and post-loop part is not being played
         }
@@ -210,18 +333,19 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
             uint32_t loop_start = -1, loop_end = end;
             // If in loop mode, set the loop over the looped part... unless we're doing sustain-only loop on prefetch area only. Then
             // streaming will only cover the release part, and it shouldn't be looped.
-            if (l->eff_loop_mode == slm_loop_continuous || (l->eff_loop_mode == slm_loop_sustain && l->loop_end >= l->eff_waveform->preloaded_frames))
+            if (l->eff_loop_mode == slm_loop_continuous || (l->eff_loop_mode == slm_loop_sustain && l->eff_loop_end >= preloaded_frames))
             {
-                loop_start = l->loop_start;
-                loop_end = l->loop_end;
+                loop_start = l->eff_loop_start;
+                loop_end = l->eff_loop_end;
             }
             // Those are initial values only, they will be adjusted in process function
-            v->current_pipe = cbox_prefetch_stack_pop(m->pipe_stack, l->eff_waveform, loop_start, loop_end, l->count);
+            float pitch = (note - l->pitch_keycenter) * l->pitch_keytrack + l->tune + l->transpose * 100;
+            v->current_pipe = cbox_prefetch_stack_pop(v->cold->pipe_stack, l->eff_waveform, loop_start, loop_end, l->count, preloaded_frames, cent2factor(pitch));
             if (!v->current_pipe)
             {
                 g_warning("Prefetch pipe pool exhausted, no streaming playback will be possible");
-                end = l->eff_waveform->preloaded_frames;
-                v->gen.cur_sample_end = end;
+                end = preloaded_frames;
+                v->gen->cur_sample_end = end;
             }
         }
     }
@@ -236,8 +360,8 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
         v->delay = (int)(delay * m->module.srate);
     else
         v->delay = 0;
-    v->gen.loop_overlap = l->loop_overlap;
-    v->gen.loop_overlap_step = l->loop_overlap > 0 ? 1.0 / l->loop_overlap : 0;
+    v->gen->loop_overlap = cbox_waveform_map_position(l->eff_waveform, l->loop_overlap);
+    v->gen->loop_overlap_step = v->gen->loop_overlap > 0 ? 1.0 / v->gen->loop_overlap : 0;
     v->gain_fromvel = 1.0 + (l->eff_velcurve[vel] - 1.0) * l->amp_veltrack * 0.01;
     v->gain_shift = 0.0;
     v->note = note;
@@ -250,9 +374,9 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
     v->channel = c;
     v->layer = l;
     v->program = c->program;
-    v->amp_env.shape = &l->amp_env_shape;
-    v->filter_env.shape = &l->filter_env_shape;
-    v->pitch_env.shape = &l->pitch_env_shape;
+    v->envs->amp_env.shape = &l->amp_env_shape;
+    v->envs->filter_env.shape = &l->filter_env_shape;
+    v->envs->pitch_env.shape = &l->pitch_env_shape;
     
     v->cutoff_shift = vel * l->fil_veltrack / 127.0 + (note - l->fil_keycenter) * l->fil_keytrack;
     v->loop_mode = l->eff_loop_mode;
@@ -289,15 +413,15 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
     lfo_init(&v->filter_lfo, &l->filter_lfo, m->module.srate, m->module.srate_inv);
     lfo_init(&v->pitch_lfo, &l->pitch_lfo, m->module.srate, m->module.srate_inv);
     
-    cbox_biquadf_reset(&v->filter_left);
-    cbox_biquadf_reset(&v->filter_right);
-    cbox_biquadf_reset(&v->filter_left2);
-    cbox_biquadf_reset(&v->filter_right2);
-    cbox_onepolef_reset(&v->onepole_left);
-    cbox_onepolef_reset(&v->onepole_right);
+    cbox_biquadf_reset(&v->filters->filter_left);
+    cbox_biquadf_reset(&v->filters->filter_right);
+    cbox_biquadf_reset(&v->filters->filter_left2);
+    cbox_biquadf_reset(&v->filters->filter_right2);
+    cbox_onepolef_reset(&v->filters->onepole_left);
+    cbox_onepolef_reset(&v->filters->onepole_right);
     // set gain later (it's a less expensive operation)
     if (l->tonectl_freq != 0)
-        cbox_onepolef_set_highshelf_tonectl(&v->onepole_coeffs, l->tonectl_freq * M_PI * m->module.srate_inv, 1.0);
+        cbox_onepolef_set_highshelf_tonectl(&v->filters->onepole_coeffs, l->tonectl_freq * M_PI * m->module.srate_inv, 1.0);
     
     GSList *nif = v->layer->nifs;
     while(nif)
@@ -306,10 +430,10 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
         p->notefunc(p, v);
         nif = nif->next;
     }
-    v->offset = l->offset;
+    v->offset = cbox_waveform_map_position(l->eff_waveform, l->offset);
     if (v->reloffset != 0)
     {
-        uint32_t maxend = v->current_pipe ? (l->eff_waveform->preloaded_frames >> 1) : l->eff_waveform->preloaded_frames;
+        uint32_t maxend = v->current_pipe ? (preloaded_frames >> 1) : preloaded_frames;
         int32_t pos = v->offset + v->reloffset * maxend * 0.01;
         if (pos < 0)
             pos = 0;
@@ -318,24 +442,25 @@ void sampler_voice_start(struct sampler_voice *v, struct sampler_channel *c, str
         v->offset = pos;
     }
     
-    cbox_envelope_reset(&v->amp_env);
-    cbox_envelope_reset(&v->filter_env);
-    cbox_envelope_reset(&v->pitch_env);
+    cbox_envelope_reset(&v->envs->amp_env);
+    cbox_envelope_reset(&v->envs->filter_env);
+    cbox_envelope_reset(&v->envs->pitch_env);
 
     v->last_eq_bitmask = 0;
 
-    sampler_voice_activate(v, l->eff_waveform->info.channels == 2 ? spt_stereo16 : spt_mono16);
+    sampler_voice_activate(v, sampler_voice_get_player_type(l->eff_waveform));
     
     uint32_t pos = v->offset;
-    if (l->offset_random)
-        pos += ((uint32_t)(rand() + (rand() << 16))) % l->offset_random;
+    uint32_t offset_random = cbox_waveform_map_position(l->eff_waveform, l->offset_random);
+    if (offset_random)
+        pos += ((uint32_t)(rand() + (rand() << 16))) % offset_random;
     if (pos >= end)
         pos = end;
-    v->gen.bigpos = ((uint64_t)pos) << 32;
-    v->gen.virtpos = ((uint64_t)pos) << 32;
+    v->gen->bigpos = ((uint64_t)pos) << 32;
+    v->gen->virtpos = ((uint64_t)pos) << 32;
     
-    if (v->current_pipe && v->gen.bigpos)
-        cbox_prefetch_pipe_consumed(v->current_pipe, v->gen.bigpos >> 32);
+    if (v->current_pipe && v->gen->bigpos)
+        cbox_prefetch_pipe_consumed(v->current_pipe, v->gen->bigpos >> 32);
     v->layer_changed = TRUE;
 }
 
@@ -362,14 +487,20 @@ void sampler_voice_unlink(struct sampler_voice **pv, struct sampler_voice *v)
 
 void sampler_voice_inactivate(struct sampler_voice *v, gboolean expect_active)
 {
-    assert((v->gen.mode != spt_inactive) == expect_active);
+    assert((v->gen->mode != spt_inactive) == expect_active);
     sampler_voice_unlink(&v->channel->voices_running, v);
-    v->gen.mode = spt_inactive;
+    sampler_steal_queue_unlink(v->program->module, v);
+    v->gen->mode = spt_inactive;
     if (v->current_pipe)
     {
-        cbox_prefetch_stack_push(v->program->module->pipe_stack, v->current_pipe);
+        cbox_prefetch_stack_push(v->current_pipe->stack, v->current_pipe);
         v->current_pipe = NULL;
     }
+    if (v->cold->held_waveform)
+    {
+        cbox_waveform_release(v->cold->held_waveform);
+        v->cold->held_waveform = NULL;
+    }
     v->channel = NULL;
     sampler_voice_link(&v->program->module->voices_free, v);
 }
@@ -391,7 +522,7 @@ void sampler_voice_release(struct sampler_voice *v, gboolean is_polyaft)
             if (v->loop_mode == slm_loop_sustain && v->current_pipe)
             {
                 // Break the loop
-                v->current_pipe->file_loop_end = v->gen.cur_sample_end;
+                v->current_pipe->file_loop_end = v->gen->cur_sample_end;
                 v->current_pipe->file_loop_start = -1;
             }
         }
@@ -405,25 +536,25 @@ void sampler_voice_update_params_from_layer(struct sampler_voice *v)
     lfo_update_freq(&v->amp_lfo, &l->amp_lfo, m->module.srate, m->module.srate_inv);
     lfo_update_freq(&v->filter_lfo, &l->filter_lfo, m->module.srate, m->module.srate_inv);
     lfo_update_freq(&v->pitch_lfo, &l->pitch_lfo, m->module.srate, m->module.srate_inv);
-    cbox_envelope_update_shape(&v->amp_env, &l->amp_env_shape);
-    cbox_envelope_update_shape(&v->filter_env, &l->filter_env_shape);
-    cbox_envelope_update_shape(&v->pitch_env, &l->pitch_env_shape);
+    cbox_envelope_update_shape(&v->envs->amp_env, &l->amp_env_shape);
+    cbox_envelope_update_shape(&v->envs->filter_env, &l->filter_env_shape);
+    cbox_envelope_update_shape(&v->envs->pitch_env, &l->pitch_env_shape);
 }
 
-void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs)
+gboolean sampler_voice_prepare_mod(struct sampler_voice *v, struct sampler_module *m, struct sampler_voice_mod *mod)
 {
     struct sampler_layer_data *l = v->layer;
-    assert(v->gen.mode != spt_inactive);
+    assert(v->gen->mode != spt_inactive);
     
     // if it's a DAHD envelope without sustain, consider the note finished
-    if (__builtin_expect(v->amp_env.cur_stage == 4 && v->amp_env.shape->stages[3].end_value <= 0.f, 0))
-        cbox_envelope_go_to(&v->amp_env, 15);                
+    if (__builtin_expect(v->envs->amp_env.cur_stage == 4 && v->envs->amp_env.shape->stages[3].end_value <= 0.f, 0))
+        cbox_envelope_go_to(&v->envs->amp_env, 15);                
 
     struct sampler_channel *c = v->channel;
     v->age += CBOX_BLOCK_SIZE;
     
     if (__builtin_expect(v->age < v->delay, 0))
-        return;
+        return FALSE;
 
     // XXXKF I'm sacrificing sample accuracy for delays for now
     v->delay = 0;
@@ -434,25 +565,32 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
         if (v->last_waveform != v->layer->eff_waveform)
         {
             v->last_waveform = v->layer->eff_waveform;
+            if (v->cold->held_waveform)
+            {
+                cbox_waveform_release(v->cold->held_waveform);
+                v->cold->held_waveform = NULL;
+            }
             if (v->layer->eff_waveform)
             {
-                v->gen.mode = v->layer->eff_waveform->info.channels == 2 ? spt_stereo16 : spt_mono16;
-                v->gen.cur_sample_end = v->layer->eff_waveform->info.frames;
+                v->cold->held_waveform = v->layer->eff_waveform;
+                v->preloaded_frames = cbox_waveform_acquire(v->layer->eff_waveform);
+                v->gen->mode = sampler_voice_get_player_type(v->layer->eff_waveform);
+                v->gen->cur_sample_end = v->layer->eff_waveform->info.frames;
             }
             else
             {
                 sampler_voice_inactivate(v, TRUE);
-                return;
+                return FALSE;
             }        
         }
     #define RECALC_EQ_IF(index) \
         if (l->eq_bitmask & (1 << (index - 1))) \
         { \
-            cbox_biquadf_set_peakeq_rbj_scaled(&v->eq_coeffs[index - 1], l->eq##index.effective_freq + velscl * l->eq##index.vel2freq, 1.0 / l->eq##index.bw, dB2gain(0.5 * (l->eq##index.gain + velscl * l->eq##index.vel2gain)), m->module.srate); \
+            cbox_biquadf_set_peakeq_rbj_scaled(&v->cold->eq_coeffs[index - 1], l->eq##index.effective_freq + velscl * l->eq##index.vel2freq, 1.0 / l->eq##index.bw, dB2gain(0.5 * (l->eq##index.gain + velscl * l->eq##index.vel2gain)), m->module.srate); \
             if (!(v->last_eq_bitmask & (1 << (index - 1)))) \
             { \
-                cbox_biquadf_reset(&v->eq_left[index-1]); \
-                cbox_biquadf_reset(&v->eq_right[index-1]); \
+                cbox_biquadf_reset(&v->cold->eq_left[index-1]); \
+                cbox_biquadf_reset(&v->cold->eq_right[index-1]); \
             } \
         }
 
@@ -460,6 +598,9 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
         RECALC_EQ_IF(2)
         RECALC_EQ_IF(3)
         v->last_eq_bitmask = l->eq_bitmask;
+        v->mix_func = sampler_voice_select_mix_func(l);
+        v->filters->filter_key = (uint32_t)-1;
+        v->filters->last_tonectl = FLT_MAX;
         v->layer_changed = FALSE;
     }
     
@@ -468,20 +609,20 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
     modsrcs[smsrc_vel - smsrc_pernote_offset] = v->vel * velscl;
     modsrcs[smsrc_pitch - smsrc_pernote_offset] = pitch * (1.f / 100.f);
     modsrcs[smsrc_polyaft - smsrc_pernote_offset] = 0.f; // XXXKF not supported yet
-    modsrcs[smsrc_pitchenv - smsrc_pernote_offset] = cbox_envelope_get_next(&v->pitch_env, v->released) * 0.01f;
-    modsrcs[smsrc_filenv - smsrc_pernote_offset] = cbox_envelope_get_next(&v->filter_env, v->released) * 0.01f;
-    modsrcs[smsrc_ampenv - smsrc_pernote_offset] = cbox_envelope_get_next(&v->amp_env, v->released) * 0.01f;
+    modsrcs[smsrc_pitchenv - smsrc_pernote_offset] = cbox_envelope_get_next(&v->envs->pitch_env, v->released) * 0.01f;
+    modsrcs[smsrc_filenv - smsrc_pernote_offset] = cbox_envelope_get_next(&v->envs->filter_env, v->released) * 0.01f;
+    modsrcs[smsrc_ampenv - smsrc_pernote_offset] = cbox_envelope_get_next(&v->envs->amp_env, v->released) * 0.01f;
 
     modsrcs[smsrc_amplfo - smsrc_pernote_offset] = lfo_run(&v->amp_lfo);
     modsrcs[smsrc_fillfo - smsrc_pernote_offset] = lfo_run(&v->filter_lfo);
     modsrcs[smsrc_pitchlfo - smsrc_pernote_offset] = lfo_run(&v->pitch_lfo);
     
-    if (__builtin_expect(v->amp_env.cur_stage < 0, 0))
+    if (__builtin_expect(v->envs->amp_env.cur_stage < 0, 0))
     {
         if (__builtin_expect(is_tail_finished(v), 0))
         {
             sampler_voice_inactivate(v, TRUE);
-            return;
+            return FALSE;
         }
     }
     
@@ -491,42 +632,30 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
     moddests[smdest_cutoff] = v->cutoff_shift;
     moddests[smdest_resonance] = 0;
     moddests[smdest_tonectl] = 0;
-    GSList *mod = l->modulations;
     if (__builtin_expect(l->trigger == stm_release, 0))
         moddests[smdest_gain] -= v->age * l->rt_decay * m->module.srate_inv;
     
     if (c->pitchwheel)
         moddests[smdest_pitch] += c->pitchwheel * (c->pitchwheel > 0 ? l->bend_up : l->bend_down) >> 13;
     
-    static const int modoffset[4] = {0, -1, -1, 1 };
-    static const int modscale[4] = {1, 1, 2, -2 };
-    while(mod)
-    {
-        struct sampler_modulation *sm = mod->data;
-        float value = 0.f, value2 = 1.f;
-        if (sm->src < smsrc_pernote_offset)
-            value = c->cc[sm->src] * (1.f / 127.f);
-        else
-            value = modsrcs[sm->src - smsrc_pernote_offset];
-        value = modoffset[sm->flags & 3] + value * modscale[sm->flags & 3];
+    if (l->compiled_modulations)
+        apply_modulations(l->compiled_modulations, c->cc, modsrcs, moddests);
+
+    mod->pitch = moddests[smdest_pitch];
+    mod->gain = moddests[smdest_gain];
+    mod->cutoff = moddests[smdest_cutoff];
+    mod->resonance = moddests[smdest_resonance];
+    mod->tonectl = moddests[smdest_tonectl];
+    mod->ampenv = modsrcs[smsrc_ampenv - smsrc_pernote_offset];
+    return TRUE;
+}
 
-        if (sm->src2 != smsrc_none)
-        {
-            if (sm->src2 < smsrc_pernote_offset)
-                value2 = c->cc[sm->src2] * (1.f / 127.f);
-            else
-                value2 = modsrcs[sm->src2 - smsrc_pernote_offset];
-            
-            value2 = modoffset[(sm->flags & 12) >> 2] + value2 * modscale[(sm->flags & 12) >> 2];
-            value *= value2;
-        }
-        moddests[sm->dest] += value * sm->amount;
-        
-        mod = g_slist_next(mod);
-    }
-    
+void sampler_voice_prepare_finish(struct sampler_voice *v, struct sampler_module *m, const struct sampler_voice_mod *mod, float pitch_factor, float gain_factor)
+{
+    struct sampler_layer_data *l = v->layer;
+    struct sampler_channel *c = v->channel;
     double maxv = 127 << 7;
-    double freq = l->eff_freq * cent2factor(moddests[smdest_pitch]) ;
+    double freq = l->eff_freq * pitch_factor;
     uint64_t freq64 = (uint64_t)(freq * 65536.0 * 65536.0 * m->module.srate_inv);
 
     gboolean playing_sustain_loop = !v->released && v->loop_mode == slm_loop_sustain;
@@ -535,14 +664,14 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
 
     if (!v->current_pipe)
     {
-        v->gen.sample_data = v->last_waveform->data;
+        v->gen->sample_data = v->last_waveform->data;
         if (v->last_waveform->levels)
         {
             gboolean use_cached = v->last_level > 0 && v->last_level < v->last_waveform->level_count
                 && freq64 > v->last_level_min_rate && freq64 <= v->last_waveform->levels[v->last_level].max_rate;
             if (__builtin_expect(use_cached, 1))
             {
-                v->gen.sample_data = v->last_waveform->levels[v->last_level].data;
+                v->gen->sample_data = v->last_waveform->levels[v->last_level].data;
                 bandlimited = TRUE;
             }
             else
@@ -552,7 +681,7 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
                     if (freq64 <= v->last_waveform->levels[i].max_rate)
                     {
                         v->last_level = i;
-                        v->gen.sample_data = v->last_waveform->levels[i].data;
+                        v->gen->sample_data = v->last_waveform->levels[i].data;
                         bandlimited = TRUE;
                         
                         break;
@@ -564,40 +693,40 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
     }
     
     gboolean play_loop = v->layer->loop_end && (v->loop_mode == slm_loop_continuous || playing_sustain_loop) && v->layer->on_cc_number == -1;
-    loop_start = play_loop ? v->layer->loop_start : (v->layer->count ? 0 : (uint32_t)-1);
-    loop_end = play_loop ? v->layer->loop_end : v->gen.cur_sample_end;
+    loop_start = play_loop ? v->layer->eff_loop_start : (v->layer->count ? 0 : (uint32_t)-1);
+    loop_end = play_loop ? v->layer->eff_loop_end : v->gen->cur_sample_end;
 
     if (v->current_pipe)
     {
-        v->gen.sample_data = v->gen.loop_count ? v->current_pipe->data : v->last_waveform->data;
-        v->gen.streaming_buffer = v->current_pipe->data;
+        v->gen->sample_data = v->gen->loop_count ? v->current_pipe->data : v->last_waveform->data;
+        v->gen->streaming_buffer = v->current_pipe->data;
         
-        v->gen.prefetch_only_loop = (loop_end < v->last_waveform->preloaded_frames);
-        v->gen.loop_overlap = 0;
-        if (v->gen.prefetch_only_loop)
+        v->gen->prefetch_only_loop = (loop_end < v->preloaded_frames);
+        v->gen->loop_overlap = 0;
+        if (v->gen->prefetch_only_loop)
         {
-            assert(!v->gen.in_streaming_buffer); // XXXKF this won't hold true when loops are edited while sound is being played (but that's not supported yet anyway)
-            v->gen.loop_start = loop_start;
-            v->gen.loop_end = loop_end;
-            v->gen.streaming_buffer_frames = 0;
+            assert(!v->gen->in_streaming_buffer); // XXXKF this won't hold true when loops are edited while sound is being played (but that's not supported yet anyway)
+            v->gen->loop_start = loop_start;
+            v->gen->loop_end = loop_end;
+            v->gen->streaming_buffer_frames = 0;
         }
         else
         {
-            v->gen.loop_start = 0;
-            v->gen.loop_end = v->last_waveform->preloaded_frames;
-            v->gen.streaming_buffer_frames = v->current_pipe->buffer_loop_end;
+            v->gen->loop_start = 0;
+            v->gen->loop_end = v->preloaded_frames;
+            v->gen->streaming_buffer_frames = v->current_pipe->buffer_loop_end;
         }
     }
     else
     {
-        v->gen.loop_count = v->layer->count;
-        v->gen.loop_start = loop_start;
-        v->gen.loop_end = loop_end;
+        v->gen->loop_count = v->layer->count;
+        v->gen->loop_start = loop_start;
+        v->gen->loop_end = loop_end;
         
         if (!bandlimited)
         {
             // Use pre-calculated join
-            v->gen.scratch = loop_start == (uint32_t)-1 ? v->layer->scratch_end : v->layer->scratch_loop;
+            v->gen->scratch = loop_start == (uint32_t)-1 ? v->layer->scratch_end : v->layer->scratch_loop;
         }
         else
         {
@@ -607,40 +736,42 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
             // not very useful anyway, as changing the loop removes the guarantee of the waveform being bandlimited and
             // may cause looping artifacts or introduce DC offset (e.g. if only a positive part of a sine wave is looped).
             if (loop_start == 0 && loop_end == l->eff_waveform->info.frames)
-                v->gen.scratch = v->gen.sample_data + l->eff_waveform->info.frames - MAX_INTERPOLATION_ORDER;
+                v->gen->scratch = (const int16_t *)v->gen->sample_data + l->eff_waveform->info.frames - MAX_INTERPOLATION_ORDER;
             else
             {
                 // Generate the join for the current wave level
                 // XXXKF this could be optimised further, by checking if waveform and loops are the same as the last
                 // time. However, this code is not likely to be used... ever, so optimising it is not the priority.
-                int shift = l->eff_waveform->info.channels == 2 ? 1 : 0;
-                uint32_t halfscratch = MAX_INTERPOLATION_ORDER << shift;
+                uint32_t frame_size = sampler_player_type_get_frame_size(v->gen->mode);
+                uint32_t halfscratch = MAX_INTERPOLATION_ORDER * frame_size;
+                const uint8_t *data = v->gen->sample_data;
+                uint8_t *scratch = (uint8_t *)v->gen->scratch_bandlimited;
                 
-                v->gen.scratch = v->gen.scratch_bandlimited;
-                memcpy(&v->gen.scratch_bandlimited[0], &v->gen.sample_data[(loop_end - MAX_INTERPOLATION_ORDER) << shift], halfscratch * sizeof(int16_t) );
+                v->gen->scratch = scratch;
+                memcpy(scratch, data + (loop_end - MAX_INTERPOLATION_ORDER) * frame_size, halfscratch);
                 if (loop_start != (uint32_t)-1)
-                    memcpy(v->gen.scratch_bandlimited + halfscratch, &v->gen.sample_data[loop_start << shift], halfscratch * sizeof(int16_t));
+                    memcpy(scratch + halfscratch, data + loop_start * frame_size, halfscratch);
                 else
-                    memset(v->gen.scratch_bandlimited + halfscratch, 0, halfscratch * sizeof(int16_t));
+                    memset(scratch + halfscratch, 0, halfscratch);
             }
         }
     }
         
     if (l->timestretch)
     {
-        v->gen.bigdelta = freq64;
-        v->gen.virtdelta = (uint64_t)(l->eff_freq * 65536.0 * 65536.0 * m->module.srate_inv);
-        v->gen.stretching_jump = l->timestretch_jump;
-        v->gen.stretching_crossfade = l->timestretch_crossfade;
+        v->gen->bigdelta = freq64;
+        v->gen->virtdelta = (uint64_t)(l->eff_freq * 65536.0 * 65536.0 * m->module.srate_inv);
+        v->gen->stretching_jump = l->timestretch_jump;
+        v->gen->stretching_crossfade = l->timestretch_crossfade;
     }
     else
     {
-        v->gen.bigdelta = freq64;
-        v->gen.virtdelta = freq64;
+        v->gen->bigdelta = freq64;
+        v->gen->virtdelta = freq64;
     }
-    float gain = modsrcs[smsrc_ampenv - smsrc_pernote_offset] * l->volume_linearized * v->gain_fromvel * c->channel_volume_cc * sampler_channel_addcc(c, 11) / (maxv * maxv);
-    if (moddests[smdest_gain] != 0.f)
-        gain *= dB2gain(moddests[smdest_gain]);
+    float gain = mod->ampenv * l->volume_linearized * v->gain_fromvel * c->channel_volume_cc * sampler_channel_addcc(c, 11) / (maxv * maxv);
+    if (mod->gain != 0.f)
+        gain *= gain_factor;
     // http://drealm.info/sfz/plj-sfz.xhtml#amp "The overall gain must remain in the range -144 to 6 decibels."
     if (gain > 2.f)
         gain = 2.f;
@@ -649,112 +780,133 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
         pan = 0.f;
     if (pan > 1.f)
         pan = 1.f;
-    v->gen.lgain = gain * (1.f - pan)  / 32768.f;
-    v->gen.rgain = gain * pan / 32768.f;
-    struct cbox_biquadf_coeffs *second_filter = &v->filter_coeffs;
-    gboolean is4p = sampler_layer_data_is_4pole(v->layer);
+    v->gen->lgain = gain * (1.f - pan)  / 32768.f;
+    v->gen->rgain = gain * pan / 32768.f;
+    // The coefficients are only recalculated when the cutoff (in whole
+    // cents, as used for the sincos lookup) or the resonance modulation
+    // (in 1/16 dB) has changed since the last block
     if (l->cutoff != -1.f)
     {
-        float logcutoff = l->logcutoff + moddests[smdest_cutoff];
+        float logcutoff = l->logcutoff + mod->cutoff;
         if (logcutoff < 0)
             logcutoff = 0;
         if (logcutoff > 12798)
             logcutoff = 12798;
-        //float resonance = v->resonance*pow(32.0,c->cc[71]/maxv);
-        float resonance = l->resonance_linearized * dB2gain((is4p ? 0.5 : 1) * moddests[smdest_resonance]);
-        if (resonance < 0.7f)
-            resonance = 0.7f;
-        if (resonance > 32.f)
-            resonance = 32.f;
-        switch(l->fil_type)
+        int cutoff_index = (int)logcutoff;
+        int resonance_step = (int)lrintf(mod->resonance * 16.f);
+        if (resonance_step < -32768)
+            resonance_step = -32768;
+        if (resonance_step > 32767)
+            resonance_step = 32767;
+        uint32_t filter_key = (uint32_t)cutoff_index | ((uint32_t)(uint16_t)resonance_step << 16);
+        if (filter_key != v->filters->filter_key)
         {
-        case sft_lp24hybrid:
-            cbox_biquadf_set_lp_rbj_lookup(&v->filter_coeffs, &m->sincos[(int)logcutoff], resonance * resonance);
-            cbox_biquadf_set_1plp_lookup(&v->filter_coeffs_extra, &m->sincos[(int)logcutoff], 1);
-            second_filter = &v->filter_coeffs_extra;
-            break;
-            
-        case sft_lp12:
-        case sft_lp24:
-            cbox_biquadf_set_lp_rbj_lookup(&v->filter_coeffs, &m->sincos[(int)logcutoff], resonance);
-            break;
-        case sft_hp12:
-        case sft_hp24:
-            cbox_biquadf_set_hp_rbj_lookup(&v->filter_coeffs, &m->sincos[(int)logcutoff], resonance);
-            break;
-        case sft_bp6:
-        case sft_bp12:
-            cbox_biquadf_set_bp_rbj_lookup(&v->filter_coeffs, &m->sincos[(int)logcutoff], resonance);
-            break;
-        case sft_lp6:
-        case sft_lp12nr:
-        case sft_lp24nr:
-            cbox_biquadf_set_1plp_lookup(&v->filter_coeffs, &m->sincos[(int)logcutoff], l->fil_type != sft_lp6);
-            break;
-        case sft_hp6:
-        case sft_hp12nr:
-        case sft_hp24nr:
-            cbox_biquadf_set_1php_lookup(&v->filter_coeffs, &m->sincos[(int)logcutoff], l->fil_type != sft_hp6);
-            break;
-        default:
-            assert(0);
+            struct cbox_sincos *sincos = &m->sincos[cutoff_index];
+            //float resonance = v->resonance*pow(32.0,c->cc[71]/maxv);
+            float resonance = l->resonance_linearized * dB2gain((sampler_layer_data_is_4pole(l) ? 0.5 : 1) * resonance_step * (1.f / 16.f));
+            if (resonance < 0.7f)
+                resonance = 0.7f;
+            if (resonance > 32.f)
+                resonance = 32.f;
+            switch(l->fil_type)
+            {
+            case sft_lp24hybrid:
+                cbox_biquadf_set_lp_rbj_lookup(&v->filters->filter_coeffs, sincos, resonance * resonance);
+                cbox_biquadf_set_1plp_lookup(&v->filters->filter_coeffs_extra, sincos, 1);
+                break;
+                
+            case sft_lp12:
+            case sft_lp24:
+                cbox_biquadf_set_lp_rbj_lookup(&v->filters->filter_coeffs, sincos, resonance);
+                break;
+            case sft_hp12:
+            case sft_hp24:
+                cbox_biquadf_set_hp_rbj_lookup(&v->filters->filter_coeffs, sincos, resonance);
+                break;
+            case sft_bp6:
+            case sft_bp12:
+                cbox_biquadf_set_bp_rbj_lookup(&v->filters->filter_coeffs, sincos, resonance);
+                break;
+            case sft_lp6:
+            case sft_lp12nr:
+            case sft_lp24nr:
+                cbox_biquadf_set_1plp_lookup(&v->filters->filter_coeffs, sincos, l->fil_type != sft_lp6);
+                break;
+            case sft_hp6:
+            case sft_hp12nr:
+            case sft_hp24nr:
+                cbox_biquadf_set_1php_lookup(&v->filters->filter_coeffs, sincos, l->fil_type != sft_hp6);
+                break;
+            default:
+                assert(0);
+            }
+            // no ramp from the coefficients of another layer (or voice)
+            if (v->filters->filter_key == (uint32_t)-1)
+            {
+                v->filters->filter_coeffs_prev = v->filters->filter_coeffs;
+                v->filters->filter_coeffs_extra_prev = v->filters->filter_coeffs_extra;
+            }
+            v->filters->filter_key = filter_key;
         }
     }
     if (__builtin_expect(l->tonectl_freq != 0, 0))
     {
-        float ctl = l->tonectl + moddests[smdest_tonectl];
-        if (fabs(ctl) > 0.0001f)
-            cbox_onepolef_set_highshelf_setgain(&v->onepole_coeffs, dB2gain(ctl));
-        else
-            cbox_onepolef_set_highshelf_setgain(&v->onepole_coeffs, 1.0);
+        float ctl = l->tonectl + mod->tonectl;
+        if (ctl != v->filters->last_tonectl)
+        {
+            if (fabs(ctl) > 0.0001f)
+                cbox_onepolef_set_highshelf_setgain(&v->filters->onepole_coeffs, dB2gain(ctl));
+            else
+                cbox_onepolef_set_highshelf_setgain(&v->filters->onepole_coeffs, 1.0);
+            v->filters->last_tonectl = ctl;
+        }
     }
     
-    float leftright[2 * CBOX_BLOCK_SIZE];
-        
-    uint32_t samples = 0;
+    sampler_voice_update_steal_bucket(m, v);
+}
 
+gboolean sampler_voice_prepare(struct sampler_voice *v, struct sampler_module *m)
+{
+    struct sampler_voice_mod mod;
+    if (!sampler_voice_prepare_mod(v, m, &mod))
+        return FALSE;
+    sampler_voice_prepare_finish(v, m, &mod, cent2factor(mod.pitch), mod.gain != 0.f ? dB2gain(mod.gain) : 1.f);
+    return TRUE;
+}
+
+uint32_t sampler_voice_render(struct sampler_voice *v, float *leftright)
+{
+    uint32_t samples = 0;
 
     if (v->current_pipe)
     {
         uint32_t limit = cbox_prefetch_pipe_get_remaining(v->current_pipe);
+        // frames this block reads at the current pitch, plus the
+        // interpolation window
+        uint64_t needed = ((uint64_t)CBOX_BLOCK_SIZE * v->gen->bigdelta >> 32) + MAX_INTERPOLATION_ORDER;
+        if (limit < needed)
+            cbox_prefetch_pipe_report_underrun(v->current_pipe);
         if (limit <= 4)
-            v->gen.mode = spt_inactive;
+            v->gen->mode = spt_inactive;
         else
         {
-            samples = sampler_gen_sample_playback(&v->gen, leftright, limit - 4);
-            cbox_prefetch_pipe_consumed(v->current_pipe, v->gen.consumed);
-            v->gen.consumed = 0;
+            samples = sampler_gen_sample_playback(v->gen, leftright, limit - 4);
+            cbox_prefetch_pipe_consumed(v->current_pipe, v->gen->consumed);
+            v->gen->consumed = 0;
         }
     }
     else
     {
-        samples = sampler_gen_sample_playback(&v->gen, leftright, (uint32_t)-1);
+        samples = sampler_gen_sample_playback(v->gen, leftright, (uint32_t)-1);
     }
+    return samples;
+}
 
+void sampler_voice_mix(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright, uint32_t samples)
+{
     for (int i = 2 * samples; i < 2 * CBOX_BLOCK_SIZE; i++)
         leftright[i] = 0.f;
-    if (l->cutoff != -1)
-    {
-        cbox_biquadf_process_stereo(&v->filter_left, &v->filter_right, &v->filter_coeffs, leftright);
-        if (is4p)
-            cbox_biquadf_process_stereo(&v->filter_left2, &v->filter_right2, second_filter, leftright);
-    }
-    if (__builtin_expect(l->tonectl_freq != 0, 0))
-    {
-        cbox_onepolef_process_stereo(&v->onepole_left, &v->onepole_right, &v->onepole_coeffs, leftright);
-    }
-    if (__builtin_expect(l->eq_bitmask, 0))
-    {
-        for (int eq = 0; eq < 3; eq++)
-        {
-            if (l->eq_bitmask & (1 << eq))
-            { 
-                cbox_biquadf_process_stereo(&v->eq_left[eq], &v->eq_right[eq], &v->eq_coeffs[eq], leftright);
-            }
-        }
-    }
-        
-    mix_block_into(outputs, v->output_pair_no * 2, leftright);
+    v->mix_func(v, m, outputs, leftright);
     if (__builtin_expect((v->send1bus > 0 && v->send1gain != 0) || (v->send2bus > 0 && v->send2gain != 0), 0))
     {
         if (v->send1bus > 0 && v->send1gain != 0)
@@ -768,7 +920,20 @@ void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cb
             mix_block_into_with_gain(outputs, oofs, leftright, v->send2gain);
         }
     }
-    if (v->gen.mode == spt_inactive)
+}
+
+void sampler_voice_finish(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs, float *leftright, uint32_t samples)
+{
+    sampler_voice_mix(v, m, outputs, leftright, samples);
+    if (v->gen->mode == spt_inactive)
         sampler_voice_inactivate(v, FALSE);
 }
 
+void sampler_voice_process(struct sampler_voice *v, struct sampler_module *m, cbox_sample_t **outputs)
+{
+    if (!sampler_voice_prepare(v, m))
+        return;
+    float leftright[2 * CBOX_BLOCK_SIZE];
+    uint32_t samples = sampler_voice_render(v, leftright);
+    sampler_voice_finish(v, m, outputs, leftright, samples);
+}
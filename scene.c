@@ -32,6 +32,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "seq.h"
 #include <assert.h>
 #include <glib.h>
+#include <string.h>
 
 CBOX_CLASS_DEFINITION_ROOT(cbox_scene)
 
@@ -229,6 +230,7 @@ static gboolean cbox_scene_process_cmd(struct cbox_command_target *ct, struct cb
             !cbox_execute_on(fb, NULL, "/transpose", "i", error, s->transpose) ||
             !cbox_execute_on(fb, NULL, "/enable_default_song_input", "i", error, s->enable_default_song_input) ||
             !cbox_execute_on(fb, NULL, "/enable_default_external_input", "i", error, s->enable_default_external_input) ||
+            !cbox_execute_on(fb, NULL, "/render_threads", "i", error, s->render_pool ? cbox_worker_pool_get_thread_count(s->render_pool) : 0) ||
             !CBOX_OBJECT_DEFAULT_STATUS(s, fb, error))
             return FALSE;
         
@@ -303,6 +305,9 @@ static gboolean cbox_scene_process_cmd(struct cbox_command_target *ct, struct cb
         s->enable_default_external_input = CBOX_ARG_I(cmd, 0);
         return TRUE;
     }
+    else
+    if (!strcmp(cmd->command, "/render_threads") && !strcmp(cmd->arg_types, "i"))
+        return cbox_scene_set_render_threads(s, CBOX_ARG_I(cmd, 0), error);
     else
         return cbox_object_default_process_cmd(ct, fb, cmd, error);
 }
@@ -349,6 +354,8 @@ gboolean cbox_scene_load(struct cbox_scene *s, const char *name, GError **error)
     
     s->transpose = cbox_config_get_int(section, "transpose", 0);
     s->title = g_strdup(cbox_config_get_string_with_default(section, "title", ""));
+    if (!cbox_scene_set_render_threads(s, cbox_config_get_int(section, "render_threads", 0), error))
+        goto error;
     g_free(section);
     cbox_command_target_init(&s->cmd_target, cbox_scene_process_cmd, s);
     s->name = g_strdup(name);
@@ -571,9 +578,213 @@ static int write_events_to_instrument_ports(struct cbox_scene *scene, struct cbo
     return event_count;
 }
 
-void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output_buffers[])
+// Find the buffers an instrument output pair is mixed into, and mark them as
+// non-silent. Returns FALSE if the output is not connected anywhere.
+static gboolean get_instrument_output_dest(struct cbox_instrument *instr, int o, float *output_buffers[], float **leftbuf, float **rightbuf)
+{
+    struct cbox_module *module = instr->module;
+    if (o < module->aux_offset / 2)
+    {
+        int leftch = instr->outputs[o].output_bus * 2;
+        int rightch = leftch + 1;
+        *leftbuf = output_buffers[leftch];
+        *rightbuf = output_buffers[rightch];
+        instr->scene->output_silent = FALSE;
+    }
+    else
+    {
+        int bus = o - module->aux_offset / 2;
+        struct cbox_aux_bus *busobj = instr->aux_outputs[bus];
+        if (busobj == NULL)
+            return FALSE;
+        *leftbuf = busobj->input_bufs[0];
+        *rightbuf = busobj->input_bufs[1];
+        busobj->input_silent = FALSE;
+    }
+    return TRUE;
+}
+
+static void mix_with_gain(float *leftbuf, float *rightbuf, const float *left, const float *right, float gain, uint32_t count)
+{
+    uint32_t j;
+    if (leftbuf && rightbuf)
+    {
+        for (j = 0; j < count; j++)
+        {
+            leftbuf[j] += gain * left[j];
+            rightbuf[j] += gain * right[j];
+        }
+    }
+    else
+    {
+        for (j = 0; j < count; j++)
+        {
+            if (leftbuf)
+                leftbuf[j] += gain * left[j];
+            if (rightbuf)
+                rightbuf[j] += gain * right[j];
+        }
+    }
+}
+
+// Process MIDI events and audio of a single instrument for the whole period.
+// The output (after the insert effect) goes to the instrument outputs' own
+// buffers, and unless to_buffers is set, is then mixed into the scene's
+// outputs or aux bus inputs. With to_buffers, only the instrument's own state
+// is modified, so it is safe to do for several instruments concurrently.
+static void cbox_scene_render_instrument(struct cbox_instrument *instr, uint32_t nframes, float *output_buffers[], gboolean to_buffers)
+{
+    struct cbox_module *module = instr->module;
+    int event_count = instr->module->midi_input.count;
+    int cur_event = 0;
+    cbox_sample_t *outputs[CBOX_MAX_AUDIO_PORTS];
+    uint32_t i = 0;
+    
+    for (int o = 0; o < module->outputs / 2; o++)
+        instr->outputs[o].buffers_silent = TRUE;
+    while(i < nframes)
+    {
+        // Events are handled with block granularity: all the events up to
+        // and including the start of a block are processed before the block.
+        // Everything up to the block containing the next event can be
+        // processed in one go.
+        uint32_t end = nframes;
+        while(cur_event < event_count)
+        {
+            const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
+            if (!event)
+            {
+                event_count = cur_event;
+                break;
+            }
+            if (event->time > i)
+            {
+                end = (event->time + CBOX_BLOCK_SIZE - 1) & ~(CBOX_BLOCK_SIZE - 1);
+                if (end > nframes)
+                    end = nframes;
+                break;
+            }
+            (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
+            cur_event++;
+        }
+        uint32_t count = end - i;
+        for (int o = 0; o < module->outputs / 2; o++)
+        {
+            outputs[2 * o] = instr->outputs[o].buffers[0] + i;
+            outputs[2 * o + 1] = instr->outputs[o].buffers[1] + i;
+        }
+        cbox_module_process_frames(module, NULL, outputs, count);
+        // only set by the modules that can tell (like the sampler with no
+        // active voices)
+        gboolean silent = module->output_silent;
+        for (int o = 0; o < module->outputs / 2; o++)
+        {
+            struct cbox_instrument_output *oobj = &instr->outputs[o];
+            struct cbox_module *insert = oobj->insert;
+            gboolean output_silent = silent;
+            if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_dry))
+                cbox_recording_source_push(&oobj->rec_dry, (const float **)(outputs + 2 * o), count);
+            if (insert && !insert->bypass)
+                output_silent = cbox_module_process_frames_silent(insert, outputs + 2 * o, outputs + 2 * o, count, output_silent);
+            if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_wet))
+                cbox_recording_source_push(&oobj->rec_wet, (const float **)(outputs + 2 * o), count);
+            if (!output_silent)
+                oobj->buffers_silent = FALSE;
+            if (to_buffers || output_silent)
+                continue;
+            float *leftbuf, *rightbuf;
+            if (!get_instrument_output_dest(instr, o, output_buffers, &leftbuf, &rightbuf))
+                continue;
+            mix_with_gain(leftbuf ? leftbuf + i : NULL, rightbuf ? rightbuf + i : NULL, outputs[2 * o], outputs[2 * o + 1], oobj->gain, count);
+        }
+        i = end;
+    }
+    while(cur_event < event_count)
+    {
+        const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
+        if (event)
+        {
+            (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
+        }
+        else
+            break;
+        
+        cur_event++;
+    }
+}
+
+// Process an aux bus for the whole period into the bus' output buffers, and
+// unless to_buffers is set, add the result to the main output. The bus'
+// effect is skipped once its input has been silent for longer than its tail.
+static void cbox_scene_render_aux_bus(struct cbox_aux_bus *bus, uint32_t nframes, float *output_buffers[], gboolean to_buffers)
+{
+    bus->output_silent = cbox_module_process_frames_silent(bus->module, bus->input_bufs, bus->output_bufs, nframes, bus->input_silent);
+    if (to_buffers || bus->output_silent)
+        return;
+    bus->owner->output_silent = FALSE;
+    for (uint32_t i = 0; i < nframes; i++)
+    {
+        output_buffers[0][i] += bus->output_bufs[0][i];
+        output_buffers[1][i] += bus->output_bufs[1][i];
+    }
+}
+
+struct cbox_scene_render_task_args
+{
+    struct cbox_scene *scene;
+    uint32_t nframes;
+};
+
+static void render_instrument_task(void *user_data, int task, int worker)
+{
+    struct cbox_scene_render_task_args *args = user_data;
+    cbox_scene_render_instrument(args->scene->instruments[task], args->nframes, NULL, TRUE);
+}
+
+static void render_aux_bus_task(void *user_data, int task, int worker)
+{
+    struct cbox_scene_render_task_args *args = user_data;
+    cbox_scene_render_aux_bus(args->scene->aux_buses[task], args->nframes, NULL, TRUE);
+}
+
+// Two stage parallel render: all instruments first, then all aux buses (as
+// they depend on the instruments' output). Each stage is reduced on the
+// calling thread in instrument/bus order, so the result doesn't depend on
+// the thread scheduling.
+static void cbox_scene_render_parallel(struct cbox_scene *scene, uint32_t nframes, float *output_buffers[])
 {
-    int n, i, j;
+    struct cbox_scene_render_task_args args = { scene, nframes };
+    cbox_worker_pool_run(scene->render_pool, render_instrument_task, &args, scene->instrument_count);
+    for (int n = 0; n < scene->instrument_count; n++)
+    {
+        struct cbox_instrument *instr = scene->instruments[n];
+        for (int o = 0; o < instr->module->outputs / 2; o++)
+        {
+            struct cbox_instrument_output *oobj = &instr->outputs[o];
+            float *leftbuf, *rightbuf;
+            if (!oobj->buffers_silent && get_instrument_output_dest(instr, o, output_buffers, &leftbuf, &rightbuf))
+                mix_with_gain(leftbuf, rightbuf, oobj->buffers[0], oobj->buffers[1], oobj->gain, nframes);
+        }
+    }
+
+    cbox_worker_pool_run(scene->render_pool, render_aux_bus_task, &args, scene->aux_bus_count);
+    for (int n = 0; n < scene->aux_bus_count; n++)
+    {
+        struct cbox_aux_bus *bus = scene->aux_buses[n];
+        if (bus->output_silent)
+            continue;
+        scene->output_silent = FALSE;
+        for (uint32_t i = 0; i < nframes; i++)
+        {
+            output_buffers[0][i] += bus->output_bufs[0][i];
+            output_buffers[1][i] += bus->output_bufs[1][i];
+        }
+    }
+}
+
+gboolean cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output_buffers[])
+{
+    int n, i;
 
     if (scene->rt && scene->rt->io)
     {
@@ -624,6 +835,7 @@ void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output
 
     write_events_to_instrument_ports(scene, &scene->midibuf_total);
 
+    scene->output_silent = TRUE;
     for (n = 0; n < scene->aux_bus_count; n++)
     {
         for (i = 0; i < nframes; i ++)
@@ -631,123 +843,17 @@ void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output
             scene->aux_buses[n]->input_bufs[0][i] = 0.f;
             scene->aux_buses[n]->input_bufs[1][i] = 0.f;
         }
+        scene->aux_buses[n]->input_silent = TRUE;
     }
     
-    for (n = 0; n < scene->instrument_count; n++)
-    {
-        struct cbox_instrument *instr = scene->instruments[n];
-        struct cbox_module *module = instr->module;
-        int event_count = instr->module->midi_input.count;
-        int cur_event = 0;
-        uint32_t highwatermark = 0;
-        cbox_sample_t channels[CBOX_MAX_AUDIO_PORTS][CBOX_BLOCK_SIZE];
-        cbox_sample_t *outputs[CBOX_MAX_AUDIO_PORTS];
-        for (i = 0; i < module->outputs; i++)
-            outputs[i] = channels[i];
-        
-        for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
-        {            
-            if (i >= highwatermark)
-            {
-                while(cur_event < event_count)
-                {
-                    const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
-                    if (event)
-                    {
-                        if (event->time <= i)
-                            (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
-                        else
-                        {
-                            highwatermark = event->time;
-                            break;
-                        }
-                    }
-                    else
-                        break;
-                    
-                    cur_event++;
-                }
-            }
-            (*module->process_block)(module, NULL, outputs);
-            for (int o = 0; o < module->outputs / 2; o++)
-            {
-                struct cbox_instrument_output *oobj = &instr->outputs[o];
-                struct cbox_module *insert = oobj->insert;
-                float gain = oobj->gain;
-                if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_dry))
-                    cbox_recording_source_push(&oobj->rec_dry, (const float **)(outputs + 2 * o), CBOX_BLOCK_SIZE);
-                if (insert && !insert->bypass)
-                    (*insert->process_block)(insert, outputs + 2 * o, outputs + 2 * o);
-                if (IS_RECORDING_SOURCE_CONNECTED(oobj->rec_wet))
-                    cbox_recording_source_push(&oobj->rec_wet, (const float **)(outputs + 2 * o), CBOX_BLOCK_SIZE);
-                float *leftbuf, *rightbuf;
-                if (o < module->aux_offset / 2)
-                {
-                    int leftch = oobj->output_bus * 2;
-                    int rightch = leftch + 1;
-                    leftbuf = output_buffers[leftch];
-                    rightbuf = output_buffers[rightch];
-                }
-                else
-                {
-                    int bus = o - module->aux_offset / 2;
-                    struct cbox_aux_bus *busobj = instr->aux_outputs[bus];
-                    if (busobj == NULL)
-                        continue;
-                    leftbuf = busobj->input_bufs[0];
-                    rightbuf = busobj->input_bufs[1];
-                }
-                if (leftbuf && rightbuf)
-                {
-                    for (j = 0; j < CBOX_BLOCK_SIZE; j++)
-                    {
-                        leftbuf[i + j] += gain * channels[2 * o][j];
-                        rightbuf[i + j] += gain * channels[2 * o + 1][j];
-                    }
-                }
-                else
-                {
-                    for (j = 0; j < CBOX_BLOCK_SIZE; j++)
-                    {
-                        if (leftbuf)
-                            leftbuf[i + j] += gain * channels[2 * o][j];
-                        if (rightbuf)
-                            rightbuf[i + j] += gain * channels[2 * o + 1][j];
-                    }
-                }
-            }
-        }
-        while(cur_event < event_count)
-        {
-            const struct cbox_midi_event *event = cbox_midi_buffer_get_event(&module->midi_input, cur_event);
-            if (event)
-            {
-                (*module->process_event)(module, cbox_midi_event_get_data(event), event->size);
-            }
-            else
-                break;
-            
-            cur_event++;
-        }
-    }
-    
-    for (n = 0; n < scene->aux_bus_count; n++)
+    if (scene->render_pool && scene->instrument_count + scene->aux_bus_count > 1)
+        cbox_scene_render_parallel(scene, nframes, output_buffers);
+    else
     {
-        struct cbox_aux_bus *bus = scene->aux_buses[n];
-        float left[CBOX_BLOCK_SIZE], right[CBOX_BLOCK_SIZE];
-        float *outputs[2] = {left, right};
-        for (i = 0; i < nframes; i += CBOX_BLOCK_SIZE)
-        {
-            float *inputs[2];
-            inputs[0] = &bus->input_bufs[0][i];
-            inputs[1] = &bus->input_bufs[1][i];
-            bus->module->process_block(bus->module, inputs, outputs);
-            for (int j = 0; j < CBOX_BLOCK_SIZE; j++)
-            {
-                output_buffers[0][i + j] += left[j];
-                output_buffers[1][i + j] += right[j];
-            }
-        }
+        for (n = 0; n < scene->instrument_count; n++)
+            cbox_scene_render_instrument(scene->instruments[n], nframes, output_buffers, FALSE);
+        for (n = 0; n < scene->aux_bus_count; n++)
+            cbox_scene_render_aux_bus(scene->aux_buses[n], nframes, output_buffers, FALSE);
     }
 
     int output_count = scene->engine->io_env.output_count;
@@ -765,6 +871,29 @@ void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output
             cbox_recording_source_push(&scene->rec_stereo_outputs[i], buf, nframes);
         }
     }
+    return scene->output_silent;
+}
+
+gboolean cbox_scene_set_render_threads(struct cbox_scene *scene, int thread_count, GError **error)
+{
+    if (thread_count < 0 || thread_count > CBOX_WORKER_POOL_MAX_THREADS)
+    {
+        g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_OUT_OF_RANGE, "Invalid render thread count %d", thread_count);
+        return FALSE;
+    }
+    if (thread_count == (scene->render_pool ? cbox_worker_pool_get_thread_count(scene->render_pool) : 0))
+        return TRUE;
+    struct cbox_worker_pool *pool = NULL;
+    if (thread_count)
+    {
+        pool = cbox_worker_pool_new(thread_count, cbox_config_get_int("io", "render_thread_priority", CBOX_WORKER_POOL_DEFAULT_PRIORITY), error);
+        if (!pool)
+            return FALSE;
+    }
+    struct cbox_worker_pool *old_pool = cbox_rt_swap_pointers(scene->rt, (void **)&scene->render_pool, pool);
+    if (old_pool)
+        cbox_worker_pool_destroy(old_pool);
+    return TRUE;
 }
 
 void cbox_scene_clear(struct cbox_scene *scene)
@@ -993,6 +1122,8 @@ struct cbox_scene *cbox_scene_new(struct cbox_document *document, struct cbox_en
     s->rec_stereo_outputs = create_rec_sources(s, buffer_size, engine->io_env.output_count / 2, 2);
     s->adhoc_patterns = NULL;
     s->retired_adhoc_patterns = NULL;
+    s->render_pool = NULL;
+    s->output_silent = TRUE;
     
     CBOX_OBJECT_REGISTER(s);
     
@@ -1190,5 +1321,7 @@ static void cbox_scene_destroyfunc(struct cbox_objhdr *objhdr)
     free_adhoc_pattern_list(scene, scene->retired_adhoc_patterns);
     free_adhoc_pattern_list(scene, scene->adhoc_patterns);
     cbox_midi_merger_close(&scene->scene_input_merger);    
+    if (scene->render_pool)
+        cbox_worker_pool_destroy(scene->render_pool);
     free(scene);
 }
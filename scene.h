@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "cmd.h"
 #include "dom.h"
 #include "mididest.h"
+#include "workerpool.h"
 
 CBOX_EXTERN_CLASS(cbox_scene)
 
@@ -60,6 +61,10 @@ struct cbox_scene
     struct cbox_recording_source *rec_stereo_inputs, *rec_stereo_outputs;
 
     struct cbox_adhoc_pattern *adhoc_patterns, *retired_adhoc_patterns;
+    // NULL if instruments and aux buses are rendered serially
+    struct cbox_worker_pool *render_pool;
+    // TRUE if nothing has been added to the output buffers in the current period
+    gboolean output_silent;
 };
 
 extern struct cbox_scene *cbox_scene_new(struct cbox_document *document, struct cbox_engine *engine);
@@ -70,7 +75,9 @@ extern void cbox_scene_move_layer(struct cbox_scene *scene, int oldpos, int newp
 extern gboolean cbox_scene_load(struct cbox_scene *scene, const char *section, GError **error);
 extern gboolean cbox_scene_remove_instrument(struct cbox_scene *scene, struct cbox_instrument *instrument);
 extern struct cbox_aux_bus *cbox_scene_get_aux_bus(struct cbox_scene *scene, const char *name, int allow_load, GError **error);
-extern void cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output_buffers[]);
+// Returns TRUE if the scene didn't add anything to the output buffers
+extern gboolean cbox_scene_render(struct cbox_scene *scene, uint32_t nframes, float *output_buffers[]);
+extern gboolean cbox_scene_set_render_threads(struct cbox_scene *scene, int thread_count, GError **error);
 extern void cbox_scene_clear(struct cbox_scene *scene);
 extern void cbox_scene_update_connected_inputs(struct cbox_scene *scene);
 extern gboolean cbox_scene_move_instrument_to(struct cbox_scene *scene, struct cbox_instrument *instrument, struct cbox_scene *new_scene, int dstpos, GError **error);
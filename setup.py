@@ -67,6 +67,7 @@ csources = [
     "sampler_gen.c",
     "sampler_layer.c",
     "sampler_prg.c",
+    "sampler_rll.c",
     "sampler_voice.c",
     "scene.c",
     "scripting.c",
@@ -85,7 +86,9 @@ csources = [
     "usbio.c",
     "usbmidi.c",
     "usbprobe.c",
-    "wavebank.c"
+    "wavebank.c",
+    "wavepack.c",
+    "workerpool.c"
 ]
 
 if '#define USE_SSE 1' in open('config.h').read():
@@ -30,21 +30,59 @@ struct sfz_load_state
     struct sampler_layer *region;
     gboolean is_control;
     GError **error;
+    // regions are finalized after the whole file has been parsed, so that
+    // their samples can be loaded in parallel first
+    GSList *pending_regions;
+    struct cbox_command_target *fb;
 };
 
 static void load_sfz_end_region(struct sfz_parser_client *client)
 {
     struct sfz_load_state *ls = client->user_data;
     // printf("-- copy current region to the list of layers\n");
-    struct sampler_layer *l = ls->region;
-    sampler_layer_data_finalize(&l->data, l->parent_group ? &l->parent_group->data : NULL, ls->program);
-    sampler_layer_reset_switches(l, ls->m);
-    sampler_layer_update(l);
-    sampler_program_add_layer(ls->program, ls->region);
+    ls->pending_regions = g_slist_prepend(ls->pending_regions, ls->region);
 
     ls->region = NULL;
 }
 
+static void load_sfz_progress(void *user_data, int done, int total)
+{
+    struct sfz_load_state *ls = user_data;
+    if (ls->fb)
+        cbox_execute_on(ls->fb, NULL, "/load_progress", "ii", NULL, done, total);
+}
+
+static void load_sfz_finalize_regions(struct sfz_load_state *ls)
+{
+    struct sampler_program *prg = ls->program;
+    GPtrArray *filenames = g_ptr_array_new();
+    ls->pending_regions = g_slist_reverse(ls->pending_regions);
+    for (GSList *p = ls->pending_regions; p; p = p->next)
+    {
+        // the sample may be inherited from the group
+        struct sampler_layer *l = p->data;
+        while(l && !l->data.has_sample)
+            l = l->parent_group;
+        if (l && l->data.sample && *l->data.sample)
+            g_ptr_array_add(filenames, l->data.sample);
+    }
+    GPtrArray *waveforms = cbox_wavebank_preload_waveforms(prg->name, prg->tarfile, prg->sample_dir, filenames, load_sfz_progress, ls);
+    g_ptr_array_free(filenames, TRUE);
+
+    for (GSList *p = ls->pending_regions; p; p = p->next)
+    {
+        struct sampler_layer *l = p->data;
+        sampler_layer_data_finalize(&l->data, l->parent_group ? &l->parent_group->data : NULL, prg);
+        sampler_layer_reset_switches(l, ls->m);
+        sampler_layer_update(l);
+        sampler_program_add_layer(prg, l);
+    }
+    g_slist_free(ls->pending_regions);
+    ls->pending_regions = NULL;
+    // the regions hold their own references now
+    cbox_wavebank_release_waveforms(waveforms);
+}
+
 static void end_token(struct sfz_parser_client *client)
 {
     struct sfz_load_state *ls = client->user_data;
@@ -137,9 +175,9 @@ static gboolean handle_token(struct sfz_parser_client *client, const char *token
     return FALSE;
 }
 
-gboolean sampler_module_load_program_sfz(struct sampler_module *m, struct sampler_program *prg, const char *sfz, int is_from_string, GError **error)
+gboolean sampler_module_load_program_sfz(struct sampler_module *m, struct sampler_program *prg, const char *sfz, int is_from_string, struct cbox_command_target *fb, GError **error)
 {
-    struct sfz_load_state ls = { .group = prg->default_group, .m = m, .filename = sfz, .region = NULL, .error = error, .program = prg, .is_control = FALSE };
+    struct sfz_load_state ls = { .group = prg->default_group, .m = m, .filename = sfz, .region = NULL, .error = error, .program = prg, .is_control = FALSE, .pending_regions = NULL, .fb = fb };
     struct sfz_parser_client c = { .user_data = &ls, .token = handle_token, .key_value = load_sfz_key_value };
     g_clear_error(error);
 
@@ -152,10 +190,17 @@ gboolean sampler_module_load_program_sfz(struct sampler_module *m, struct sample
     {
         if (ls.region)
             CBOX_DELETE(ls.region);
+        for (GSList *p = ls.pending_regions; p; p = p->next)
+        {
+            struct sampler_layer *l = p->data;
+            CBOX_DELETE(l);
+        }
+        g_slist_free(ls.pending_regions);
         return FALSE;
     }
 
     end_token(&c);
+    load_sfz_finalize_regions(&ls);
     
     prg->all_layers = g_slist_reverse(prg->all_layers);
     sampler_program_update_layers(prg);
@@ -0,0 +1,86 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Self-check of the steal buckets of the "quietest" policy. The lowest
+// non-empty bucket is stolen from first, so a voice that is silent (amp
+// envelope decayed to 0, or a sustain level of 0) must be in a lower bucket
+// than any sounding voice, held or released, and the buckets must not go
+// up as the level goes down. Returns a non-zero exit code on mismatch.
+// Not built by default, use "make stealcheck".
+
+#include "sampler.h"
+#include <stdio.h>
+
+struct check_voice
+{
+    struct sampler_voice voice;
+    struct sampler_voice_envs envs;
+};
+
+static int get_bucket(struct sampler_module *m, double level, int stage, gboolean released)
+{
+    struct check_voice cv;
+    memset(&cv, 0, sizeof(cv));
+    cv.voice.envs = &cv.envs;
+    cv.voice.released = released;
+    cv.envs.amp_env.cur_value = level;
+    cv.envs.amp_env.cur_stage = stage;
+    return sampler_voice_get_steal_bucket(m, &cv.voice);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct sampler_module module;
+    // decay, sustain and release stages; levels in the envelope's 0-100 range
+    static const int stages[] = { 3, 4, 5 };
+    static const double levels[] = { 100, 50, 10, 1, 0.1, 0.01, 100.1 / 16384.0, 1e-6 };
+    int errors = 0;
+
+    module.steal_policy = ssp_quietest;
+    for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); s++)
+    {
+        for (int released = 0; released < 2; released++)
+        {
+            int silent = get_bucket(&module, 0, stages[s], released);
+            if (silent != 0)
+            {
+                printf("Silent voice in stage %d (released %d) is in bucket %d\n", stages[s], released, silent);
+                errors++;
+            }
+            int last = SAMPLER_STEAL_BUCKETS - 1;
+            for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+            {
+                int bucket = get_bucket(&module, levels[l], stages[s], released);
+                if (bucket > last || bucket < silent)
+                {
+                    printf("Level %g in stage %d (released %d) is in bucket %d\n", levels[l], stages[s], released, bucket);
+                    errors++;
+                }
+                last = bucket;
+            }
+            // a sounding voice at a typical level is stolen after a silent one
+            if (get_bucket(&module, 10, stages[s], released) <= silent)
+            {
+                printf("Sounding voice in stage %d (released %d) is not above the silent one\n", stages[s], released);
+                errors++;
+            }
+        }
+    }
+    printf("%s\n", errors ? "FAILED" : "OK");
+    return errors ? 1 : 0;
+}
@@ -53,6 +53,15 @@ class TestCbox(unittest.TestCase):
         scene.clear()
         scene.add_new_instrument_layer("test_instr", "sampler")
         
+        self.assertEqual(scene.status().render_threads, 0)
+        # normal priority workers, the tests may run without realtime privileges
+        cbox.Config.set("io", "render_thread_priority", 0)
+        scene.set_render_threads(2)
+        self.assertEqual(scene.status().render_threads, 2)
+        scene.set_render_threads(0)
+        self.assertEqual(scene.status().render_threads, 0)
+        cbox.Config.delete("io", "render_thread_priority")
+
         scene_status = scene.status()
         layer = scene_status.layers[0]
         self.verify_uuid(scene.uuid, "cbox_scene", "/scene")
@@ -137,6 +146,32 @@ class TestCbox(unittest.TestCase):
         self.verify_uuid(layer.uuid, "cbox_layer", scene.make_path("/layer/1"))
         instrument = layer.get_instrument()
         self.assertEqual(instrument.status().engine, "sampler")
+        self.assertEqual(instrument.engine.status().steal_policy, "released")
+        self.assertEqual(instrument.engine.status().render_threads, 0)
+        self.assertEqual(instrument.engine.status().stream_underruns, 0)
+        self.assertEqual(instrument.engine.status().stream_buffer_shortages, 0)
+        streaming = cbox.GetThings("/waves/status", ['bytes', 'mapped_bytes', 'budget', 'evictions', 'warmups', 'cache_hits', 'cache_misses', 'packed_bytes', 'stream_pipes', 'stream_buffer_bytes', 'stream_buffer_budget', 'stream_underruns', 'stream_buffer_shortages'], [])
+        self.assertTrue(streaming.mapped_bytes <= streaming.bytes)
+        self.assertTrue(streaming.packed_bytes <= streaming.bytes)
+        self.assertEqual(streaming.budget, 0)
+        self.assertEqual(streaming.evictions, 0)
+        self.assertEqual(streaming.stream_pipes, 0)
+        self.assertTrue(streaming.stream_buffer_bytes <= streaming.stream_buffer_budget)
+        self.assertEqual(streaming.stream_underruns, 0)
+        self.assertEqual(streaming.stream_buffer_shortages, 0)
+        instrument.engine.set_steal_policy("quietest")
+        self.assertEqual(instrument.engine.status().steal_policy, "quietest")
+        with self.assertRaises(Exception):
+            instrument.engine.set_steal_policy("loudest")
+        instrument.engine.set_polyphony(1024)
+        self.assertEqual(instrument.engine.status().polyphony, 1024)
+        self.assertTrue(instrument.engine.status().allocated_voices >= 1024)
+        instrument.engine.set_polyphony(16)
+        self.assertEqual(instrument.engine.status().polyphony, 16)
+        self.assertTrue(instrument.engine.status().allocated_voices >= 16)
+        # streaming status covers the pipes of all the voice arenas
+        self.assertEqual(instrument.engine.status().active_pipes, 0)
+        self.assertEqual(instrument.engine.status().stream_underruns, 0)
         
         program0 = instrument.engine.load_patch_from_file(0, 'synthbass.sfz', 'test_sampler_sfz_loader')
         self.assertNotEqual(program0, None)
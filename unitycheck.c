@@ -0,0 +1,163 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Self-check of the unity pitch shortcut in sampler_gen.c: for every sample
+// format, the copy kernels used when bigdelta is exactly 1 << 32 must produce
+// the same output (to within float rounding of the 1/6 scaling in the cubic
+// interpolator), the same gain ramps and the same end position as the cubic
+// kernels they replace. The kernels are static, so the file is included.
+// Returns a non-zero exit code on mismatch.
+// Not built by default, use "make unitycheck".
+
+#include "sampler_gen.c"
+
+#define CHECK_FRAMES 4096
+#define CHECK_RUNS 200
+#define MAX_ERROR 1e-6
+
+static uint32_t seed = 1;
+
+static int rnd(int range)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % range;
+}
+
+static const char *mode_names[] = {
+    [spt_mono16] = "mono16", [spt_stereo16] = "stereo16",
+    [spt_mono24] = "mono24", [spt_stereo24] = "stereo24",
+    [spt_monof] = "monof", [spt_stereof] = "stereof",
+};
+
+// The dispatch in process_voice_noloop, minus the unity shortcut
+static void process_voice_cubic(struct sampler_gen *v, struct resampler_state *rs, const void *src, int endpos)
+{
+    switch(v->mode)
+    {
+        case spt_stereo16: process_voice_stereo_noloop(v, rs, src, endpos); break;
+        case spt_mono24: process_voice_mono_noloop_s24(v, rs, src, endpos); break;
+        case spt_stereo24: process_voice_stereo_noloop_s24(v, rs, src, endpos); break;
+        case spt_monof: process_voice_mono_noloop_f32(v, rs, src, endpos); break;
+        case spt_stereof: process_voice_stereo_noloop_f32(v, rs, src, endpos); break;
+        default: process_voice_mono_noloop(v, rs, src, endpos); break;
+    }
+}
+
+// Random samples in the int16 scale, stored in the format of the mode
+static void *generate(enum sampler_player_type mode, int values)
+{
+    int16_t *s16 = malloc(values * sizeof(int16_t));
+    uint8_t *s24 = malloc(values * 3);
+    float *f32 = malloc(values * sizeof(float));
+    for (int i = 0; i < values; i++)
+    {
+        int value = (rnd(4) ? rnd(65536) : (i & 1) * 65535) - 32768;
+        int fraction = rnd(256);
+        s16[i] = value;
+        s24[3 * i] = fraction;
+        s24[3 * i + 1] = value & 255;
+        s24[3 * i + 2] = (value >> 8) & 255;
+        f32[i] = value + fraction / 256.f;
+    }
+    void *result;
+    switch(mode)
+    {
+        case spt_mono24: case spt_stereo24: result = s24; s24 = NULL; break;
+        case spt_monof: case spt_stereof: result = f32; f32 = NULL; break;
+        default: result = s16; s16 = NULL; break;
+    }
+    free(s16);
+    free(s24);
+    free(f32);
+    return result;
+}
+
+static int mismatch(float unity_value, float cubic_value)
+{
+    return fabs(unity_value - cubic_value) > MAX_ERROR * (fabs(cubic_value) > 1 ? fabs(cubic_value) : 1);
+}
+
+static int check_mode(enum sampler_player_type mode)
+{
+    int channels = (mode == spt_stereo16 || mode == spt_stereo24 || mode == spt_stereof) ? 2 : 1;
+    void *data = generate(mode, (CHECK_FRAMES + MAX_INTERPOLATION_ORDER) * channels);
+    float unity_out[2 * CBOX_BLOCK_SIZE], cubic_out[2 * CBOX_BLOCK_SIZE];
+    int errors = 0;
+
+    for (int run = 0; run < CHECK_RUNS; run++)
+    {
+        struct sampler_gen unity_gen, cubic_gen;
+        struct resampler_state unity_rs, cubic_rs;
+        memset(&unity_gen, 0, sizeof(unity_gen));
+        unity_gen.mode = mode;
+        unity_gen.bigpos = (uint64_t)rnd(CHECK_FRAMES - CBOX_BLOCK_SIZE) << 32;
+        unity_gen.bigdelta = (uint64_t)1 << 32;
+        cubic_gen = unity_gen;
+
+        // start part way into the block sometimes, like after a delay or
+        // a loop restart
+        unity_rs.leftright = unity_out;
+        unity_rs.offset = rnd(4) ? 0 : rnd(CBOX_BLOCK_SIZE);
+        unity_rs.lgain = rnd(1000) / 1000.0;
+        unity_rs.rgain = rnd(1000) / 1000.0;
+        unity_rs.lgain_delta = (rnd(1000) - 500) / 1000000.0;
+        unity_rs.rgain_delta = (rnd(1000) - 500) / 1000000.0;
+        cubic_rs = unity_rs;
+        cubic_rs.leftright = cubic_out;
+        memset(unity_out, 0, sizeof(unity_out));
+        memset(cubic_out, 0, sizeof(cubic_out));
+
+        if (!sampler_gen_is_unity(&unity_gen))
+        {
+            errors++;
+            break;
+        }
+        uint32_t start = unity_gen.bigpos >> 32;
+        uint32_t frames = process_voice_noloop(&unity_gen, &unity_rs, data, 0, CHECK_FRAMES);
+        process_voice_cubic(&cubic_gen, &cubic_rs, data, unity_rs.offset);
+
+        if (unity_gen.bigpos != cubic_gen.bigpos || unity_rs.offset != cubic_rs.offset ||
+            frames != (cubic_gen.bigpos >> 32) - start ||
+            unity_rs.lgain != cubic_rs.lgain || unity_rs.rgain != cubic_rs.rgain)
+        {
+            errors++;
+            continue;
+        }
+        for (int i = 0; i < 2 * CBOX_BLOCK_SIZE; i++)
+        {
+            if (mismatch(unity_out[i], cubic_out[i]))
+            {
+                errors++;
+                break;
+            }
+        }
+    }
+    printf("%-8s %d runs: %s\n", mode_names[mode], CHECK_RUNS, errors ? "FAILED" : "OK");
+    free(data);
+    return errors;
+}
+
+int main(int argc, char *argv[])
+{
+    static const enum sampler_player_type modes[] = { spt_mono16, spt_stereo16, spt_mono24, spt_stereo24, spt_monof, spt_stereof };
+    int errors = 0;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        errors += check_mode(modes[i]);
+    printf("%s\n", errors ? "FAILED" : "OK");
+    return errors ? 1 : 0;
+}
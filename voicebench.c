@@ -0,0 +1,287 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Micro-benchmark of the voice data layout: a pass over 256 active voices
+// touching the state the render loop uses every block, with the generator,
+// envelope and filter state stored inline in each voice (the old layout) and
+// in the per-arena arrays of struct sampler_voice_arena. The caches are
+// flushed between blocks, like the other modules and the sample data would.
+// Cache misses per voice come from the hardware counters; where those are not
+// available (no perf_event_open, VMs without a PMU) only the time is shown.
+// Not built by default, use "make voicebench".
+
+#include "sampler.h"
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_VOICES 256
+#define BENCH_BLOCKS 2000
+#define FLUSH_SIZE (16 << 20)
+
+// The old layout - the same data, with the DSP state inside the voice
+struct inline_voice
+{
+    struct sampler_voice voice;
+    struct sampler_gen gen;
+    struct sampler_voice_envs envs;
+    struct sampler_voice_filters filters;
+} __attribute__((aligned(SAMPLER_VOICE_ALIGNMENT)));
+
+struct counters
+{
+    int fds[2];
+    uint64_t values[2];
+};
+
+static const char *counter_names[2] = { "L1D misses", "LLC misses" };
+
+static char *flush_buffer;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counters_init(struct counters *c)
+{
+    c->fds[0] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    c->fds[1] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+}
+
+static void counters_enable(struct counters *c, int enable)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (c->fds[i] != -1)
+            ioctl(c->fds[i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+static void counters_read(struct counters *c)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        c->values[i] = 0;
+        if (c->fds[i] != -1 && read(c->fds[i], &c->values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+            c->values[i] = 0;
+        if (c->fds[i] != -1)
+            ioctl(c->fds[i], PERF_EVENT_IOC_RESET, 0);
+    }
+}
+
+static uint32_t seed = 1;
+
+static int rnd(int range)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % range;
+}
+
+// Roughly what sampler_voice_prepare, sampler_voice_render and the mix
+// function do with the per-voice state in one block, minus the audio itself
+static float process_voice(struct sampler_voice *v)
+{
+    struct sampler_gen *gen = v->gen;
+    struct sampler_voice_envs *envs = v->envs;
+    struct sampler_voice_filters *filters = v->filters;
+    float sum = 0;
+
+    if (v->delay >= CBOX_BLOCK_SIZE)
+        v->delay -= CBOX_BLOCK_SIZE;
+    v->age += CBOX_BLOCK_SIZE;
+    struct cbox_envelope *env[3] = { &envs->amp_env, &envs->filter_env, &envs->pitch_env };
+    for (int i = 0; i < 3; i++)
+    {
+        env[i]->cur_time += CBOX_BLOCK_SIZE;
+        env[i]->cur_value = env[i]->stage_start_value + env[i]->cur_time * env[i]->inv_time;
+    }
+    float gain = envs->amp_env.cur_value * v->gain_fromvel * v->gain_shift;
+    gen->last_lgain = gen->lgain;
+    gen->last_rgain = gen->rgain;
+    gen->lgain = gain;
+    gen->rgain = gain;
+    gen->bigpos += (uint64_t)CBOX_BLOCK_SIZE * gen->bigdelta;
+    if ((gen->bigpos >> 32) >= gen->cur_sample_end)
+        gen->bigpos = (uint64_t)gen->loop_start << 32;
+    filters->filter_key = (uint32_t)(envs->filter_env.cur_value + v->cutoff_shift);
+    struct cbox_biquadf_state *states[4] = { &filters->filter_left, &filters->filter_right, &filters->filter_left2, &filters->filter_right2 };
+    for (int i = 0; i < 4; i++)
+    {
+        states[i]->x2 = states[i]->x1;
+        states[i]->x1 = gain;
+        states[i]->y2 = states[i]->y1;
+        states[i]->y1 = filters->filter_coeffs.a0 * gain - filters->filter_coeffs.b1 * states[i]->y2;
+        sum += states[i]->y1;
+    }
+    filters->filter_coeffs_prev = filters->filter_coeffs;
+    filters->onepole_left.y1 = filters->onepole_coeffs.a0 * sum;
+    filters->onepole_right.y1 = filters->onepole_coeffs.a0 * sum;
+    return sum + gen->lgain + v->send1gain;
+}
+
+static float run_blocks(struct sampler_voice *first, struct counters *c, double *time)
+{
+    float sum = 0;
+    *time = 0;
+    for (int b = 0; b < BENCH_BLOCKS; b++)
+    {
+        for (int i = 0; i < FLUSH_SIZE; i += 64)
+            flush_buffer[i]++;
+        double t = now();
+        counters_enable(c, 1);
+        for (struct sampler_voice *v = first; v; v = v->next)
+            sum += process_voice(v);
+        counters_enable(c, 0);
+        *time += now() - t;
+    }
+    counters_read(c);
+    return sum;
+}
+
+// Links the voices into a running list, either in reverse allocation order
+// (as after starting them from a fresh free list) or in random order (as
+// after some time of voices being stolen and reused)
+static struct sampler_voice *link_voices(struct sampler_voice **voices, int shuffle)
+{
+    int order[BENCH_VOICES];
+    for (int i = 0; i < BENCH_VOICES; i++)
+        order[i] = BENCH_VOICES - 1 - i;
+    for (int i = BENCH_VOICES - 1; shuffle && i > 0; i--)
+    {
+        int j = rnd(i + 1), tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (int i = 0; i < BENCH_VOICES; i++)
+        voices[order[i]]->next = i < BENCH_VOICES - 1 ? voices[order[i + 1]] : NULL;
+    return voices[order[0]];
+}
+
+static void init_voice(struct sampler_voice *v)
+{
+    v->gen->bigdelta = 1ULL << 32;
+    v->gen->cur_sample_end = 1 << 20;
+    v->gen->loop_start = 0;
+    v->gain_fromvel = 1;
+    v->gain_shift = 1;
+    v->envs->amp_env.inv_time = v->envs->filter_env.inv_time = v->envs->pitch_env.inv_time = 1e-6;
+    v->filters->filter_coeffs.a0 = 0.5;
+    v->filters->onepole_coeffs.a0 = 0.5;
+}
+
+static void report(const char *name, struct counters *c, double time)
+{
+    double voice_blocks = (double)BENCH_BLOCKS * BENCH_VOICES;
+    printf("%-26s %6.1f ns/voice", name, time * 1e9 / voice_blocks);
+    for (int i = 0; i < 2; i++)
+    {
+        if (c->fds[i] != -1)
+            printf(", %s %5.2f/voice", counter_names[i], c->values[i] / voice_blocks);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct inline_voice *inline_voices;
+    struct sampler_voice *voices, *list[BENCH_VOICES];
+    struct sampler_gen *gens;
+    struct sampler_voice_envs *envs;
+    struct sampler_voice_filters *filters;
+    struct counters c;
+    double time;
+    float sum = 0;
+
+    if (posix_memalign((void **)&inline_voices, SAMPLER_VOICE_ALIGNMENT, BENCH_VOICES * sizeof(struct inline_voice)) ||
+        posix_memalign((void **)&voices, SAMPLER_VOICE_ALIGNMENT, BENCH_VOICES * sizeof(struct sampler_voice)) ||
+        posix_memalign((void **)&gens, SAMPLER_VOICE_ALIGNMENT, BENCH_VOICES * sizeof(struct sampler_gen)) ||
+        posix_memalign((void **)&envs, SAMPLER_VOICE_ALIGNMENT, BENCH_VOICES * sizeof(struct sampler_voice_envs)) ||
+        posix_memalign((void **)&filters, SAMPLER_VOICE_ALIGNMENT, BENCH_VOICES * sizeof(struct sampler_voice_filters)))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    flush_buffer = calloc(FLUSH_SIZE, 1);
+    memset(inline_voices, 0, BENCH_VOICES * sizeof(struct inline_voice));
+    memset(voices, 0, BENCH_VOICES * sizeof(struct sampler_voice));
+    memset(gens, 0, BENCH_VOICES * sizeof(struct sampler_gen));
+    memset(envs, 0, BENCH_VOICES * sizeof(struct sampler_voice_envs));
+    memset(filters, 0, BENCH_VOICES * sizeof(struct sampler_voice_filters));
+    counters_init(&c);
+    if (c.fds[0] == -1 && c.fds[1] == -1)
+        printf("Hardware cache counters not available, reporting time only\n");
+    printf("%d voices, voice structure %d bytes, inline DSP state %d bytes\n", BENCH_VOICES,
+        (int)sizeof(struct sampler_voice), (int)(sizeof(struct inline_voice) - sizeof(struct sampler_voice)));
+
+    for (int shuffle = 0; shuffle < 2; shuffle++)
+    {
+        for (int i = 0; i < BENCH_VOICES; i++)
+        {
+            struct inline_voice *iv = &inline_voices[i];
+            iv->voice.gen = &iv->gen;
+            iv->voice.envs = &iv->envs;
+            iv->voice.filters = &iv->filters;
+            init_voice(&iv->voice);
+            list[i] = &iv->voice;
+        }
+        seed = 1;
+        sum += run_blocks(link_voices(list, shuffle), &c, &time);
+        report(shuffle ? "inline, random order" : "inline, arena order", &c, time);
+
+        for (int i = 0; i < BENCH_VOICES; i++)
+        {
+            struct sampler_voice *v = &voices[i];
+            v->gen = &gens[i];
+            v->envs = &envs[i];
+            v->filters = &filters[i];
+            init_voice(v);
+            list[i] = v;
+        }
+        seed = 1;
+        sum += run_blocks(link_voices(list, shuffle), &c, &time);
+        report(shuffle ? "arena arrays, random order" : "arena arrays, arena order", &c, time);
+    }
+    printf("(checksum %g)\n", sum);
+
+    free(flush_buffer);
+    free(filters);
+    free(envs);
+    free(gens);
+    free(voices);
+    free(inline_voices);
+    return 0;
+}
@@ -21,14 +21,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "config-api.h"
 #include "dspmath.h"
 #include "errors.h"
+#include "prefetch_pipe.h"
 #include "tarfile.h"
 #include "wavebank.h"
+#include "wavepack.h"
+#include "workerpool.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define STD_WAVEFORM_FRAMES 1024
 #define STD_WAVEFORM_BITS 10
@@ -119,12 +128,39 @@ static void my_ifft_c2r(int16_t output[STD_WAVEFORM_FRAMES], complex float input
     }    
 }
 
+// Largest part of an evicted preload region read back in one prefetch round,
+// so that warming up a waveform doesn't hold up the stream refills for long
+#define WARMUP_CHUNK_BYTES (256 * 1024)
+
 struct wave_bank
 {
     int64_t bytes, maxbytes, serial_no;
     GHashTable *waveforms_by_name, *waveforms_by_id;
     GSList *std_waveforms;
     uint32_t streaming_prefetch_size;
+    gboolean mmap_samples, mmap_populate, mlock_samples;
+    int64_t mapped_bytes;
+    struct cbox_prefetch_service *prefetch_service;
+    // preload eviction; the lock serialises the main thread (loading and
+    // unloading) and the prefetch thread (warming up evicted waveforms)
+    pthread_mutex_t lock;
+    // waveform being read into by the prefetch thread without the lock held;
+    // it can't be evicted or destroyed until warmup_done is signalled
+    struct cbox_waveform *warmup_busy;
+    pthread_cond_t warmup_done;
+    int64_t preload_budget;
+    uint32_t preload_head_frames;
+    int warmups_pending;
+    uint32_t evictions, warmups;
+    int load_threads;
+    gchar *preload_cache_dir;
+    uint32_t cache_hits, cache_misses;
+    gboolean compress_samples;
+    int64_t packed_bytes;
+    // formats used for integer samples wider than 16 bits and for floating
+    // point (and lossy) samples
+    enum cbox_sample_format int_format, float_format;
+    int resample_rate;
 };
 
 static struct wave_bank bank;
@@ -207,11 +243,13 @@ void cbox_wavebank_add_std_waveform(const char *name, float (*getfunc)(float v,
     }
     struct cbox_waveform *waveform = calloc(1, sizeof(struct cbox_waveform));
     waveform->data = wave;
+    waveform->format = csf_int16;
+    waveform->frame_size = sizeof(int16_t);
     waveform->info.channels = 1;
     waveform->preloaded_frames = waveform->info.frames = nsize;
     waveform->info.samplerate = (int)(nsize * 261.6255);
     waveform->id = ++bank.serial_no;
-    waveform->bytes = waveform->info.channels * 2 * (waveform->info.frames + 1);
+    waveform->bytes = waveform->frame_size * (waveform->info.frames + 1);
     waveform->refcount = 1;
     waveform->canonical_name = g_strdup(name);
     waveform->display_name = g_strdup(name);
@@ -231,6 +269,183 @@ void cbox_wavebank_add_std_waveform(const char *name, float (*getfunc)(float v,
     // much value for the user.
 }
 
+// Cuts the preloaded part of an unused waveform down to the head. Called with
+// bank.lock held.
+static gboolean cbox_waveform_evict(struct cbox_waveform *waveform)
+{
+    size_t old_frames = waveform->preloaded_frames;
+    waveform->preloaded_frames = bank.preload_head_frames;
+    // pairs with the barrier in cbox_waveform_acquire - either the voice sees
+    // the new size, or the voice count is seen here
+    __sync_synchronize();
+    if (waveform->active_voices)
+    {
+        waveform->preloaded_frames = old_frames;
+        return FALSE;
+    }
+    uint32_t frame_size = waveform->frame_size;
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)((uint8_t *)waveform->data + bank.preload_head_frames * frame_size) + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = (uintptr_t)((uint8_t *)waveform->data + old_frames * frame_size) & ~(page_size - 1);
+    // The pages are returned to the OS, and read back as zeroes until they
+    // are written by cbox_waveform_warmup
+    if (end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    size_t freed = (old_frames - bank.preload_head_frames) * frame_size;
+    waveform->bytes -= freed;
+    bank.bytes -= freed;
+    waveform->evicted = TRUE;
+    bank.evictions++;
+    return TRUE;
+}
+
+static gint compare_last_used(gconstpointer p1, gconstpointer p2)
+{
+    const struct cbox_waveform *w1 = *(struct cbox_waveform * const *)p1;
+    const struct cbox_waveform *w2 = *(struct cbox_waveform * const *)p2;
+    if (w1->last_used < w2->last_used)
+        return -1;
+    if (w1->last_used > w2->last_used)
+        return 1;
+    return 0;
+}
+
+// Evicts the least recently used waveforms until extra_bytes more fit in the
+// preload budget. Only the waveforms that are streamed anyway are considered.
+// Called with bank.lock held.
+static gboolean cbox_wavebank_make_room(size_t extra_bytes, struct cbox_waveform *keep)
+{
+    if (!bank.preload_budget || bank.bytes + (int64_t)extra_bytes <= bank.preload_budget)
+        return TRUE;
+    GPtrArray *candidates = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, bank.waveforms_by_id);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+    {
+        struct cbox_waveform *waveform = value;
+        // partially warmed up waveforms can be evicted again, too
+        if (waveform != keep && waveform != bank.warmup_busy && !waveform->mapping && !waveform->active_voices
+            && waveform->full_preloaded_frames < (size_t)waveform->info.frames && waveform->preloaded_frames > bank.preload_head_frames)
+            g_ptr_array_add(candidates, waveform);
+    }
+    g_ptr_array_sort(candidates, compare_last_used);
+    for (guint i = 0; i < candidates->len && bank.bytes + (int64_t)extra_bytes > bank.preload_budget; i++)
+        cbox_waveform_evict(g_ptr_array_index(candidates, i));
+    g_ptr_array_free(candidates, TRUE);
+    return bank.bytes + (int64_t)extra_bytes <= bank.preload_budget;
+}
+
+// Reads the next chunk of the evicted part of the preload region back, and
+// clears warmup_requested when it's complete (or can't be done). Called on
+// the prefetch thread with bank.lock held, releases it during the read.
+static void cbox_waveform_warmup(struct cbox_waveform *waveform)
+{
+    uint32_t frame_size = waveform->frame_size;
+    size_t head = waveform->preloaded_frames;
+    sf_count_t frames = waveform->full_preloaded_frames - head;
+    if (frames > WARMUP_CHUNK_BYTES / frame_size)
+        frames = WARMUP_CHUNK_BYTES / frame_size;
+    size_t extra = frames * frame_size;
+    if (!cbox_wavebank_make_room(extra, waveform))
+    {
+        waveform->warmup_requested = FALSE;
+        return;
+    }
+    // counted in right away, so that no one else uses the same space
+    waveform->bytes += extra;
+    bank.bytes += extra;
+    if (bank.bytes > bank.maxbytes)
+        bank.maxbytes = bank.bytes;
+    bank.warmup_busy = waveform;
+    pthread_mutex_unlock(&bank.lock);
+    
+    SF_INFO info;
+    struct cbox_tarfile_sndstream stream;
+    SNDFILE *sndfile;
+    memset(&info, 0, sizeof(info));
+    if (waveform->taritem)
+        sndfile = cbox_tarfile_opensndfile(waveform->tarfile, waveform->taritem, &stream, &info);
+    else
+        sndfile = sf_open(waveform->canonical_name, SFM_READ, &info);
+    if (sndfile)
+    {
+        uint8_t *dest = (uint8_t *)waveform->data + head * frame_size;
+        sf_count_t actread = 0;
+        if (sf_seek(sndfile, head, SEEK_SET) == (sf_count_t)head)
+            actread = cbox_waveform_read_frames(sndfile, waveform->format, waveform->info.channels, dest, frames);
+        if (actread < 0)
+            actread = 0;
+        if (actread < frames)
+            memset(dest + actread * frame_size, 0, (frames - actread) * frame_size);
+        sf_close(sndfile);
+    }
+    
+    pthread_mutex_lock(&bank.lock);
+    bank.warmup_busy = NULL;
+    pthread_cond_broadcast(&bank.warmup_done);
+    if (!sndfile)
+    {
+        waveform->bytes -= extra;
+        bank.bytes -= extra;
+        waveform->warmup_requested = FALSE;
+        return;
+    }
+    // the data needs to be in place before any voice can see the new size
+    __sync_synchronize();
+    waveform->preloaded_frames = head + frames;
+    if (waveform->preloaded_frames == waveform->full_preloaded_frames)
+    {
+        waveform->evicted = FALSE;
+        waveform->warmup_requested = FALSE;
+        bank.warmups++;
+    }
+}
+
+void cbox_waveform_request_warmup(struct cbox_waveform *waveform)
+{
+    waveform->warmup_requested = TRUE;
+    __sync_fetch_and_add(&bank.warmups_pending, 1);
+    cbox_prefetch_service_wakeup(bank.prefetch_service);
+}
+
+// Warms up one chunk per prefetch round, and asks for another round
+// straight away if there is more to do
+static void wavebank_housekeeping(void *user_data)
+{
+    if (!__sync_lock_test_and_set(&bank.warmups_pending, 0))
+        return;
+    pthread_mutex_lock(&bank.lock);
+    struct cbox_waveform *next = NULL;
+    gboolean more = FALSE;
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, bank.waveforms_by_id);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+    {
+        struct cbox_waveform *waveform = value;
+        if (!waveform->warmup_requested)
+            continue;
+        if (!waveform->evicted)
+            waveform->warmup_requested = FALSE;
+        else if (!next)
+            next = waveform;
+        else
+            more = TRUE;
+    }
+    if (next)
+    {
+        cbox_waveform_warmup(next);
+        more = more || next->warmup_requested;
+    }
+    pthread_mutex_unlock(&bank.lock);
+    if (more)
+    {
+        __sync_fetch_and_add(&bank.warmups_pending, 1);
+        cbox_prefetch_service_wakeup(bank.prefetch_service);
+    }
+}
+
 void cbox_wavebank_init()
 {
     init_tables();
@@ -242,11 +457,524 @@ void cbox_wavebank_init()
     bank.waveforms_by_id = g_hash_table_new(g_int_hash, g_int_equal);
     bank.std_waveforms = NULL;
     bank.streaming_prefetch_size = cbox_config_get_int("streaming", "prefetch_size", 65536);
+    bank.mmap_samples = cbox_config_get_int("streaming", "mmap_samples", 0);
+    bank.mmap_populate = cbox_config_get_int("streaming", "mmap_populate", 1);
+    bank.mlock_samples = cbox_config_get_int("streaming", "mlock_samples", 0);
+    bank.mapped_bytes = 0;
+    bank.preload_budget = (int64_t)cbox_config_get_int("streaming", "preload_budget_kb", 0) * 1024;
+    bank.preload_head_frames = cbox_config_get_int("streaming", "preload_head_frames", 8192);
+    bank.warmups_pending = 0;
+    bank.evictions = 0;
+    bank.warmups = 0;
+    bank.load_threads = cbox_config_get_int("streaming", "load_threads", 4);
+    bank.compress_samples = cbox_config_get_int("streaming", "compress_samples", 0);
+    // int16 (default) converts everything to 16 bits, int24 and float keep
+    // the extra resolution in the given format, native uses int24 for
+    // integer and float for floating point sources
+    const char *sample_format = cbox_config_get_string_with_default("streaming", "sample_format", "int16");
+    bank.int_format = bank.float_format = csf_int16;
+    if (!strcmp(sample_format, "int24"))
+        bank.int_format = bank.float_format = csf_int24;
+    else if (!strcmp(sample_format, "float"))
+        bank.int_format = bank.float_format = csf_float;
+    else if (!strcmp(sample_format, "native"))
+    {
+        bank.int_format = csf_int24;
+        bank.float_format = csf_float;
+    }
+    else if (strcmp(sample_format, "int16"))
+        g_warning("Unknown sample format '%s', using int16", sample_format);
+    bank.resample_rate = cbox_config_get_int("streaming", "resample_rate", 0);
+    bank.packed_bytes = 0;
+    const char *cache_dir = cbox_config_get_string("streaming", "preload_cache_dir");
+    bank.preload_cache_dir = NULL;
+    bank.cache_hits = 0;
+    bank.cache_misses = 0;
+    if (cache_dir && *cache_dir)
+    {
+        if (!g_mkdir_with_parents(cache_dir, 0755))
+            bank.preload_cache_dir = g_strdup(cache_dir);
+        else
+            g_warning("Cannot create preload cache directory '%s': %s", cache_dir, strerror(errno));
+    }
+    pthread_mutex_init(&bank.lock, NULL);
+    pthread_cond_init(&bank.warmup_done, NULL);
+    bank.warmup_busy = NULL;
+    // Shared by all the sampler instances
+    uint32_t streambuf_size = cbox_config_get_int("streaming", "streambuf_size", 65536);
+    bank.prefetch_service = cbox_prefetch_service_new(streambuf_size,
+        (uint64_t)cbox_config_get_int("streaming", "streambuf_budget_kb", 256 * (streambuf_size / 1024)) * 1024,
+        cbox_config_get_int("streaming", "io_threads", 0));
     
     cbox_wavebank_add_std_waveform("*sine", func_sine, NULL, 0);
     cbox_wavebank_add_std_waveform("*saw", func_saw, NULL, 11);
     cbox_wavebank_add_std_waveform("*sqr", func_sqr, NULL, 11);
     cbox_wavebank_add_std_waveform("*tri", func_tri, NULL, 11);
+    if (bank.prefetch_service)
+        cbox_prefetch_service_set_housekeeping(bank.prefetch_service, wavebank_housekeeping, NULL);
+}
+
+static inline uint32_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Find the sample data of a 16-bit PCM RIFF WAVE file stored at offset..offset+size
+// of fd. Anything else is left to libsndfile.
+gboolean cbox_waveform_find_pcm16_data(int fd, uint64_t offset, uint64_t size, SF_INFO *info, uint64_t *data_offset)
+{
+    uint8_t hdr[40];
+    if (size < 12 || pread(fd, hdr, 12, offset) != 12)
+        return FALSE;
+    if (memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+        return FALSE;
+    gboolean have_fmt = FALSE;
+    uint64_t data_size = 0;
+    *data_offset = 0;
+    uint64_t pos = 12;
+    while(pos + 8 <= size && (!have_fmt || !*data_offset))
+    {
+        if (pread(fd, hdr, 8, offset + pos) != 8)
+            return FALSE;
+        uint32_t chunk_size = get_le32(hdr + 4);
+        if (!memcmp(hdr, "fmt ", 4))
+        {
+            uint32_t fmt_size = chunk_size < sizeof(hdr) ? chunk_size : sizeof(hdr);
+            if (fmt_size < 16 || pread(fd, hdr, fmt_size, offset + pos + 8) != fmt_size)
+                return FALSE;
+            uint32_t format = get_le16(hdr);
+            // WAVE_FORMAT_EXTENSIBLE - the subformat GUID starts with the format tag
+            if (format == 0xFFFE && fmt_size >= 26)
+                format = get_le16(hdr + 24);
+            if (format != 1 || get_le16(hdr + 14) != 16)
+                return FALSE;
+            info->channels = get_le16(hdr + 2);
+            info->samplerate = get_le32(hdr + 4);
+            have_fmt = TRUE;
+        }
+        else if (!memcmp(hdr, "data", 4))
+        {
+            *data_offset = offset + pos + 8;
+            data_size = chunk_size;
+            if (data_size > size - pos - 8)
+                data_size = size - pos - 8;
+        }
+        // chunks are word-aligned
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+    if (!have_fmt || !*data_offset || !info->channels)
+        return FALSE;
+    info->frames = data_size / (sizeof(int16_t) * info->channels);
+    info->format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+    info->sections = 1;
+    info->seekable = 1;
+    return TRUE;
+}
+
+// Maps a read-only region of a file, using the [streaming] mmap_populate and
+// mlock_samples settings. offset must be a multiple of the page size.
+static void *cbox_wavebank_map_file(int fd, uint64_t offset, size_t size, const char *name)
+{
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (bank.mmap_populate)
+        flags |= MAP_POPULATE;
+#endif
+    void *mapping = mmap(NULL, size, PROT_READ, flags, fd, offset);
+    if (mapping == MAP_FAILED)
+        return NULL;
+    if (bank.mmap_populate)
+        madvise(mapping, size, MADV_WILLNEED);
+    // Pages of a mapping can be evicted, causing a page fault in the RT
+    // thread when they're played again - locking them prevents that
+    if (bank.mlock_samples && mlock(mapping, size))
+        g_warning("Cannot lock '%s' in memory: %s", name, strerror(errno));
+    return mapping;
+}
+
+// Maps the preloaded part of a 16-bit PCM WAV file instead of reading it
+// into memory, so that the page cache is used directly (and shared with any
+// other processes using the same files)
+static gboolean cbox_waveform_map(struct cbox_waveform *waveform, int fd, uint64_t offset, uint64_t size)
+{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    SF_INFO info;
+    uint64_t data_offset;
+    memset(&info, 0, sizeof(info));
+    if (!cbox_waveform_find_pcm16_data(fd, offset, size, &info, &data_offset))
+        return FALSE;
+    if (info.channels != waveform->info.channels || info.frames < waveform->preloaded_frames || (data_offset & 1))
+        return FALSE;
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t map_start = data_offset & ~(page_size - 1);
+    size_t map_size = data_offset - map_start + waveform->bytes;
+    void *mapping = cbox_wavebank_map_file(fd, map_start, map_size, waveform->canonical_name);
+    if (!mapping)
+        return FALSE;
+    waveform->mapping = mapping;
+    waveform->mapping_size = map_size;
+    waveform->data = (uint8_t *)mapping + (data_offset - map_start);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+// Picks the format for keeping the data of a file with the given libsndfile
+// format, according to the [streaming] sample_format setting
+static enum cbox_sample_format cbox_wavebank_choose_format(int sf_format)
+{
+    switch(sf_format & SF_FORMAT_SUBMASK)
+    {
+        case SF_FORMAT_PCM_24:
+        case SF_FORMAT_PCM_32:
+            return bank.int_format;
+        case SF_FORMAT_FLOAT:
+        case SF_FORMAT_DOUBLE:
+        case SF_FORMAT_VORBIS:
+            return bank.float_format;
+        default:
+            return csf_int16;
+    }
+}
+
+sf_count_t cbox_waveform_read_frames(SNDFILE *sndfile, enum cbox_sample_format format, int channels, void *dest, sf_count_t frames)
+{
+    if (format == csf_int16)
+        return sf_readf_short(sndfile, dest, frames);
+    if (format == csf_float)
+    {
+        // libsndfile normalises floats to -1..1
+        float *fdest = dest;
+        sf_count_t actread = sf_readf_float(sndfile, fdest, frames);
+        for (sf_count_t i = 0; i < actread * channels; i++)
+            fdest[i] *= 32768.f;
+        return actread;
+    }
+    // libsndfile returns ints left-aligned, the top 3 bytes are kept
+    int32_t buf[1024];
+    uint8_t *bdest = dest;
+    sf_count_t total = 0;
+    while(total < frames)
+    {
+        sf_count_t chunk = frames - total;
+        if (chunk > 1024 / channels)
+            chunk = 1024 / channels;
+        sf_count_t actread = sf_readf_int(sndfile, buf, chunk);
+        if (actread <= 0)
+            break;
+        for (sf_count_t i = 0; i < actread * channels; i++)
+        {
+            uint32_t value = buf[i];
+            bdest[0] = value >> 8;
+            bdest[1] = value >> 16;
+            bdest[2] = value >> 24;
+            bdest += 3;
+        }
+        total += actread;
+        if (actread < chunk)
+            break;
+    }
+    return total;
+}
+
+// If sample is larger than 2x prefetch buffer size, then load only
+// a prefetch buffer worth of data, and stream the rest.
+static uint32_t cbox_wavebank_get_preload_frames(sf_count_t frames)
+{
+    if (frames > 2 * bank.streaming_prefetch_size)
+        return bank.streaming_prefetch_size;
+    return frames;
+}
+
+// Only the samples that are kept in memory as a whole are converted, the
+// streamed ones are read at the source rate by the prefetch pipes. Samples
+// with an embedded loop are left alone too, because the loop points
+// would no longer fall on whole frames.
+static gboolean cbox_wavebank_should_resample(int samplerate, sf_count_t frames, gboolean has_loop)
+{
+    return bank.resample_rate > 0 && samplerate > 0 && samplerate != bank.resample_rate
+        && frames > 0 && cbox_wavebank_get_preload_frames(frames) == frames && !has_loop;
+}
+
+// The preload cache keeps the decoded preload region of each sample file in
+// [streaming] preload_cache_dir, so that compressed files (and files inside
+// tar archives) don't need to be decoded again on the next start. Each entry
+// is a header, followed by the canonical name (to detect hash collisions)
+// and the sample data in native byte order, and is mapped directly.
+#define CBOX_PRELOAD_CACHE_MAGIC "CBXPRE02"
+#define CBOX_PRELOAD_CACHE_BYTE_ORDER 0x01020304
+
+struct cbox_preload_cache_header
+{
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t name_length;
+    uint64_t source_size;
+    int64_t source_mtime;
+    int64_t frames;
+    int32_t samplerate, channels, format, sections, seekable;
+    uint32_t preloaded_frames;
+    uint32_t has_loop, loop_start, loop_end;
+    uint32_t sample_format;
+    uint32_t data_offset;
+};
+
+static gchar *cbox_preload_cache_path(const char *canonical)
+{
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, canonical, -1);
+    gchar *path = g_strdup_printf("%s/%s.pcm", bank.preload_cache_dir, hash);
+    g_free(hash);
+    return path;
+}
+
+// Returns the mapping of a valid cache entry, or NULL if there is none.
+static void *cbox_preload_cache_map(const char *canonical, const struct stat *source_st, struct cbox_preload_cache_header *hdr, size_t *size)
+{
+    gchar *path = cbox_preload_cache_path(canonical);
+    int fd = open(path, O_RDONLY);
+    g_free(path);
+    if (fd == -1)
+        return NULL;
+    size_t name_length = strlen(canonical);
+    struct stat st;
+    void *mapping = NULL;
+    if (pread(fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr) && !memcmp(hdr->magic, CBOX_PRELOAD_CACHE_MAGIC, 8)
+        && hdr->byte_order == CBOX_PRELOAD_CACHE_BYTE_ORDER && hdr->name_length == name_length
+        && hdr->source_size == (uint64_t)source_st->st_size && hdr->source_mtime == (int64_t)source_st->st_mtime
+        && (hdr->channels == 1 || hdr->channels == 2) && hdr->preloaded_frames == cbox_wavebank_get_preload_frames(hdr->frames)
+        && hdr->sample_format == cbox_wavebank_choose_format(hdr->format)
+        && !cbox_wavebank_should_resample(hdr->samplerate, hdr->frames, hdr->has_loop)
+        && !fstat(fd, &st) && (uint64_t)st.st_size == hdr->data_offset + (uint64_t)hdr->preloaded_frames * hdr->channels * cbox_sample_format_get_size(hdr->sample_format))
+    {
+        // the cache file is written in one go, so this only checks for
+        // truncated files and hash collisions
+        gchar *name = g_malloc(name_length);
+        if (pread(fd, name, name_length, sizeof(*hdr)) == name_length && !memcmp(name, canonical, name_length))
+        {
+            *size = st.st_size;
+            mapping = cbox_wavebank_map_file(fd, 0, *size, canonical);
+        }
+        g_free(name);
+    }
+    close(fd);
+    return mapping;
+}
+
+static gboolean cbox_preload_cache_write(FILE *f, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, f) == size;
+}
+
+// Writes the preload region of a freshly decoded waveform to the cache. The
+// entry is created under a temporary name and renamed, so that other
+// processes (or loader threads) never see a partially written file.
+static void cbox_preload_cache_store(struct cbox_waveform *waveform, const struct stat *source_st)
+{
+    struct cbox_preload_cache_header hdr;
+    size_t name_length = strlen(waveform->canonical_name);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CBOX_PRELOAD_CACHE_MAGIC, 8);
+    hdr.byte_order = CBOX_PRELOAD_CACHE_BYTE_ORDER;
+    hdr.name_length = name_length;
+    hdr.source_size = source_st->st_size;
+    hdr.source_mtime = source_st->st_mtime;
+    hdr.frames = waveform->info.frames;
+    hdr.samplerate = waveform->info.samplerate;
+    hdr.channels = waveform->info.channels;
+    hdr.format = waveform->info.format;
+    hdr.sections = waveform->info.sections;
+    hdr.seekable = waveform->info.seekable;
+    hdr.preloaded_frames = waveform->preloaded_frames;
+    hdr.has_loop = waveform->has_loop;
+    hdr.loop_start = waveform->loop_start;
+    hdr.loop_end = waveform->loop_end;
+    hdr.sample_format = waveform->format;
+    // keep the sample data aligned
+    hdr.data_offset = (sizeof(hdr) + name_length + 15) & ~15;
+    
+    gchar *path = cbox_preload_cache_path(waveform->canonical_name);
+    gchar *tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    int fd = g_mkstemp(tmp_path);
+    if (fd == -1)
+    {
+        g_warning("Cannot create a preload cache file '%s': %s", tmp_path, strerror(errno));
+        g_free(tmp_path);
+        g_free(path);
+        return;
+    }
+    static const char padding[16];
+    FILE *f = fdopen(fd, "wb");
+    gboolean ok = f &&
+        cbox_preload_cache_write(f, &hdr, sizeof(hdr)) &&
+        cbox_preload_cache_write(f, waveform->canonical_name, name_length) &&
+        cbox_preload_cache_write(f, padding, hdr.data_offset - sizeof(hdr) - name_length) &&
+        cbox_preload_cache_write(f, waveform->data, waveform->bytes);
+    if (f)
+        ok = !fclose(f) && ok;
+    else
+        close(fd);
+    if (!ok || rename(tmp_path, path))
+    {
+        g_warning("Cannot write preload cache file '%s': %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    g_free(tmp_path);
+    g_free(path);
+}
+
+// Load-time sample rate conversion: windowed sinc (Blackman-Harris window),
+// with the kernel tabulated at RESAMPLE_TABLE_RES points per input frame
+// and linearly interpolated between them.
+#define RESAMPLE_ZERO_CROSSINGS 32
+#define RESAMPLE_TABLE_RES 512
+#define RESAMPLE_PASSBAND 0.95
+
+static void cbox_waveform_samples_to_float(const void *src, enum cbox_sample_format format, float *dest, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (format == csf_int16)
+            dest[i] = ((const int16_t *)src)[i];
+        else if (format == csf_float)
+            dest[i] = ((const float *)src)[i];
+        else
+        {
+            const uint8_t *p = (const uint8_t *)src + 3 * i;
+            dest[i] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) * (1.f / 65536.f);
+        }
+    }
+}
+
+static void cbox_waveform_samples_from_float(const float *src, enum cbox_sample_format format, void *dest, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (format == csf_float)
+            ((float *)dest)[i] = src[i];
+        else if (format == csf_int16)
+        {
+            long value = lrintf(src[i]);
+            ((int16_t *)dest)[i] = value < -32768 ? -32768 : (value > 32767 ? 32767 : value);
+        }
+        else
+        {
+            long value = lrintf(src[i] * 256.f);
+            value = value < -8388608 ? -8388608 : (value > 8388607 ? 8388607 : value);
+            uint8_t *p = (uint8_t *)dest + 3 * i;
+            p[0] = value;
+            p[1] = value >> 8;
+            p[2] = value >> 16;
+        }
+    }
+}
+
+static void cbox_waveform_resample(struct cbox_waveform *waveform, int samplerate)
+{
+    int channels = waveform->info.channels;
+    sf_count_t in_frames = waveform->info.frames;
+    double ratio = samplerate / (double)waveform->info.samplerate;
+    // Cutoff relative to the input Nyquist frequency; when downsampling, the
+    // kernel gets wider (in input frames) to remove what would alias
+    double cutoff = (ratio < 1 ? ratio : 1) * RESAMPLE_PASSBAND;
+    double half_width = RESAMPLE_ZERO_CROSSINGS / cutoff;
+    int table_size = (int)(half_width * RESAMPLE_TABLE_RES) + 2;
+    float *table = malloc(table_size * sizeof(float));
+    for (int i = 0; i < table_size; i++)
+    {
+        double x = i * (1.0 / RESAMPLE_TABLE_RES);
+        if (x >= half_width)
+        {
+            table[i] = 0;
+            continue;
+        }
+        double sinc = x > 0 ? sin(M_PI * cutoff * x) / (M_PI * cutoff * x) : 1;
+        double w = M_PI * (x / half_width + 1);
+        double window = 0.35875 - 0.48829 * cos(w) + 0.14128 * cos(2 * w) - 0.01168 * cos(3 * w);
+        table[i] = cutoff * sinc * window;
+    }
+
+    float *input = malloc(in_frames * channels * sizeof(float));
+    cbox_waveform_samples_to_float(waveform->data, waveform->format, input, in_frames * channels);
+    sf_count_t out_frames = (sf_count_t)(in_frames * ratio + 0.5);
+    float *output = calloc(out_frames * channels, sizeof(float));
+    for (sf_count_t i = 0; i < out_frames; i++)
+    {
+        double x = i / ratio;
+        sf_count_t first = (sf_count_t)ceil(x - half_width), last = (sf_count_t)floor(x + half_width);
+        if (first < 0)
+            first = 0;
+        if (last >= in_frames)
+            last = in_frames - 1;
+        float acc[2] = {0, 0};
+        for (sf_count_t j = first; j <= last; j++)
+        {
+            double pos = fabs(x - j) * RESAMPLE_TABLE_RES;
+            int idx = (int)pos;
+            float frac = pos - idx;
+            float coeff = table[idx] + (table[idx + 1] - table[idx]) * frac;
+            for (int c = 0; c < channels; c++)
+                acc[c] += coeff * input[j * channels + c];
+        }
+        for (int c = 0; c < channels; c++)
+            output[i * channels + c] = acc[c];
+    }
+    free(input);
+    free(table);
+
+    free(waveform->data);
+    waveform->bytes = out_frames * waveform->frame_size;
+    waveform->data = malloc(waveform->bytes);
+    cbox_waveform_samples_from_float(output, waveform->format, waveform->data, out_frames * channels);
+    free(output);
+    waveform->source_samplerate = waveform->info.samplerate;
+    waveform->source_frames = in_frames;
+    waveform->info.samplerate = samplerate;
+    waveform->info.frames = out_frames;
+    waveform->preloaded_frames = out_frames;
+    waveform->full_preloaded_frames = out_frames;
+}
+
+// Replaces a fully preloaded waveform with a compressed copy plus a short
+// uncompressed head, if that saves memory. The voices play the head from
+// memory and the rest through a prefetch pipe (see cbox_prefetch_io_wavepack),
+// so the sample generator never sees the compressed data. Short samples are
+// not worth it, as they would only add the pipe overhead.
+static void cbox_waveform_pack(struct cbox_waveform *waveform)
+{
+    uint32_t head = bank.preload_head_frames;
+    int channels = waveform->info.channels;
+    if (waveform->format != csf_int16 || waveform->preloaded_frames != waveform->info.frames || waveform->preloaded_frames <= 2 * head)
+        return;
+    struct cbox_wavepack *pack = cbox_wavepack_new(waveform->data, waveform->preloaded_frames, channels);
+    size_t head_bytes = head * channels * sizeof(int16_t);
+    size_t packed_bytes = cbox_wavepack_get_bytes(pack);
+    if (head_bytes + packed_bytes >= waveform->bytes)
+    {
+        cbox_wavepack_destroy(pack);
+        return;
+    }
+    waveform->data = realloc(waveform->data, head_bytes);
+    waveform->preloaded_frames = head;
+    waveform->full_preloaded_frames = head;
+    waveform->bytes = head_bytes + packed_bytes;
+    waveform->packed = pack;
+    __sync_fetch_and_add(&bank.packed_bytes, packed_bytes);
+}
+
+static struct cbox_waveform *cbox_wavebank_ref_waveform_by_name(const char *name)
+{
+    pthread_mutex_lock(&bank.lock);
+    struct cbox_waveform *waveform = g_hash_table_lookup(bank.waveforms_by_name, name);
+    if (waveform)
+        cbox_waveform_ref(waveform);
+    pthread_mutex_unlock(&bank.lock);
+    return waveform;
 }
 
 struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struct cbox_tarfile *tarfile, const char *sample_dir, const char *filename, GError **error)
@@ -260,13 +988,9 @@ struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struc
     // Built in waveforms don't go through path canonicalization
     if (filename[0] == '*')
     {
-        gpointer value = g_hash_table_lookup(bank.waveforms_by_name, filename);
-        if (value)
-        {
-            struct cbox_waveform *waveform = value;
-            cbox_waveform_ref(waveform);
+        struct cbox_waveform *waveform = cbox_wavebank_ref_waveform_by_name(filename);
+        if (waveform)
             return waveform;
-        }
     }
     
     gchar *value_copy = g_strdup(filename);
@@ -297,95 +1021,277 @@ struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struc
         g_free(pathname);
         return NULL;
     }
-    gpointer value = g_hash_table_lookup(bank.waveforms_by_name, canonical);
-    if (value)
+    struct cbox_waveform *existing = cbox_wavebank_ref_waveform_by_name(canonical);
+    if (existing)
     {
         g_free(pathname);
         g_free(canonical);
-        
-        struct cbox_waveform *waveform = value;
-        cbox_waveform_ref(waveform);
-        return waveform;
+        return existing;
     }
     
     struct cbox_waveform *waveform = calloc(1, sizeof(struct cbox_waveform));
     SNDFILE *sndfile = NULL;
     struct cbox_taritem *taritem = NULL;
     if (tarfile)
-    {
         taritem = cbox_tarfile_get_item_by_name(tarfile, pathname, TRUE);
-        if (taritem)
-            sndfile = cbox_tarfile_opensndfile(tarfile, taritem, &waveform->sndstream, &waveform->info);
+    // The cache entries are only valid for the same size and modification
+    // time of the source file (or the whole tar archive)
+    struct stat source_st;
+    gboolean cacheable = bank.preload_cache_dir && (taritem || !tarfile) && !stat(taritem ? tarfile->file_pathname : canonical, &source_st);
+    struct cbox_preload_cache_header cache_hdr;
+    size_t cache_size = 0;
+    gboolean resample = FALSE;
+    void *cache_mapping = cacheable ? cbox_preload_cache_map(canonical, &source_st, &cache_hdr, &cache_size) : NULL;
+    if (cache_mapping)
+    {
+        waveform->info.frames = cache_hdr.frames;
+        waveform->info.samplerate = cache_hdr.samplerate;
+        waveform->info.channels = cache_hdr.channels;
+        waveform->info.format = cache_hdr.format;
+        waveform->info.sections = cache_hdr.sections;
+        waveform->info.seekable = cache_hdr.seekable;
     }
     else
-        sndfile = sf_open(pathname, SFM_READ, &waveform->info);
-    if (!sndfile)
     {
-        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno (errno), "%s: cannot open '%s'", context_name, pathname);
-        g_free(pathname);
-        g_free(canonical);
-        free(waveform);
-        return NULL;
-    }
+        if (taritem)
+            sndfile = cbox_tarfile_opensndfile(tarfile, taritem, &waveform->sndstream, &waveform->info);
+        else if (!tarfile)
+            sndfile = sf_open(pathname, SFM_READ, &waveform->info);
+        if (!sndfile)
+        {
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno (errno), "%s: cannot open '%s'", context_name, pathname);
+            g_free(pathname);
+            g_free(canonical);
+            free(waveform);
+            return NULL;
+        }
 
-    SF_INSTRUMENT instrument;
-    int nshorts;
-    if (waveform->info.channels != 1 && waveform->info.channels != 2)
-    {
-        g_set_error(error, CBOX_WAVEFORM_ERROR, CBOX_WAVEFORM_ERROR_FAILED, 
-            "%s: cannot open file '%s': unsupported channel count %d", context_name, pathname, (int)waveform->info.channels);
-        sf_close(sndfile);
-        free(canonical);
-        g_free(pathname);
-        return NULL;
+        if (waveform->info.channels != 1 && waveform->info.channels != 2)
+        {
+            g_set_error(error, CBOX_WAVEFORM_ERROR, CBOX_WAVEFORM_ERROR_FAILED, 
+                "%s: cannot open file '%s': unsupported channel count %d", context_name, pathname, (int)waveform->info.channels);
+            sf_close(sndfile);
+            free(canonical);
+            g_free(pathname);
+            return NULL;
+        }
     }
     g_free(pathname);
-    uint32_t preloaded_frames = waveform->info.frames;
-    // If sample is larger than 2x prefetch buffer size, then load only
-    // a prefetch buffer worth of data, and stream the rest.
-    if (preloaded_frames > 2 * bank.streaming_prefetch_size)
-        preloaded_frames = bank.streaming_prefetch_size;
-    waveform->id = ++bank.serial_no;
-    waveform->bytes = waveform->info.channels * 2 * preloaded_frames;
-    waveform->data = malloc(waveform->bytes);
+    uint32_t preloaded_frames = cbox_wavebank_get_preload_frames(waveform->info.frames);
+    waveform->format = cbox_wavebank_choose_format(waveform->info.format);
+    waveform->frame_size = waveform->info.channels * cbox_sample_format_get_size(waveform->format);
+    waveform->bytes = waveform->frame_size * preloaded_frames;
+    waveform->data = NULL;
+    waveform->mapping = NULL;
+    waveform->mapping_size = 0;
     waveform->refcount = 1;
     waveform->canonical_name = canonical;
     waveform->display_name = g_filename_display_name(canonical);
     waveform->has_loop = FALSE;
+    waveform->source_samplerate = 0;
+    waveform->source_frames = 0;
     waveform->levels = NULL;
     waveform->level_count = 0;
     waveform->preloaded_frames = preloaded_frames;
+    waveform->full_preloaded_frames = preloaded_frames;
+    waveform->evicted = FALSE;
+    waveform->warmup_requested = FALSE;
+    waveform->active_voices = 0;
+    waveform->last_used = g_get_monotonic_time();
+    waveform->packed = NULL;
     waveform->tarfile = tarfile;
     waveform->taritem = taritem;
     
-    if (sf_command(sndfile, SFC_GET_INSTRUMENT, &instrument, sizeof(SF_INSTRUMENT)))
+    if (cache_mapping)
     {
-        for (int i = 0; i < instrument.loop_count; i++)
+        waveform->mapping = cache_mapping;
+        waveform->mapping_size = cache_size;
+        waveform->data = (uint8_t *)cache_mapping + cache_hdr.data_offset;
+        waveform->has_loop = cache_hdr.has_loop;
+        waveform->loop_start = cache_hdr.loop_start;
+        waveform->loop_end = cache_hdr.loop_end;
+        __sync_fetch_and_add(&bank.cache_hits, 1);
+    }
+    else
+    {
+        SF_INSTRUMENT instrument;
+        if (sf_command(sndfile, SFC_GET_INSTRUMENT, &instrument, sizeof(SF_INSTRUMENT)))
         {
-            if (instrument.loops[i].mode == SF_LOOP_FORWARD)
+            for (int i = 0; i < instrument.loop_count; i++)
             {
-                waveform->loop_start = instrument.loops[i].start;
-                waveform->loop_end = instrument.loops[i].end;
-                waveform->has_loop = TRUE;
-                break;
+                if (instrument.loops[i].mode == SF_LOOP_FORWARD)
+                {
+                    waveform->loop_start = instrument.loops[i].start;
+                    waveform->loop_end = instrument.loops[i].end;
+                    waveform->has_loop = TRUE;
+                    break;
+                }
             }
         }
-    }
 
-    nshorts = waveform->info.channels * preloaded_frames;
-    for (uint32_t i = 0; i < nshorts; i++)
-        waveform->data[i] = 0;
-    sf_readf_short(sndfile, waveform->data, preloaded_frames);
-    sf_close(sndfile);
+        resample = cbox_wavebank_should_resample(waveform->info.samplerate, waveform->info.frames, waveform->has_loop);
+        // only int16 data can be used directly
+        if (bank.mmap_samples && waveform->format == csf_int16 && !resample)
+        {
+            if (taritem)
+                cbox_waveform_map(waveform, tarfile->fd, taritem->offset, taritem->size);
+            else
+            {
+                int fd = open(canonical, O_RDONLY);
+                struct stat st;
+                if (fd != -1)
+                {
+                    if (!fstat(fd, &st))
+                        cbox_waveform_map(waveform, fd, 0, st.st_size);
+                    // the mapping stays valid after the descriptor is closed
+                    close(fd);
+                }
+            }
+        }
+    }
+    if (waveform->mapping)
+        __sync_fetch_and_add(&bank.mapped_bytes, waveform->bytes);
+    else
+    {
+        waveform->data = calloc(1, waveform->bytes);
+        cbox_waveform_read_frames(sndfile, waveform->format, waveform->info.channels, waveform->data, preloaded_frames);
+        // Files mapped directly don't need decoding, so there is nothing
+        // to gain from caching them. Converted samples aren't cached either,
+        // the entries only describe the source file.
+        if (resample)
+            cbox_waveform_resample(waveform, bank.resample_rate);
+        else if (cacheable)
+        {
+            cbox_preload_cache_store(waveform, &source_st);
+            __sync_fetch_and_add(&bank.cache_misses, 1);
+        }
+        if (bank.compress_samples)
+            cbox_waveform_pack(waveform);
+    }
+    if (sndfile)
+        sf_close(sndfile);
+    pthread_mutex_lock(&bank.lock);
+    // Another thread may have loaded the same file in the meantime
+    existing = g_hash_table_lookup(bank.waveforms_by_name, canonical);
+    if (existing)
+    {
+        cbox_waveform_ref(existing);
+        pthread_mutex_unlock(&bank.lock);
+        if (waveform->mapping)
+        {
+            munmap(waveform->mapping, waveform->mapping_size);
+            __sync_fetch_and_sub(&bank.mapped_bytes, waveform->bytes);
+        }
+        else
+            free(waveform->data);
+        if (waveform->packed)
+        {
+            __sync_fetch_and_sub(&bank.packed_bytes, cbox_wavepack_get_bytes(waveform->packed));
+            cbox_wavepack_destroy(waveform->packed);
+        }
+        g_free(waveform->display_name);
+        g_free(waveform->canonical_name);
+        free(waveform);
+        return existing;
+    }
+    waveform->id = ++bank.serial_no;
     bank.bytes += waveform->bytes;
     if (bank.bytes > bank.maxbytes)
         bank.maxbytes = bank.bytes;
     g_hash_table_insert(bank.waveforms_by_name, waveform->canonical_name, waveform);
     g_hash_table_insert(bank.waveforms_by_id, &waveform->id, waveform);
+    cbox_wavebank_make_room(0, waveform);
+    pthread_mutex_unlock(&bank.lock);
     
     return waveform;
 }
 
+struct wavebank_preload_state
+{
+    const char *context_name;
+    struct cbox_tarfile *tarfile;
+    const char *sample_dir;
+    GPtrArray *filenames, *waveforms;
+    int done;
+    void (*progress)(void *user_data, int done, int total);
+    void *user_data;
+};
+
+static void wavebank_preload_task(void *user_data, int task, int worker)
+{
+    struct wavebank_preload_state *ps = user_data;
+    GError *error = NULL;
+    // Failures are not reported here - the caller will get the same error
+    // when binding the region to the file
+    g_ptr_array_index(ps->waveforms, task) = cbox_wavebank_get_waveform(ps->context_name, ps->tarfile, ps->sample_dir, g_ptr_array_index(ps->filenames, task), &error);
+    g_clear_error(&error);
+    int done = __sync_add_and_fetch(&ps->done, 1);
+    // The progress callback is only ever called from the calling thread
+    if (worker == 0 && ps->progress)
+        ps->progress(ps->user_data, done, ps->filenames->len);
+}
+
+GPtrArray *cbox_wavebank_preload_waveforms(const char *context_name, struct cbox_tarfile *tarfile, const char *sample_dir, GPtrArray *filenames, void (*progress)(void *user_data, int done, int total), void *user_data)
+{
+    struct wavebank_preload_state ps = { .context_name = context_name, .tarfile = tarfile, .sample_dir = sample_dir, .done = 0, .progress = progress, .user_data = user_data };
+    // The same file is often used by many regions
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    ps.filenames = g_ptr_array_new();
+    for (guint i = 0; i < filenames->len; i++)
+    {
+        const char *filename = g_ptr_array_index(filenames, i);
+        if (filename && !g_hash_table_lookup(seen, filename))
+        {
+            g_hash_table_insert(seen, (gpointer)filename, (gpointer)filename);
+            g_ptr_array_add(ps.filenames, (gpointer)filename);
+        }
+    }
+    g_hash_table_destroy(seen);
+    ps.waveforms = g_ptr_array_sized_new(ps.filenames->len);
+    g_ptr_array_set_size(ps.waveforms, ps.filenames->len);
+
+    struct cbox_worker_pool *pool = NULL;
+    int threads = bank.load_threads;
+    if (threads > CBOX_WORKER_POOL_MAX_THREADS + 1)
+        threads = CBOX_WORKER_POOL_MAX_THREADS + 1;
+    if (threads > 1 && ps.filenames->len > 1)
+    {
+        GError *error = NULL;
+        pool = cbox_worker_pool_new(threads - 1, 0, &error);
+        if (!pool)
+        {
+            g_warning("Cannot create sample loader threads, loading serially: %s", error ? error->message : "unknown error");
+            g_clear_error(&error);
+        }
+    }
+    if (pool)
+    {
+        cbox_worker_pool_run(pool, wavebank_preload_task, &ps, ps.filenames->len);
+        cbox_worker_pool_destroy(pool);
+    }
+    else
+    {
+        for (guint i = 0; i < ps.filenames->len; i++)
+            wavebank_preload_task(&ps, i, 0);
+    }
+    if (progress)
+        progress(user_data, ps.done, ps.filenames->len);
+
+    g_ptr_array_free(ps.filenames, TRUE);
+    return ps.waveforms;
+}
+
+void cbox_wavebank_release_waveforms(GPtrArray *waveforms)
+{
+    for (guint i = 0; i < waveforms->len; i++)
+    {
+        struct cbox_waveform *waveform = g_ptr_array_index(waveforms, i);
+        if (waveform)
+            cbox_waveform_unref(waveform);
+    }
+    g_ptr_array_free(waveforms, TRUE);
+}
+
 int64_t cbox_wavebank_get_bytes()
 {
     return bank.bytes;
@@ -396,6 +1302,11 @@ int64_t cbox_wavebank_get_maxbytes()
     return bank.maxbytes;
 }
 
+struct cbox_prefetch_service *cbox_wavebank_get_prefetch_service()
+{
+    return bank.prefetch_service;
+}
+
 int cbox_wavebank_get_count()
 {
     return g_hash_table_size(bank.waveforms_by_id);
@@ -420,6 +1331,13 @@ void cbox_wavebank_foreach(void (*cb)(void *, struct cbox_waveform *), void *use
 
 void cbox_wavebank_close()
 {
+    if (bank.prefetch_service)
+    {
+        cbox_prefetch_service_destroy(bank.prefetch_service);
+        bank.prefetch_service = NULL;
+    }
+    g_free(bank.preload_cache_dir);
+    bank.preload_cache_dir = NULL;
     if (bank.bytes > 0)
         g_warning("Warning: %lld bytes in unfreed samples", (long long int)bank.bytes);
     while(bank.std_waveforms)
@@ -431,6 +1349,8 @@ void cbox_wavebank_close()
     g_hash_table_destroy(bank.waveforms_by_name);
     bank.waveforms_by_id = NULL;
     bank.waveforms_by_name = NULL;
+    pthread_cond_destroy(&bank.warmup_done);
+    pthread_mutex_destroy(&bank.lock);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -445,16 +1365,31 @@ void cbox_waveform_unref(struct cbox_waveform *waveform)
     if (--waveform->refcount > 0)
         return;
     
+    pthread_mutex_lock(&bank.lock);
+    while(bank.warmup_busy == waveform)
+        pthread_cond_wait(&bank.warmup_done, &bank.lock);
     g_hash_table_remove(bank.waveforms_by_name, waveform->canonical_name);
     g_hash_table_remove(bank.waveforms_by_id, &waveform->id);
     bank.bytes -= waveform->bytes;
+    pthread_mutex_unlock(&bank.lock);
 
     g_free(waveform->display_name);
     g_free(waveform->canonical_name);
     for (int i = 0; i < waveform->level_count; i++)
         free(waveform->levels[i].data);
     free(waveform->levels);
-    free(waveform->data);
+    if (waveform->mapping)
+    {
+        munmap(waveform->mapping, waveform->mapping_size);
+        __sync_fetch_and_sub(&bank.mapped_bytes, waveform->bytes);
+    }
+    else
+        free(waveform->data);
+    if (waveform->packed)
+    {
+        __sync_fetch_and_sub(&bank.packed_bytes, cbox_wavepack_get_bytes(waveform->packed));
+        cbox_wavepack_destroy(waveform->packed);
+    }
     free(waveform);
     
 }
@@ -485,7 +1420,20 @@ static gboolean waves_process_cmd(struct cbox_command_target *ct, struct cbox_co
         // XXXKF this only supports 4GB - not a big deal for now yet?
         return cbox_execute_on(fb, NULL, "/bytes", "i", error, (int)cbox_wavebank_get_bytes()) &&
             cbox_execute_on(fb, NULL, "/max_bytes", "i", error, (int)cbox_wavebank_get_maxbytes()) &&
-            cbox_execute_on(fb, NULL, "/count", "i", error, (int)cbox_wavebank_get_count())
+            cbox_execute_on(fb, NULL, "/mapped_bytes", "i", error, (int)bank.mapped_bytes) &&
+            cbox_execute_on(fb, NULL, "/budget", "i", error, (int)bank.preload_budget) &&
+            cbox_execute_on(fb, NULL, "/evictions", "i", error, (int)bank.evictions) &&
+            cbox_execute_on(fb, NULL, "/warmups", "i", error, (int)bank.warmups) &&
+            cbox_execute_on(fb, NULL, "/cache_hits", "i", error, (int)bank.cache_hits) &&
+            cbox_execute_on(fb, NULL, "/cache_misses", "i", error, (int)bank.cache_misses) &&
+            cbox_execute_on(fb, NULL, "/packed_bytes", "i", error, (int)bank.packed_bytes) &&
+            cbox_execute_on(fb, NULL, "/count", "i", error, (int)cbox_wavebank_get_count()) &&
+            cbox_execute_on(fb, NULL, "/stream_pipes", "i", error, cbox_prefetch_service_get_active_pipe_count(bank.prefetch_service)) &&
+            cbox_execute_on(fb, NULL, "/stream_bytes_in_flight", "i", error, (int)cbox_prefetch_service_get_bytes_in_flight(bank.prefetch_service)) &&
+            cbox_execute_on(fb, NULL, "/stream_buffer_bytes", "i", error, (int)cbox_prefetch_service_get_buffer_bytes(bank.prefetch_service)) &&
+            cbox_execute_on(fb, NULL, "/stream_buffer_budget", "i", error, (int)cbox_prefetch_service_get_buffer_budget(bank.prefetch_service)) &&
+            cbox_execute_on(fb, NULL, "/stream_underruns", "i", error, (int)cbox_prefetch_service_get_underrun_count(bank.prefetch_service)) &&
+            cbox_execute_on(fb, NULL, "/stream_buffer_shortages", "i", error, (int)cbox_prefetch_service_get_buffer_shortage_count(bank.prefetch_service))
             ;
     }
     else if (!strcmp(cmd->command, "/list") && !strcmp(cmd->arg_types, ""))
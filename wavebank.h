@@ -25,6 +25,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define MAX_INTERPOLATION_ORDER 3
 
+struct cbox_prefetch_service;
+struct cbox_wavepack;
+
 #define CBOX_WAVEFORM_ERROR cbox_waveform_error_quark()
 
 enum CboxWaveformError
@@ -32,6 +35,24 @@ enum CboxWaveformError
     CBOX_WAVEFORM_ERROR_FAILED,
 };
 
+// Sample formats of waveform data. All of them use the int16 scale, so that
+// the player can treat them the same way: 24-bit samples are packed into
+// 3 bytes (little endian), floats are stored pre-multiplied by 32768.
+enum cbox_sample_format
+{
+    csf_int16,
+    csf_int24,
+    csf_float,
+};
+
+static inline uint32_t cbox_sample_format_get_size(enum cbox_sample_format format)
+{
+    return format == csf_int24 ? 3 : (format == csf_float ? sizeof(float) : sizeof(int16_t));
+}
+
+// Largest frame size in bytes (stereo float)
+#define CBOX_WAVEFORM_MAX_FRAME_SIZE (2 * sizeof(float))
+
 struct cbox_waveform_level
 {
     int16_t *data;
@@ -40,7 +61,10 @@ struct cbox_waveform_level
 
 struct cbox_waveform
 {
-    int16_t *data;
+    // frame_size bytes per frame, in the given format (levels are int16)
+    void *data;
+    enum cbox_sample_format format;
+    uint32_t frame_size;
     SF_INFO info;
     int id;
     int refcount;
@@ -50,26 +74,88 @@ struct cbox_waveform
     gchar *display_name;
     gboolean has_loop;
     uint32_t loop_start, loop_end;
+    // With [streaming] resample_rate, short samples are converted to that
+    // rate at load time; these are the rate and length of the source file,
+    // source_samplerate is 0 if the data was not converted
+    int source_samplerate;
+    sf_count_t source_frames;
     struct cbox_tarfile *tarfile;
     struct cbox_taritem *taritem;
     struct cbox_tarfile_sndstream sndstream;
+    // set if data points into a read-only mapping of the file
+    void *mapping;
+    size_t mapping_size;
+    // With a preload budget, the preloaded part of a waveform that hasn't
+    // been played recently may be cut down to a short head (evicted), and
+    // read back in the background, a chunk at a time, when a voice uses it
+    // again. full_preloaded_frames is the size before eviction.
+    size_t full_preloaded_frames;
+    gboolean evicted;
+    volatile gboolean warmup_requested;
+    int active_voices;
+    gint64 last_used;
+    // With [streaming] compress_samples, the whole sample is kept in
+    // compressed form and only a short head stays in data; the rest is
+    // decoded by the prefetch pipes, like a streamed file
+    struct cbox_wavepack *packed;
     
     struct cbox_waveform_level *levels;
     int level_count;
 };
 
+// Converts a position in the source file (as used in SFZ opcodes) to
+// a frame index in the waveform's data
+static inline uint32_t cbox_waveform_map_position(const struct cbox_waveform *waveform, uint32_t pos)
+{
+    if (!waveform->source_samplerate || pos == (uint32_t)-1)
+        return pos;
+    return (uint32_t)(pos * (double)waveform->info.samplerate / waveform->source_samplerate + 0.5);
+}
+
+static inline sf_count_t cbox_waveform_get_source_frames(const struct cbox_waveform *waveform)
+{
+    return waveform->source_samplerate ? waveform->source_frames : waveform->info.frames;
+}
+
 extern struct cbox_command_target cbox_waves_cmd_target;
 
 extern void cbox_wavebank_init(void);
 extern struct cbox_waveform *cbox_wavebank_get_waveform(const char *context_name, struct cbox_tarfile *tf, const char *sample_dir, const char *filename, GError **error);
+// Loads all the listed files, using up to [streaming] load_threads threads,
+// and returns an array of references (NULL for files that failed to load)
+// that keep them in the bank until released.
+extern GPtrArray *cbox_wavebank_preload_waveforms(const char *context_name, struct cbox_tarfile *tf, const char *sample_dir, GPtrArray *filenames, void (*progress)(void *user_data, int done, int total), void *user_data);
+extern void cbox_wavebank_release_waveforms(GPtrArray *waveforms);
 extern struct cbox_waveform *cbox_wavebank_peek_waveform_by_id(int id);
 extern void cbox_wavebank_foreach(void (*cb)(void *user_data, struct cbox_waveform *waveform), void *user_data);
 extern void cbox_wavebank_add_std_waveform(const char *name, float (*getfunc)(float v, void *user_data), void *user_data, int levels);
 extern int cbox_wavebank_get_count(void);
 extern int64_t cbox_wavebank_get_bytes(void);
 extern int64_t cbox_wavebank_get_maxbytes(void);
+extern struct cbox_prefetch_service *cbox_wavebank_get_prefetch_service(void);
+extern void cbox_waveform_request_warmup(struct cbox_waveform *waveform);
+extern sf_count_t cbox_waveform_read_frames(SNDFILE *sndfile, enum cbox_sample_format format, int channels, void *dest, sf_count_t frames);
+extern gboolean cbox_waveform_find_pcm16_data(int fd, uint64_t offset, uint64_t size, SF_INFO *info, uint64_t *data_offset);
 extern void cbox_wavebank_close(void);
 
+// Called by the RT thread when a voice starts using the waveform; returns the
+// number of preloaded frames the voice can rely on until it calls
+// cbox_waveform_release.
+static inline uint32_t cbox_waveform_acquire(struct cbox_waveform *waveform)
+{
+    // the full barrier pairs with the one in cbox_waveform_evict
+    __sync_fetch_and_add(&waveform->active_voices, 1);
+    waveform->last_used = g_get_monotonic_time();
+    if (waveform->evicted && !waveform->warmup_requested)
+        cbox_waveform_request_warmup(waveform);
+    return waveform->preloaded_frames;
+}
+
+static inline void cbox_waveform_release(struct cbox_waveform *waveform)
+{
+    __sync_fetch_and_sub(&waveform->active_voices, 1);
+}
+
 extern void cbox_waveform_ref(struct cbox_waveform *waveform);
 extern void cbox_waveform_unref(struct cbox_waveform *waveform);
 
@@ -0,0 +1,188 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "wavepack.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LANE_VALUES (CBOX_WAVEPACK_BLOCK_FRAMES / CBOX_WAVEPACK_LANES)
+
+typedef uint32_t wavepack_v4su __attribute__((vector_size(16)));
+
+static inline uint32_t zigzag_encode(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// Packs CBOX_WAVEPACK_BLOCK_FRAMES values of the given width into
+// LANE_VALUES * bits / 32 vectors of words; value i goes to lane i % 4.
+static void wavepack_pack(const uint32_t *values, int bits, uint32_t *words)
+{
+    for (int k = 0; k < CBOX_WAVEPACK_LANES; k++)
+    {
+        uint64_t acc = 0;
+        int used = 0, w = 0;
+        for (int i = 0; i < LANE_VALUES; i++)
+        {
+            acc |= (uint64_t)values[i * CBOX_WAVEPACK_LANES + k] << used;
+            used += bits;
+            if (used >= 32)
+            {
+                words[w++ * CBOX_WAVEPACK_LANES + k] = (uint32_t)acc;
+                acc >>= 32;
+                used -= 32;
+            }
+        }
+        // LANE_VALUES is a multiple of 32, so nothing is left over
+    }
+}
+
+// Inverse of wavepack_pack, including the zigzag decoding. Works on 4 lanes
+// at a time.
+static void wavepack_unpack(const uint32_t *words, int bits, int32_t *values)
+{
+    if (!bits)
+    {
+        memset(values, 0, CBOX_WAVEPACK_BLOCK_FRAMES * sizeof(int32_t));
+        return;
+    }
+    wavepack_v4su mask = {0, 0, 0, 0};
+    mask += (uint32_t)((1ULL << bits) - 1);
+    wavepack_v4su cur, one = {1, 1, 1, 1};
+    int used = 0, w = 0;
+    memcpy(&cur, words, sizeof(cur));
+    for (int i = 0; i < LANE_VALUES; i++)
+    {
+        wavepack_v4su val = cur >> used;
+        used += bits;
+        if (used >= 32 && i < LANE_VALUES - 1)
+        {
+            used -= 32;
+            memcpy(&cur, words + ++w * CBOX_WAVEPACK_LANES, sizeof(cur));
+            if (used)
+                val |= cur << (bits - used);
+        }
+        val &= mask;
+        val = (val >> 1) ^ -(val & one);
+        memcpy(values + i * CBOX_WAVEPACK_LANES, &val, sizeof(val));
+    }
+}
+
+struct cbox_wavepack *cbox_wavepack_new(const int16_t *data, uint32_t frames, int channels)
+{
+    struct cbox_wavepack *pack = calloc(1, sizeof(struct cbox_wavepack));
+    pack->frames = frames;
+    pack->channels = channels;
+    pack->block_count = (frames + CBOX_WAVEPACK_BLOCK_FRAMES - 1) / CBOX_WAVEPACK_BLOCK_FRAMES;
+    pack->blocks = calloc(pack->block_count * channels, sizeof(struct cbox_wavepack_block));
+    
+    // worst case is 17 bits per value (a full scale difference)
+    size_t max_words = (size_t)pack->block_count * channels * (CBOX_WAVEPACK_BLOCK_FRAMES * 17 / 32);
+    uint32_t *words = malloc(max_words * sizeof(uint32_t));
+    uint32_t values[CBOX_WAVEPACK_BLOCK_FRAMES];
+    size_t word_count = 0;
+    for (uint32_t b = 0; b < pack->block_count; b++)
+    {
+        uint32_t start = b * CBOX_WAVEPACK_BLOCK_FRAMES;
+        uint32_t len = frames - start < CBOX_WAVEPACK_BLOCK_FRAMES ? frames - start : CBOX_WAVEPACK_BLOCK_FRAMES;
+        for (int c = 0; c < channels; c++)
+        {
+            struct cbox_wavepack_block *blk = &pack->blocks[b * channels + c];
+            const int16_t *src = data + start * channels + c;
+            uint32_t all = 0;
+            // the padding repeats the last sample, i.e. has zero differences
+            values[0] = 0;
+            for (uint32_t i = 1; i < CBOX_WAVEPACK_BLOCK_FRAMES; i++)
+            {
+                values[i] = i < len ? zigzag_encode(src[i * channels] - src[(i - 1) * channels]) : 0;
+                all |= values[i];
+            }
+            int bits = 0;
+            while(bits < 32 && (all >> bits))
+                bits++;
+            blk->first = src[0];
+            blk->bits = bits;
+            blk->offset = word_count;
+            if (bits)
+                wavepack_pack(values, bits, words + word_count);
+            word_count += LANE_VALUES * bits / 32 * CBOX_WAVEPACK_LANES;
+        }
+    }
+    pack->word_count = word_count;
+    pack->words = realloc(words, (word_count ? word_count : 1) * sizeof(uint32_t));
+    return pack;
+}
+
+size_t cbox_wavepack_get_bytes(const struct cbox_wavepack *pack)
+{
+    return pack->word_count * sizeof(uint32_t) + pack->block_count * pack->channels * sizeof(struct cbox_wavepack_block);
+}
+
+void cbox_wavepack_decode_block(const struct cbox_wavepack *pack, uint32_t block, int16_t *dest)
+{
+    int32_t deltas[CBOX_WAVEPACK_BLOCK_FRAMES] __attribute__((aligned(16)));
+    int channels = pack->channels;
+    for (int c = 0; c < channels; c++)
+    {
+        const struct cbox_wavepack_block *blk = &pack->blocks[block * channels + c];
+        wavepack_unpack(pack->words + blk->offset, blk->bits, deltas);
+        int32_t value = blk->first;
+        dest[c] = value;
+        for (int i = 1; i < CBOX_WAVEPACK_BLOCK_FRAMES; i++)
+        {
+            value += deltas[i];
+            dest[i * channels + c] = (int16_t)value;
+        }
+    }
+}
+
+uint32_t cbox_wavepack_read(const struct cbox_wavepack *pack, int16_t *dest, uint32_t pos, uint32_t frames, int16_t *scratch)
+{
+    if (pos >= pack->frames)
+        return 0;
+    if (frames > pack->frames - pos)
+        frames = pack->frames - pos;
+    int channels = pack->channels;
+    uint32_t done = 0;
+    while(done < frames)
+    {
+        uint32_t block = pos / CBOX_WAVEPACK_BLOCK_FRAMES;
+        uint32_t ofs = pos % CBOX_WAVEPACK_BLOCK_FRAMES;
+        uint32_t len = CBOX_WAVEPACK_BLOCK_FRAMES - ofs;
+        if (len > frames - done)
+            len = frames - done;
+        if (len == CBOX_WAVEPACK_BLOCK_FRAMES)
+            cbox_wavepack_decode_block(pack, block, dest);
+        else
+        {
+            cbox_wavepack_decode_block(pack, block, scratch);
+            memcpy(dest, scratch + ofs * channels, len * channels * sizeof(int16_t));
+        }
+        dest += len * channels;
+        pos += len;
+        done += len;
+    }
+    return done;
+}
+
+void cbox_wavepack_destroy(struct cbox_wavepack *pack)
+{
+    free(pack->words);
+    free(pack->blocks);
+    free(pack);
+}
@@ -0,0 +1,65 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CBOX_WAVEPACK_H
+#define CBOX_WAVEPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Losslessly compressed int16 sample data. The data is split into blocks of
+// CBOX_WAVEPACK_BLOCK_FRAMES frames that can be decoded independently. Each
+// channel of a block is stored as its first sample, followed by the
+// differences between consecutive samples, bit-packed with the smallest
+// width that fits the whole block. The packed values are interleaved
+// between 4 lanes of 32-bit words, so that the decoder can extract 4 values
+// at a time with vector shifts.
+#define CBOX_WAVEPACK_BLOCK_FRAMES 1024
+#define CBOX_WAVEPACK_LANES 4
+
+struct cbox_wavepack_block
+{
+    // start of the packed stream, in 32-bit words
+    uint32_t offset;
+    int16_t first;
+    uint8_t bits;
+};
+
+struct cbox_wavepack
+{
+    uint32_t frames;
+    int channels;
+    uint32_t block_count;
+    // block_count * channels entries, channel-interleaved
+    struct cbox_wavepack_block *blocks;
+    uint32_t *words;
+    size_t word_count;
+};
+
+extern struct cbox_wavepack *cbox_wavepack_new(const int16_t *data, uint32_t frames, int channels);
+extern size_t cbox_wavepack_get_bytes(const struct cbox_wavepack *pack);
+// Decodes a whole block into dest (interleaved, CBOX_WAVEPACK_BLOCK_FRAMES
+// frames; the last block is padded with its last sample)
+extern void cbox_wavepack_decode_block(const struct cbox_wavepack *pack, uint32_t block, int16_t *dest);
+// Decodes up to frames frames starting at pos into dest (interleaved), using
+// scratch (one block worth of frames) for partial blocks. Returns the number
+// of frames decoded.
+extern uint32_t cbox_wavepack_read(const struct cbox_wavepack *pack, int16_t *dest, uint32_t pos, uint32_t frames, int16_t *scratch);
+extern void cbox_wavepack_destroy(struct cbox_wavepack *pack);
+
+#endif
@@ -0,0 +1,159 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Self-check of the sample compression in wavepack.c. Signals of different
+// kinds (silence, quiet noise, a sine, full scale jumps needing 17-bit
+// deltas) and lengths (shorter than a block, exact blocks, a partial last
+// block) are packed as mono and stereo, then read back whole, block by block
+// and at random positions and lengths, and must match the input exactly.
+// Returns a non-zero exit code on mismatch.
+// Not built by default, use "make wavepackcheck".
+
+#include "wavepack.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_READS 2000
+
+enum signal_kind
+{
+    sk_silence,
+    sk_noise,
+    sk_sine,
+    sk_full_scale,
+    sk_count
+};
+
+static const char *signal_names[sk_count] = { "silence", "noise", "sine", "full scale" };
+
+static uint32_t seed = 1;
+
+static int rnd(int range)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % range;
+}
+
+static void generate(int16_t *data, uint32_t frames, int channels, enum signal_kind kind)
+{
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            int16_t value = 0;
+            switch(kind)
+            {
+            case sk_silence:
+                value = 0;
+                break;
+            case sk_noise:
+                value = rnd(64) - 32;
+                break;
+            case sk_sine:
+                value = (int16_t)(30000 * sin(i * (0.01 + 0.003 * c)));
+                break;
+            case sk_full_scale:
+                // mostly the extremes, so that the deltas use all 17 bits
+                value = rnd(4) ? ((i + c) & 1 ? 32767 : -32768) : rnd(65536) - 32768;
+                break;
+            default:
+                break;
+            }
+            data[i * channels + c] = value;
+        }
+    }
+}
+
+static int check_pack(const int16_t *data, uint32_t frames, int channels, enum signal_kind kind)
+{
+    struct cbox_wavepack *pack = cbox_wavepack_new(data, frames, channels);
+    int16_t *out = malloc((frames + CBOX_WAVEPACK_BLOCK_FRAMES) * channels * sizeof(int16_t));
+    int16_t *block = malloc(CBOX_WAVEPACK_BLOCK_FRAMES * channels * sizeof(int16_t));
+    int16_t *scratch = malloc(CBOX_WAVEPACK_BLOCK_FRAMES * channels * sizeof(int16_t));
+    int errors = 0;
+
+    // the whole waveform, from a partial first block
+    uint32_t first = frames > 1 ? 1 : 0;
+    if (cbox_wavepack_read(pack, out, first, frames, scratch) != frames - first ||
+        memcmp(out, data + first * channels, (frames - first) * channels * sizeof(int16_t)))
+        errors++;
+    if (cbox_wavepack_read(pack, out, 0, frames, scratch) != frames ||
+        memcmp(out, data, frames * channels * sizeof(int16_t)))
+        errors++;
+
+    // whole blocks, including the padding of the last one
+    for (uint32_t b = 0; b < pack->block_count; b++)
+    {
+        uint32_t start = b * CBOX_WAVEPACK_BLOCK_FRAMES;
+        cbox_wavepack_decode_block(pack, b, block);
+        for (uint32_t i = 0; i < CBOX_WAVEPACK_BLOCK_FRAMES; i++)
+        {
+            uint32_t src = start + i < frames ? start + i : frames - 1;
+            if (memcmp(block + i * channels, data + src * channels, channels * sizeof(int16_t)))
+            {
+                errors++;
+                break;
+            }
+        }
+    }
+
+    // random reads, some of them past the end
+    for (int r = 0; r < CHECK_READS; r++)
+    {
+        uint32_t pos = rnd(frames + 16);
+        uint32_t len = rnd(3 * CBOX_WAVEPACK_BLOCK_FRAMES);
+        if (len > frames)
+            len = frames;
+        uint32_t expected = pos >= frames ? 0 : (len < frames - pos ? len : frames - pos);
+        if (cbox_wavepack_read(pack, out, pos, len, scratch) != expected ||
+            memcmp(out, data + pos * channels, expected * channels * sizeof(int16_t)))
+            errors++;
+    }
+
+    printf("%-10s %d ch %6u frames, %6u bytes packed: %s\n", signal_names[kind], channels, frames,
+        (unsigned)cbox_wavepack_get_bytes(pack), errors ? "FAILED" : "OK");
+    free(scratch);
+    free(block);
+    free(out);
+    cbox_wavepack_destroy(pack);
+    return errors;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t lengths[] = { 1, 100, CBOX_WAVEPACK_BLOCK_FRAMES - 1, CBOX_WAVEPACK_BLOCK_FRAMES, CBOX_WAVEPACK_BLOCK_FRAMES + 1, 5 * CBOX_WAVEPACK_BLOCK_FRAMES, 5 * CBOX_WAVEPACK_BLOCK_FRAMES + 333 };
+    int errors = 0;
+
+    for (int channels = 1; channels <= 2; channels++)
+    {
+        for (int kind = 0; kind < sk_count; kind++)
+        {
+            for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+            {
+                int16_t *data = malloc(lengths[l] * channels * sizeof(int16_t));
+                generate(data, lengths[l], channels, kind);
+                errors += check_pack(data, lengths[l], channels, kind);
+                free(data);
+            }
+        }
+    }
+    printf("%s\n", errors ? "FAILED" : "OK");
+    return errors ? 1 : 0;
+}
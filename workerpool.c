@@ -0,0 +1,216 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "errors.h"
+#include "workerpool.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Number of polls of the finished thread count before the calling thread
+// goes to sleep; the tasks are usually short, so most of the time the
+// workers finish within the spin
+#define WORKER_POOL_SPIN_COUNT 2000
+
+struct cbox_worker_thread
+{
+    struct cbox_worker_pool *pool;
+    int index;
+    pthread_t thread;
+    sem_t sem_start;
+};
+
+struct cbox_worker_pool
+{
+    int thread_count;
+    struct cbox_worker_thread threads[CBOX_WORKER_POOL_MAX_THREADS];
+
+    // state of the current run, written by the calling thread before waking
+    // up the workers
+    cbox_worker_task_func func;
+    void *user_data;
+    int task_count;
+    volatile int next_task;
+    volatile int threads_finished;
+    // set by the calling thread before it sleeps on threads_finished
+    volatile int caller_waiting;
+    volatile gboolean terminate;
+};
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline void futex_wait(volatile int *addr, int value)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline void futex_wake(volatile int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void worker_pool_run_tasks(struct cbox_worker_pool *pool, int worker)
+{
+    int task;
+    while((task = __sync_fetch_and_add(&pool->next_task, 1)) < pool->task_count)
+        pool->func(pool->user_data, task, worker);
+}
+
+static void *worker_thread_func(void *user_data)
+{
+    struct cbox_worker_thread *wt = user_data;
+    struct cbox_worker_pool *pool = wt->pool;
+
+    while(1)
+    {
+        while(sem_wait(&wt->sem_start) == -1 && errno == EINTR)
+            ;
+        if (pool->terminate)
+            break;
+        worker_pool_run_tasks(pool, wt->index);
+        __sync_fetch_and_add(&pool->threads_finished, 1);
+        if (pool->caller_waiting)
+            futex_wake(&pool->threads_finished);
+    }
+    return NULL;
+}
+
+static int worker_thread_start(struct cbox_worker_thread *wt, int rt_priority)
+{
+    if (rt_priority > 0)
+    {
+        pthread_attr_t attr;
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = rt_priority;
+        pthread_attr_init(&attr);
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+        int result = pthread_create(&wt->thread, &attr, worker_thread_func, wt);
+        pthread_attr_destroy(&attr);
+        // Not falling back to normal priority here - the RT thread waits for
+        // the workers, so a worker preempted by anything else would make the
+        // RT thread miss its deadline
+        return result;
+    }
+    return pthread_create(&wt->thread, NULL, worker_thread_func, wt);
+}
+
+struct cbox_worker_pool *cbox_worker_pool_new(int thread_count, int rt_priority, GError **error)
+{
+    if (thread_count < 1 || thread_count > CBOX_WORKER_POOL_MAX_THREADS)
+    {
+        g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_OUT_OF_RANGE, "Invalid worker thread count %d (must be between 1 and %d)", thread_count, CBOX_WORKER_POOL_MAX_THREADS);
+        return NULL;
+    }
+    struct cbox_worker_pool *pool = calloc(1, sizeof(struct cbox_worker_pool));
+    pool->terminate = FALSE;
+    for (int i = 0; i < thread_count; i++)
+    {
+        struct cbox_worker_thread *wt = &pool->threads[i];
+        wt->pool = pool;
+        wt->index = i + 1;
+        sem_init(&wt->sem_start, 0, 0);
+        int result = worker_thread_start(wt, rt_priority);
+        if (result)
+        {
+            if (rt_priority > 0)
+                g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Cannot create a worker thread with realtime priority %d: %s (use priority 0 for normal priority threads)", rt_priority, strerror(result));
+            else
+                g_set_error(error, CBOX_MODULE_ERROR, CBOX_MODULE_ERROR_FAILED, "Cannot create a worker thread: %s", strerror(result));
+            sem_destroy(&wt->sem_start);
+            cbox_worker_pool_destroy(pool);
+            return NULL;
+        }
+        pool->thread_count = i + 1;
+    }
+    return pool;
+}
+
+void cbox_worker_pool_run(struct cbox_worker_pool *pool, cbox_worker_task_func func, void *user_data, int task_count)
+{
+    // there is no point waking up more threads than there are tasks to share
+    int wake_count = task_count - 1;
+    if (wake_count > pool->thread_count)
+        wake_count = pool->thread_count;
+    if (wake_count <= 0)
+    {
+        for (int i = 0; i < task_count; i++)
+            func(user_data, i, 0);
+        return;
+    }
+    pool->func = func;
+    pool->user_data = user_data;
+    pool->task_count = task_count;
+    pool->next_task = 0;
+    pool->threads_finished = 0;
+    pool->caller_waiting = FALSE;
+    __sync_synchronize();
+    for (int i = 0; i < wake_count; i++)
+        sem_post(&pool->threads[i].sem_start);
+    worker_pool_run_tasks(pool, 0);
+    // All the tasks have been claimed by now, but some may still be running.
+    // Waiting for the threads (and not just the tasks) to finish ensures that
+    // no thread is still looking at the run state when it's reused.
+    for (int spin = 0; spin < WORKER_POOL_SPIN_COUNT && pool->threads_finished < wake_count; spin++)
+        cpu_relax();
+    if (pool->threads_finished < wake_count)
+    {
+        // The workers check caller_waiting after incrementing the count, so
+        // either they see it set and wake this thread up, or the count read
+        // below already includes them
+        pool->caller_waiting = TRUE;
+        __sync_synchronize();
+        int finished;
+        while((finished = pool->threads_finished) < wake_count)
+            futex_wait(&pool->threads_finished, finished);
+    }
+    __sync_synchronize();
+}
+
+int cbox_worker_pool_get_thread_count(struct cbox_worker_pool *pool)
+{
+    return pool->thread_count;
+}
+
+void cbox_worker_pool_destroy(struct cbox_worker_pool *pool)
+{
+    pool->terminate = TRUE;
+    __sync_synchronize();
+    for (int i = 0; i < pool->thread_count; i++)
+        sem_post(&pool->threads[i].sem_start);
+    for (int i = 0; i < pool->thread_count; i++)
+    {
+        pthread_join(pool->threads[i].thread, NULL);
+        sem_destroy(&pool->threads[i].sem_start);
+    }
+    free(pool);
+}
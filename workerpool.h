@@ -0,0 +1,51 @@
+/*
+Calf Box, an open source musical instrument.
+Copyright (C) 2010-2013 Krzysztof Foltman
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef CBOX_WORKERPOOL_H
+#define CBOX_WORKERPOOL_H
+
+#include <glib.h>
+
+#define CBOX_WORKER_POOL_MAX_THREADS 16
+#define CBOX_WORKER_POOL_DEFAULT_PRIORITY 70
+
+struct cbox_worker_pool;
+
+// Called for each task of a run; worker is 0 for the calling (RT) thread and
+// 1..thread_count for the pool threads, so that per-worker scratch space can
+// be indexed by it
+typedef void (*cbox_worker_task_func)(void *user_data, int task, int worker);
+
+// Creates a pool of thread_count helper threads, which are given SCHED_FIFO
+// priority rt_priority (use rt_priority <= 0 for normal priority). Fails if
+// realtime scheduling is not permitted, rather than running the workers at
+// a lower priority than the thread that waits for them.
+extern struct cbox_worker_pool *cbox_worker_pool_new(int thread_count, int rt_priority, GError **error);
+// Runs task_count tasks, distributed between the calling thread and the pool
+// threads, and waits for all of them to complete. Tasks are claimed from a
+// shared lock-free counter, so the assignment of tasks to workers is not
+// fixed - the results need to be combined in task order, not worker order,
+// if they are to be deterministic. Does not allocate memory or take locks;
+// the calling thread spins for a short while waiting for the workers, then
+// sleeps on a futex.
+extern void cbox_worker_pool_run(struct cbox_worker_pool *pool, cbox_worker_task_func func, void *user_data, int task_count);
+extern int cbox_worker_pool_get_thread_count(struct cbox_worker_pool *pool);
+extern void cbox_worker_pool_destroy(struct cbox_worker_pool *pool);
+
+#endif